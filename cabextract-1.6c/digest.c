@@ -0,0 +1,900 @@
+/* digest.c - a choice of digests for testing files
+ * (C) 2026 okwkntr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* MD5 comes from md5.c. SHA-256 and CRC32C use the SHA and SSE4.2
+ * instructions on x86 processors that have them, which is checked for
+ * when a digest is first started, and portable code otherwise. XXH3 uses
+ * SSE2 where the compiler can always use it. digest_many() hashes several
+ * whole buffers with MD5 at once, one in each lane of SSE2, AVX2 or
+ * AVX-512 vectors.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "digest.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    HAVE_CPUID_H && HAVE_IMMINTRIN_H
+# include <cpuid.h>
+# include <immintrin.h>
+# define DIGEST_X86 1
+#endif
+
+#if DIGEST_X86 && defined(__SSE2__)
+# define XXH3_SSE2 1
+#endif
+
+/* reads and writes integers of a given byte order, one byte at a time.
+ * compilers turn these into single loads and stores */
+static uint32_t read32le(const unsigned char *p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+    ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t read64le(const unsigned char *p) {
+  return (uint64_t) read32le(p) | ((uint64_t) read32le(p + 4) << 32);
+}
+
+static uint64_t swap64(uint64_t x) {
+  x = ((x & 0x00FF00FF00FF00FFULL) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+  x = ((x & 0x0000FFFF0000FFFFULL) << 16) | ((x >> 16) & 0xFFFF0000FFFFULL);
+  return (x << 32) | (x >> 32);
+}
+
+static uint32_t read32be(const unsigned char *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+    ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static void write32be(unsigned char *p, uint32_t x) {
+  p[0] = (unsigned char) (x >> 24);
+  p[1] = (unsigned char) (x >> 16);
+  p[2] = (unsigned char) (x >> 8);
+  p[3] = (unsigned char) x;
+}
+
+static void write64be(unsigned char *p, uint64_t x) {
+  write32be(p, (uint32_t) (x >> 32));
+  write32be(p + 4, (uint32_t) x);
+}
+
+#if DIGEST_X86
+/* CPU features, found by digest_setup() */
+#define CPU_SSE42   (1)
+#define CPU_SHA     (2)
+#define CPU_SSE2    (4)
+#define CPU_AVX2    (8)
+#define CPU_AVX512  (16)
+static int cpu;
+#endif
+
+static void crc32c_make_table(void);
+
+/* finds the CPU's features and makes the CRC32C tables, once. Digests
+ * are used by more than one thread, so this is done with pthread_once()
+ * where there are threads */
+#if HAVE_PTHREAD_H
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+#else
+static int setup_done = 0;
+#endif
+
+static void digest_setup(void) {
+#if DIGEST_X86
+  unsigned int eax, ebx, ecx, edx, sse41 = 0;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    if (ecx & bit_SSE4_2) cpu |= CPU_SSE42;
+    sse41 = (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+  }
+  if (sse41 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    if (ebx & (1 << 29)) cpu |= CPU_SHA;
+  }
+  /* these also need the OS to save the wider registers */
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))    cpu |= CPU_SSE2;
+  if (__builtin_cpu_supports("avx2"))    cpu |= CPU_AVX2;
+  if (__builtin_cpu_supports("avx512f")) cpu |= CPU_AVX512;
+#endif
+  crc32c_make_table();
+#if !HAVE_PTHREAD_H
+  setup_done = 1;
+#endif
+}
+
+static void digest_once(void) {
+#if HAVE_PTHREAD_H
+  pthread_once(&setup_once, &digest_setup);
+#else
+  if (!setup_done) digest_setup();
+#endif
+}
+
+/* --- SHA-256 ------------------------------------------------------------ */
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks(uint32_t *state, const unsigned char *data,
+                          size_t blocks)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  while (blocks--) {
+    for (i = 0; i < 16; i++) w[i] = read32be(&data[i * 4]);
+    for (i = 16; i < 64; i++) {
+      w[i] = w[i - 16] + w[i - 7] +
+        (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+        (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+      t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+        ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+        ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    data += 64;
+  }
+}
+
+#if DIGEST_X86
+/* the same, with the SHA instructions. The state is kept as ABEF and
+ * CDGH, as the instructions want it, and each pass of the loop does four
+ * rounds, scheduling the message four words at a time */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_sha(uint32_t *state, const unsigned char *data,
+                              size_t blocks)
+{
+  const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                      0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+  int i;
+
+  tmp    = _mm_loadu_si128((const __m128i *) &state[0]);
+  state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+  tmp    = _mm_shuffle_epi32(tmp, 0xB1);          /* CDAB */
+  state1 = _mm_shuffle_epi32(state1, 0x1B);       /* EFGH */
+  state0 = _mm_alignr_epi8(tmp, state1, 8);       /* ABEF */
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);    /* CDGH */
+
+  while (blocks--) {
+    abef = state0;
+    cdgh = state1;
+    for (i = 0; i < 16; i++) {
+      if (i < 4) {
+        msg = _mm_loadu_si128((const __m128i *) &data[i * 16]);
+        w[i] = _mm_shuffle_epi8(msg, swap);
+      }
+      else {
+        /* w[i] = w[i-4] + s0(w[i-3]) + w[i-2..i-1 shifted] + s1(w[i-1]) */
+        tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+        tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) & 3],
+                                                 w[(i + 2) & 3], 4));
+        w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+      }
+      msg = _mm_add_epi32(w[i & 3],
+        _mm_loadu_si128((const __m128i *) &sha256_k[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += 64;
+  }
+
+  tmp    = _mm_shuffle_epi32(state0, 0x1B);       /* FEBA */
+  state1 = _mm_shuffle_epi32(state1, 0xB1);       /* DCHG */
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);    /* DCBA */
+  state1 = _mm_alignr_epi8(state1, tmp, 8);       /* HGFE */
+  _mm_storeu_si128((__m128i *) &state[0], state0);
+  _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+#endif
+
+static void sha256_process(uint32_t *state, const unsigned char *data,
+                           size_t blocks)
+{
+#if DIGEST_X86
+  if (cpu & CPU_SHA) {
+    sha256_blocks_sha(state, data, blocks);
+    return;
+  }
+#endif
+  sha256_blocks(state, data, blocks);
+}
+
+static void sha256_init(struct digest_ctx *ctx) {
+  static const uint32_t init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(ctx->u.sha256.state, init, sizeof(init));
+  ctx->u.sha256.length = 0;
+}
+
+static void sha256_update(struct digest_ctx *ctx, const unsigned char *p,
+                          size_t len)
+{
+  size_t used = (size_t) (ctx->u.sha256.length & 63), n;
+  ctx->u.sha256.length += len;
+
+  if (used) {
+    n = 64 - used;
+    if (len < n) {
+      memcpy(&ctx->u.sha256.buf[used], p, len);
+      return;
+    }
+    memcpy(&ctx->u.sha256.buf[used], p, n);
+    sha256_process(ctx->u.sha256.state, ctx->u.sha256.buf, 1);
+    p += n;
+    len -= n;
+  }
+  if (len >= 64) {
+    sha256_process(ctx->u.sha256.state, p, len / 64);
+    p += len & ~(size_t) 63;
+    len &= 63;
+  }
+  if (len) memcpy(ctx->u.sha256.buf, p, len);
+}
+
+static void sha256_finish(struct digest_ctx *ctx, unsigned char *result) {
+  uint64_t bits = ctx->u.sha256.length * 8;
+  size_t used = (size_t) (ctx->u.sha256.length & 63);
+  unsigned char *buf = ctx->u.sha256.buf;
+  int i;
+
+  buf[used++] = 0x80;
+  if (used > 56) {
+    memset(&buf[used], 0, 64 - used);
+    sha256_process(ctx->u.sha256.state, buf, 1);
+    used = 0;
+  }
+  memset(&buf[used], 0, 56 - used);
+  write64be(&buf[56], bits);
+  sha256_process(ctx->u.sha256.state, buf, 1);
+  for (i = 0; i < 8; i++) write32be(&result[i * 4], ctx->u.sha256.state[i]);
+}
+
+/* --- XXH3 --------------------------------------------------------------- */
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH_SECRET_SIZE  (192)
+#define XXH_STRIPE_LEN   (64)
+#define XXH_STRIPES      ((XXH_SECRET_SIZE - XXH_STRIPE_LEN) / 8)
+#define XXH_BUFFER_SIZE  (256)
+#define XXH_MIDSIZE_MAX  (240)
+
+static const unsigned char xxh_secret[XXH_SECRET_SIZE] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+  0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+  0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+  0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+  0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+  0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+  0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+  0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+  0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+  0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+  0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+  0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+  0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+#define ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t xxh_mul128_fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 product = (unsigned __int128) a * b;
+  return (uint64_t) product ^ (uint64_t) (product >> 64);
+#else
+  uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+  uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+  uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+  uint64_t hi_hi = (a >> 32) * (b >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+  uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+  return lower ^ upper;
+#endif
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+  h ^= h >> 37;
+  h *= XXH_PRIME_MX1;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len) {
+  h ^= ROL64(h, 49) ^ ROL64(h, 24);
+  h *= XXH_PRIME_MX2;
+  h ^= (h >> 35) + len;
+  h *= XXH_PRIME_MX2;
+  return h ^ (h >> 28);
+}
+
+static uint64_t xxh3_mix16(const unsigned char *p, const unsigned char *s) {
+  return xxh_mul128_fold64(read64le(p) ^ read64le(s),
+                           read64le(p + 8) ^ read64le(s + 8));
+}
+
+/* hashes up to XXH_MIDSIZE_MAX bytes in one go */
+static uint64_t xxh3_short(const unsigned char *p, size_t len) {
+  const unsigned char *s = xxh_secret;
+  uint64_t acc, acc_end, lo, hi;
+  uint32_t combined;
+  size_t i;
+
+  if (len == 0) {
+    return xxh64_avalanche(read64le(s + 56) ^ read64le(s + 64));
+  }
+  if (len <= 3) {
+    combined = ((uint32_t) p[0] << 16) | ((uint32_t) p[len >> 1] << 24) |
+      (uint32_t) p[len - 1] | ((uint32_t) len << 8);
+    return xxh64_avalanche((uint64_t) combined ^
+                           (uint64_t) (read32le(s) ^ read32le(s + 4)));
+  }
+  if (len <= 8) {
+    acc = (uint64_t) read32le(p + len - 4) + ((uint64_t) read32le(p) << 32);
+    return xxh3_rrmxmx(acc ^ (read64le(s + 8) ^ read64le(s + 16)), len);
+  }
+  if (len <= 16) {
+    lo = read64le(p) ^ (read64le(s + 24) ^ read64le(s + 32));
+    hi = read64le(p + len - 8) ^ (read64le(s + 40) ^ read64le(s + 48));
+    acc = len + swap64(lo) + hi + xxh_mul128_fold64(lo, hi);
+    return xxh3_avalanche(acc);
+  }
+  acc = len * XXH_PRIME64_1;
+  if (len <= 128) {
+    if (len > 32) {
+      if (len > 64) {
+        if (len > 96) {
+          acc += xxh3_mix16(p + 48, s + 96);
+          acc += xxh3_mix16(p + len - 64, s + 112);
+        }
+        acc += xxh3_mix16(p + 32, s + 64);
+        acc += xxh3_mix16(p + len - 48, s + 80);
+      }
+      acc += xxh3_mix16(p + 16, s + 32);
+      acc += xxh3_mix16(p + len - 32, s + 48);
+    }
+    acc += xxh3_mix16(p, s);
+    acc += xxh3_mix16(p + len - 16, s + 16);
+    return xxh3_avalanche(acc);
+  }
+  for (i = 0; i < 8; i++) acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+  acc_end = xxh3_mix16(p + len - 16, s + 136 - 17);
+  acc = xxh3_avalanche(acc);
+  for (i = 8; i < len / 16; i++) {
+    acc_end += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+  }
+  return xxh3_avalanche(acc + acc_end);
+}
+
+/* adds one stripe of 64 bytes to the accumulators */
+static void xxh3_accumulate(uint64_t *acc, const unsigned char *p,
+                            const unsigned char *s)
+{
+#if XXH3_SSE2
+  __m128i *a = (__m128i *) acc, data, key, dk, product;
+  int i;
+  for (i = 0; i < 4; i++) {
+    data = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+    key  = _mm_loadu_si128((const __m128i *) (s + 16 * i));
+    dk   = _mm_xor_si128(data, key);
+    product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0,3,0,1)));
+    data = _mm_shuffle_epi32(data, _MM_SHUFFLE(1,0,3,2));
+    data = _mm_add_epi64(_mm_loadu_si128(&a[i]), data);
+    _mm_storeu_si128(&a[i], _mm_add_epi64(product, data));
+  }
+#else
+  uint64_t data, dk;
+  int i;
+  for (i = 0; i < 8; i++) {
+    data = read64le(p + 8 * i);
+    dk = data ^ read64le(s + 8 * i);
+    acc[i ^ 1] += data;
+    acc[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
+  }
+#endif
+}
+
+/* scrambles the accumulators at the end of each block */
+static void xxh3_scramble(uint64_t *acc, const unsigned char *s) {
+#if XXH3_SSE2
+  const __m128i prime = _mm_set1_epi32((int) XXH_PRIME32_1);
+  __m128i *a = (__m128i *) acc, dk, lo, hi;
+  int i;
+  for (i = 0; i < 4; i++) {
+    dk = _mm_loadu_si128(&a[i]);
+    dk = _mm_xor_si128(dk, _mm_srli_epi64(dk, 47));
+    dk = _mm_xor_si128(dk, _mm_loadu_si128((const __m128i *) (s + 16 * i)));
+    lo = _mm_mul_epu32(dk, prime);
+    hi = _mm_mul_epu32(_mm_shuffle_epi32(dk, _MM_SHUFFLE(0,3,0,1)), prime);
+    _mm_storeu_si128(&a[i], _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+  }
+#else
+  uint64_t a;
+  int i;
+  for (i = 0; i < 8; i++) {
+    a = acc[i];
+    a ^= a >> 47;
+    a ^= read64le(s + 8 * i);
+    acc[i] = a * XXH_PRIME32_1;
+  }
+#endif
+}
+
+/* adds a number of stripes, scrambling at the end of each block */
+static void xxh3_stripes(uint64_t *acc, size_t *done,
+                         const unsigned char *p, size_t stripes)
+{
+  while (stripes--) {
+    xxh3_accumulate(acc, p, &xxh_secret[*done * 8]);
+    p += XXH_STRIPE_LEN;
+    if (++*done == XXH_STRIPES) {
+      xxh3_scramble(acc, &xxh_secret[XXH_SECRET_SIZE - XXH_STRIPE_LEN]);
+      *done = 0;
+    }
+  }
+}
+
+static void xxh3_init(struct digest_ctx *ctx) {
+  uint64_t *acc = ctx->u.xxh3.acc;
+  acc[0] = XXH_PRIME32_3; acc[1] = XXH_PRIME64_1;
+  acc[2] = XXH_PRIME64_2; acc[3] = XXH_PRIME64_3;
+  acc[4] = XXH_PRIME64_4; acc[5] = XXH_PRIME32_2;
+  acc[6] = XXH_PRIME64_5; acc[7] = XXH_PRIME32_1;
+  ctx->u.xxh3.length = 0;
+  ctx->u.xxh3.buffered = 0;
+  ctx->u.xxh3.stripes = 0;
+}
+
+/* input is buffered until there is more than a buffer's worth, so the
+ * last stripe is always left for xxh3_finish(), which hashes it with a
+ * different part of the secret */
+static void xxh3_update(struct digest_ctx *ctx, const unsigned char *p,
+                        size_t len)
+{
+  unsigned char *buf = ctx->u.xxh3.buf;
+  size_t n, buffered = ctx->u.xxh3.buffered;
+
+  ctx->u.xxh3.length += len;
+  if (buffered + len <= XXH_BUFFER_SIZE) {
+    memcpy(&buf[buffered], p, len);
+    ctx->u.xxh3.buffered = buffered + len;
+    return;
+  }
+
+  if (buffered) {
+    n = XXH_BUFFER_SIZE - buffered;
+    memcpy(&buf[buffered], p, n);
+    p += n;
+    len -= n;
+    xxh3_stripes(ctx->u.xxh3.acc, &ctx->u.xxh3.stripes, buf,
+                 XXH_BUFFER_SIZE / XXH_STRIPE_LEN);
+  }
+  if (len > XXH_BUFFER_SIZE) {
+    n = (len - 1) / XXH_STRIPE_LEN;
+    xxh3_stripes(ctx->u.xxh3.acc, &ctx->u.xxh3.stripes, p, n);
+    p += n * XXH_STRIPE_LEN;
+    len -= n * XXH_STRIPE_LEN;
+    /* keep the last stripe, in case fewer bytes than that are left */
+    memcpy(&buf[XXH_BUFFER_SIZE - XXH_STRIPE_LEN], p - XXH_STRIPE_LEN,
+           XXH_STRIPE_LEN);
+  }
+  memcpy(buf, p, len);
+  ctx->u.xxh3.buffered = len;
+}
+
+static uint64_t xxh3_finish(struct digest_ctx *ctx) {
+  unsigned char *buf = ctx->u.xxh3.buf, last[XXH_STRIPE_LEN];
+  size_t buffered = ctx->u.xxh3.buffered, stripes = ctx->u.xxh3.stripes;
+  uint64_t *acc = ctx->u.xxh3.acc, result;
+  const unsigned char *p;
+  int i;
+
+  if (ctx->u.xxh3.length <= XXH_MIDSIZE_MAX) {
+    return xxh3_short(buf, (size_t) ctx->u.xxh3.length);
+  }
+
+  if (buffered >= XXH_STRIPE_LEN) {
+    xxh3_stripes(acc, &stripes, buf, (buffered - 1) / XXH_STRIPE_LEN);
+    p = &buf[buffered - XXH_STRIPE_LEN];
+  }
+  else {
+    /* the last stripe is partly from the previous buffer */
+    memcpy(last, &buf[XXH_BUFFER_SIZE - (XXH_STRIPE_LEN - buffered)],
+           XXH_STRIPE_LEN - buffered);
+    memcpy(&last[XXH_STRIPE_LEN - buffered], buf, buffered);
+    p = last;
+  }
+  xxh3_accumulate(acc, p, &xxh_secret[XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7]);
+
+  result = ctx->u.xxh3.length * XXH_PRIME64_1;
+  for (i = 0; i < 4; i++) {
+    result += xxh_mul128_fold64(acc[2 * i] ^ read64le(&xxh_secret[11+16*i]),
+                            acc[2 * i + 1] ^ read64le(&xxh_secret[19+16*i]));
+  }
+  return xxh3_avalanche(result);
+}
+
+/* --- CRC32C ------------------------------------------------------------- */
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_make_table(void) {
+  uint32_t crc;
+  int i, j;
+  for (i = 0; i < 256; i++) {
+    crc = (uint32_t) i;
+    for (j = 0; j < 8; j++) crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    crc = crc32c_table[0][i];
+    for (j = 1; j < 8; j++) {
+      crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+      crc32c_table[j][i] = crc;
+    }
+  }
+}
+
+/* slicing-by-8: eight bytes at a time, with eight tables */
+static uint32_t crc32c_slice8(uint32_t crc, const unsigned char *p,
+                              size_t len)
+{
+  uint32_t lo, hi;
+  for (; len >= 8; len -= 8, p += 8) {
+    lo = read32le(p) ^ crc;
+    hi = read32le(p + 4);
+    crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+      crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+      crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+      crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+  }
+  while (len--) crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#if DIGEST_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p,
+                             size_t len)
+{
+# if defined(__x86_64__)
+  uint64_t crc64 = crc, x;
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&x, p, 8);
+    crc64 = _mm_crc32_u64(crc64, x);
+  }
+  crc = (uint32_t) crc64;
+# endif
+  while (len--) crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+static void crc32c_update(struct digest_ctx *ctx, const unsigned char *p,
+                          size_t len)
+{
+#if DIGEST_X86
+  if (cpu & CPU_SSE42) {
+    ctx->u.crc32c = crc32c_sse42(ctx->u.crc32c, p, len);
+    return;
+  }
+#endif
+  ctx->u.crc32c = crc32c_slice8(ctx->u.crc32c, p, len);
+}
+
+/* --- multi-buffer MD5 --------------------------------------------------- */
+
+#if DIGEST_X86
+static const uint32_t md5_k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+  0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+  0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/* the rotation of each step within a round */
+static const unsigned char md5_rot[4][4] = {
+  { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
+};
+
+typedef uint32_t md5x_v4  __attribute__((vector_size(16)));
+typedef uint32_t md5x_v8  __attribute__((vector_size(32)));
+typedef uint32_t md5x_v16 __attribute__((vector_size(64)));
+
+/* defines a function that does one block of MD5 for each of as many
+ * messages as a vector has 32-bit lanes. state has the A words of every
+ * lane, then the B, C and D words. w has word i of each lane's block at
+ * w[i * lanes + lane]. Each of the four rounds takes the message words
+ * in its own order, starting at word s and stepping by word t */
+#define MD5X_STEP(f, n, s, t)                                           \
+  for (i = 0; i < 16; i++) {                                            \
+    x = a + (f) + md5_k[n * 16 + i] + m[(s + t * i) & 15];              \
+    r = md5_rot[n][i & 3];                                              \
+    a = d; d = c; c = b;                                                \
+    b += (x << r) | (x >> (32 - r));                                    \
+  }
+
+#define MD5X_BLOCK(name, isa, vec)                                      \
+__attribute__((target(isa)))                                            \
+static void name(uint32_t *state, const uint32_t *w) {                  \
+  const int lanes = (int) (sizeof(vec) / sizeof(uint32_t));             \
+  vec a, b, c, d, a0, b0, c0, d0, x, m[16];                             \
+  int i, r;                                                             \
+  memcpy(&a, &state[0 * lanes], sizeof(vec));                           \
+  memcpy(&b, &state[1 * lanes], sizeof(vec));                           \
+  memcpy(&c, &state[2 * lanes], sizeof(vec));                           \
+  memcpy(&d, &state[3 * lanes], sizeof(vec));                           \
+  for (i = 0; i < 16; i++) memcpy(&m[i], &w[i * lanes], sizeof(vec));   \
+  a0 = a; b0 = b; c0 = c; d0 = d;                                       \
+  MD5X_STEP(d ^ (b & (c ^ d)), 0, 0, 1)                                 \
+  MD5X_STEP(c ^ (d & (b ^ c)), 1, 1, 5)                                 \
+  MD5X_STEP(b ^ c ^ d,         2, 5, 3)                                 \
+  MD5X_STEP(c ^ (b | ~d),      3, 0, 7)                                 \
+  a += a0; b += b0; c += c0; d += d0;                                   \
+  memcpy(&state[0 * lanes], &a, sizeof(vec));                           \
+  memcpy(&state[1 * lanes], &b, sizeof(vec));                           \
+  memcpy(&state[2 * lanes], &c, sizeof(vec));                           \
+  memcpy(&state[3 * lanes], &d, sizeof(vec));                           \
+}
+
+MD5X_BLOCK(md5x_block_sse2,   "sse2",    md5x_v4)
+MD5X_BLOCK(md5x_block_avx2,   "avx2",    md5x_v8)
+MD5X_BLOCK(md5x_block_avx512, "avx512f", md5x_v16)
+
+#define MD5X_LANES (16)
+
+/* a message being hashed in a lane. Its whole blocks are read where they
+ * are, then the rest of it is padded in pad[] */
+struct md5x_lane {
+  int job;                  /* the message in the lane, or -1 if idle */
+  const unsigned char *p;   /* the lane's next block */
+  size_t whole;             /* whole blocks left before pad[] */
+  size_t left;              /* all blocks left */
+  unsigned char pad[128];   /* the end of the message, padded */
+};
+
+static void md5x_start(struct md5x_lane *l, int job,
+                       const unsigned char *buffer, size_t length)
+{
+  size_t rem = length & 63, tail = (rem < 56) ? 64 : 128;
+  uint64_t bits = (uint64_t) length << 3;
+  int i;
+
+  l->job = job;
+  l->whole = length >> 6;
+  l->left = l->whole + tail / 64;
+  l->p = l->whole ? buffer : l->pad;
+  memcpy(l->pad, &buffer[length - rem], rem);
+  l->pad[rem] = 0x80;
+  memset(&l->pad[rem + 1], 0, tail - rem - 1);
+  for (i = 0; i < 8; i++) {
+    l->pad[tail - 8 + i] = (unsigned char) (bits >> (i * 8));
+  }
+}
+
+/* runs messages through the lanes of a block function. Whenever a lane's
+ * message is done, the next message starts in that lane, so all lanes
+ * are kept busy until the messages run out. Idle lanes hash zeros */
+static void md5x_many(void (*block)(uint32_t *, const uint32_t *),
+                      int lanes, int num,
+                      const unsigned char *const *buffers,
+                      const size_t *lengths,
+                      unsigned char (*results)[DIGEST_MAX])
+{
+  static const uint32_t iv[4] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+  };
+  static const unsigned char zeros[64];
+  struct md5x_lane lane[MD5X_LANES];
+  uint32_t state[4 * MD5X_LANES], w[16 * MD5X_LANES];
+  const unsigned char *p;
+  int i, j, next = 0, active = 0;
+
+  for (j = 0; j < lanes; j++) lane[j].job = -1;
+
+  while (1) {
+    /* start the next messages in idle lanes */
+    for (j = 0; j < lanes && next < num; j++) {
+      if (lane[j].job >= 0) continue;
+      md5x_start(&lane[j], next, buffers[next], lengths[next]);
+      for (i = 0; i < 4; i++) state[i * lanes + j] = iv[i];
+      next++;
+      active++;
+    }
+    if (!active) break;
+
+    for (j = 0; j < lanes; j++) {
+      p = (lane[j].job >= 0) ? lane[j].p : zeros;
+      for (i = 0; i < 16; i++) w[i * lanes + j] = read32le(&p[i * 4]);
+    }
+    block(state, w);
+
+    for (j = 0; j < lanes; j++) {
+      if (lane[j].job < 0) continue;
+      if (--lane[j].left) {
+        lane[j].p = (lane[j].whole && --lane[j].whole == 0)
+          ? lane[j].pad : lane[j].p + 64;
+        continue;
+      }
+      /* the message is done, its digest is A to D, little-endian */
+      for (i = 0; i < 16; i++) {
+        results[lane[j].job][i] =
+          (unsigned char) (state[(i >> 2) * lanes + j] >> ((i & 3) * 8));
+      }
+      lane[j].job = -1;
+      active--;
+    }
+  }
+}
+#endif
+
+int digest_lanes(int type) {
+  digest_once();
+#if DIGEST_X86
+  if (type == DIGEST_MD5) {
+    if (cpu & CPU_AVX512) return 16;
+    if (cpu & CPU_AVX2)   return 8;
+    if (cpu & CPU_SSE2)   return 4;
+  }
+#else
+  (void) type;
+#endif
+  return 1;
+}
+
+void digest_many(int type, int num, const unsigned char *const *buffers,
+                 const size_t *lengths, unsigned char (*results)[DIGEST_MAX])
+{
+  struct digest_ctx ctx;
+  int i;
+
+#if DIGEST_X86
+  switch (digest_lanes(type)) {
+  case 16: md5x_many(&md5x_block_avx512, 16, num, buffers, lengths, results);
+    return;
+  case 8:  md5x_many(&md5x_block_avx2, 8, num, buffers, lengths, results);
+    return;
+  case 4:  md5x_many(&md5x_block_sse2, 4, num, buffers, lengths, results);
+    return;
+  }
+#endif
+  for (i = 0; i < num; i++) {
+    digest_init(&ctx, type);
+    digest_update(&ctx, buffers[i], lengths[i]);
+    digest_finish(&ctx, results[i]);
+  }
+}
+
+/* --- the choice of digests ---------------------------------------------- */
+
+static const struct {
+  const char *name;
+  size_t size;
+} digests[] = {
+  { "md5",    16 },
+  { "sha256", 32 },
+  { "xxh3",    8 },
+  { "crc32c",  4 }
+};
+
+int digest_lookup(const char *name) {
+  int i;
+  for (i = 0; i < (int) (sizeof(digests) / sizeof(*digests)); i++) {
+    if (strcmp(name, digests[i].name) == 0) return i;
+  }
+  return -1;
+}
+
+const char *digest_name(int type) {
+  return digests[type].name;
+}
+
+size_t digest_size(int type) {
+  return digests[type].size;
+}
+
+void digest_init(struct digest_ctx *ctx, int type) {
+  digest_once();
+  ctx->type = type;
+  switch (type) {
+  case DIGEST_MD5:    md5_init_ctx(&ctx->u.md5); break;
+  case DIGEST_SHA256: sha256_init(ctx); break;
+  case DIGEST_XXH3:   xxh3_init(ctx); break;
+  case DIGEST_CRC32C: ctx->u.crc32c = 0xFFFFFFFF; break;
+  }
+}
+
+void digest_update(struct digest_ctx *ctx, const void *buffer, size_t len) {
+  switch (ctx->type) {
+  case DIGEST_MD5:    md5_process_bytes(buffer, len, &ctx->u.md5); break;
+  case DIGEST_SHA256: sha256_update(ctx, buffer, len); break;
+  case DIGEST_XXH3:   xxh3_update(ctx, buffer, len); break;
+  case DIGEST_CRC32C: crc32c_update(ctx, buffer, len); break;
+  }
+}
+
+void digest_finish(struct digest_ctx *ctx, unsigned char *result) {
+  switch (ctx->type) {
+  case DIGEST_MD5:    md5_finish_ctx(&ctx->u.md5, result); break;
+  case DIGEST_SHA256: sha256_finish(ctx, result); break;
+  case DIGEST_XXH3:   write64be(result, xxh3_finish(ctx)); break;
+  case DIGEST_CRC32C: write32be(result, ~ctx->u.crc32c); break;
+  }
+}
@@ -0,0 +1,93 @@
+/* digest.h - a choice of digests for testing files
+ * (C) 2026 okwkntr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _DIGEST_H
+#define _DIGEST_H 1
+
+#include <stddef.h>
+#if HAVE_STDINT_H
+# include <stdint.h>
+#elif HAVE_INTTYPES_H
+# include <inttypes.h>
+#endif
+
+#include "md5.h"
+
+/* the digests that can be chosen. DIGEST_XXH3 is the 64-bit XXH3 hash
+ * with the default secret and seed 0, as printed by xxhsum -H3 */
+#define DIGEST_MD5    (0)
+#define DIGEST_SHA256 (1)
+#define DIGEST_XXH3   (2)
+#define DIGEST_CRC32C (3)
+
+/* the size in bytes of the largest digest */
+#define DIGEST_MAX    (32)
+
+struct digest_ctx {
+  int type;
+  union {
+    struct md5_ctx md5;
+    struct {
+      uint32_t state[8];
+      uint64_t length;          /* bytes hashed so far */
+      unsigned char buf[64];    /* a partial block */
+    } sha256;
+    struct {
+      uint64_t acc[8];
+      uint64_t length;          /* bytes hashed so far */
+      unsigned char buf[256];   /* four stripes, the last of them kept */
+      size_t buffered;          /* bytes waiting in buf */
+      size_t stripes;           /* stripes done in the current block */
+    } xxh3;
+    uint32_t crc32c;
+  } u;
+};
+
+/* returns the digest named, or -1 if there is no such digest */
+extern int digest_lookup(const char *name);
+
+/* returns the name of a digest */
+extern const char *digest_name(int type);
+
+/* returns the size of a digest in bytes, at most DIGEST_MAX */
+extern size_t digest_size(int type);
+
+/* starts a digest */
+extern void digest_init(struct digest_ctx *ctx, int type);
+
+/* adds bytes to a digest */
+extern void digest_update(struct digest_ctx *ctx, const void *buffer,
+                          size_t len);
+
+/* finishes a digest, writing digest_size() bytes to result. The digest
+ * must be started again before it is used again */
+extern void digest_finish(struct digest_ctx *ctx, unsigned char *result);
+
+/* returns how many buffers digest_many() hashes at once with a digest on
+ * this CPU, or 1 if it hashes them one at a time */
+extern int digest_lanes(int type);
+
+/* digests num whole buffers. results[i] gets the same digest as
+ * digest_init(), digest_update() with all of buffers[i] and
+ * digest_finish() would give. Buffers are best of similar lengths */
+extern void digest_many(int type, int num,
+                        const unsigned char *const *buffers,
+                        const size_t *lengths,
+                        unsigned char (*results)[DIGEST_MAX]);
+
+#endif
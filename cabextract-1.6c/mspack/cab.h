@@ -77,6 +77,20 @@
 #define CAB_FOLDERMAX (65535)
 #define CAB_LENGTHMAX (CAB_BLOCKMAX * CAB_FOLDERMAX)
 
+/* Cabinet metadata (files, filenames, folders and folder data segments)
+ * is carved out of large chunks owned by each cabinet, rather than being
+ * allocated one structure at a time. The first chunk is sized from the
+ * cabinet header; further chunks are at least CAB_ARENA_CHUNK bytes.
+ * All chunks are released together when the cabinet is closed.
+ */
+#define CAB_ARENA_CHUNK (16384)
+#define CAB_ARENA_ALIGN (8)
+#define CAB_ARENA_HDR   ((sizeof(struct mscabd_arena) + CAB_ARENA_ALIGN - 1) \
+                         & ~((size_t) CAB_ARENA_ALIGN - 1))
+
+/* A threaded search gives each thread at least this many bytes to scan */
+#define CAB_SEARCH_RANGEMIN (1048576)
+
 /* CAB compression definitions */
 
 struct mscab_compressor_p {
@@ -103,18 +117,66 @@ struct mscabd_decompress_state {
   unsigned char input[CAB_INPUTMAX]; /* one input block of data              */
 };
 
+/* an open cabinet file in the decompressor's handle cache */
+struct mscabd_handle {
+  struct mscabd_cabinet_p *cab;      /* cabinet the file belongs to, or NULL */
+  struct mspack_file *fh;            /* open file handle                     */
+  unsigned int last_use;             /* handle_clock value when last used    */
+};
+
 struct mscab_decompressor_p {
   struct mscab_decompressor base;
   struct mscabd_decompress_state *d;
   struct mspack_system *system;
-  int param[3]; /* !!! MATCH THIS TO NUM OF PARAMS IN MSPACK.H !!! */
+  int param[7]; /* !!! MATCH THIS TO NUM OF PARAMS IN MSPACK.H !!! */
   int error, read_error;
+  struct mscabd_handle *handles;     /* param[MAXHANDLES] cached files       */
+  unsigned int handle_clock;         /* counts handle uses, for LRU          */
+  /* the best block checksum function the CPU can run */
+  unsigned int (*checksum)(unsigned char *data, unsigned int bytes,
+                           unsigned int cksum);
+  struct mscabd_stats stats;         /* what extract() has done so far       */
+};
+
+/* one chunk of a cabinet's metadata arena, allocation space follows it */
+struct mscabd_arena {
+  struct mscabd_arena *next;         /* previously filled chunk              */
+  size_t size;                       /* bytes of allocation space in chunk   */
+  size_t used;                       /* bytes already handed out             */
+};
+
+/* a possible cabinet header found by a search thread */
+struct mscabd_candidate {
+  off_t offset;                      /* offset of 'MSCF' in the file         */
+  unsigned int length;               /* alleged length of the cabinet        */
+  unsigned int foffset;              /* alleged offset of the file entries   */
+};
+
+/* part of a file scanned by one search thread. Signatures starting in
+ * [start, end) are looked at, their headers may extend beyond end */
+struct mscabd_search_range {
+  struct mscab_decompressor_p *self; /* decompressor doing the search        */
+  const char *filename;              /* file being searched                  */
+  off_t start, end;                  /* range of signature offsets to scan   */
+  off_t flen;                        /* length of the whole file             */
+  struct mscabd_candidate *cands;    /* headers found, in offset order       */
+  unsigned int num_cands, max_cands; /* number of headers found, room for    */
+  int error;                         /* MSPACK_ERR_OK or reason for stopping */
+};
+
+/* filename hash index, built by find_file(). slot[] has mask+1 entries */
+struct mscabd_name_index {
+  int flags;                         /* MSCABD_FIND_* flags index built with */
+  unsigned int mask;                 /* number of hash slots - 1             */
+  struct mscabd_file *slot[1];       /* open-addressed table of files        */
 };
 
 struct mscabd_cabinet_p {
   struct mscabd_cabinet base;
   off_t blocks_off;                  /* offset to data blocks                */
   int block_resv;                    /* reserved space in data blocks        */
+  struct mscabd_arena *arena;        /* chunks holding all cabinet metadata  */
+  struct mscabd_name_index *index;   /* filename index, or NULL if not built */
 };
 
 /* there is one of these for every cabinet a folder spans */
@@ -25,6 +25,21 @@
 #include <cab.h>
 #include <assert.h>
 
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* x86 compilers that support per-function target attributes can build
+ * SSE2 and AVX2 signature scanners and block checksums, chosen at runtime
+ * by cabd_scan_select() and cabd_checksum_select() according to what the
+ * CPU supports */
+#if !defined(MSPACK_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && \
+     ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+# define CABD_SIMD 1
+# include <immintrin.h>
+#endif
+
 /* Notes on compliance with cabinet specification:
  *
  * One of the main changes between cabextract 0.6 and libmspack's cab
@@ -73,8 +88,17 @@ static void cabd_close(
 static int cabd_read_headers(
   struct mspack_system *sys, struct mspack_file *fh,
   struct mscabd_cabinet_p *cab, off_t offset, int quiet);
+static void cabd_folder_lengths(
+  struct mscabd_cabinet_p *cab, off_t offset);
 static char *cabd_read_string(
-  struct mspack_system *sys, struct mspack_file *fh, int *error);
+  struct mspack_system *sys, struct mspack_file *fh,
+  struct mscabd_cabinet_p *cab, int *error);
+static int cabd_arena_grow(
+  struct mspack_system *sys, struct mscabd_cabinet_p *cab, size_t size);
+static void *cabd_arena_alloc(
+  struct mspack_system *sys, struct mscabd_cabinet_p *cab, size_t bytes);
+static void cabd_arena_free(
+  struct mspack_system *sys, struct mscabd_cabinet_p *cab);
 
 static struct mscabd_cabinet *cabd_search(
   struct mscab_decompressor *base, const char *filename);
@@ -83,6 +107,32 @@ static int cabd_find(
   struct mspack_file *fh, const char *filename, 
   off_t flen, off_t *firstlen, struct mscabd_cabinet_p **firstcab);
 
+static int cabd_find_cab(
+  struct mscab_decompressor_p *self, struct mspack_file *fh,
+  const char *filename, off_t flen, off_t caboff, unsigned int cablen_u32,
+  unsigned int foffset_u32, off_t *firstlen,
+  struct mscabd_cabinet_p **firstcab, struct mscabd_cabinet_p **link,
+  int *false_cabs, off_t *offset);
+#if HAVE_PTHREAD_H
+static int cabd_find_threaded(
+  struct mscab_decompressor_p *self, struct mspack_file *fh,
+  const char *filename, off_t flen, int threads, off_t *firstlen,
+  struct mscabd_cabinet_p **firstcab);
+static void *cabd_search_range(
+  void *arg);
+#endif
+
+typedef unsigned char *(*cabd_scan_fn)(unsigned char *p, unsigned char *pend);
+static cabd_scan_fn cabd_scan_select(void);
+static unsigned char *cabd_scan_sig(
+  unsigned char *p, unsigned char *pend);
+#ifdef CABD_SIMD
+static unsigned char *cabd_scan_sig_sse2(
+  unsigned char *p, unsigned char *pend);
+static unsigned char *cabd_scan_sig_avx2(
+  unsigned char *p, unsigned char *pend);
+#endif
+
 static int cabd_prepend(
   struct mscab_decompressor *base, struct mscabd_cabinet *cab,
   struct mscabd_cabinet *prevcab);
@@ -99,6 +149,8 @@ static int cabd_can_merge_folders(
 static int cabd_extract(
   struct mscab_decompressor *base, struct mscabd_file *file,
   const char *filename);
+static int cabd_decompress(
+  struct mscab_decompressor_p *self, off_t bytes);
 static int cabd_init_decomp(
   struct mscab_decompressor_p *self, unsigned int ct);
 static void cabd_free_decomp(
@@ -108,10 +160,30 @@ static int cabd_sys_read(
 static int cabd_sys_write(
   struct mspack_file *file, void *buffer, int bytes);
 static int cabd_sys_read_block(
-  struct mspack_system *sys, struct mscabd_decompress_state *d, int *out,
-  int ignore_cksum);
+  struct mscab_decompressor_p *self, int *out, int ignore_cksum);
+static off_t cabd_skip_blocks(
+  struct mscab_decompressor_p *self, off_t bytes);
+static off_t cabd_copy_blocks(
+  struct mscab_decompressor_p *self, struct mspack_file *fh, off_t bytes);
+static int cabd_check_folder(
+  struct mscab_decompressor *base, struct mscabd_folder *folder,
+  unsigned int *block, unsigned int *unchecked);
+static struct mspack_file *cabd_open_handle(
+  struct mscab_decompressor_p *self, struct mscabd_cabinet_p *cab);
+static void cabd_close_handles(
+  struct mscab_decompressor_p *self, struct mscabd_cabinet *cab);
+typedef unsigned int (*cabd_checksum_fn)(unsigned char *data,
+                                         unsigned int bytes,
+                                         unsigned int cksum);
+static cabd_checksum_fn cabd_checksum_select(void);
 static unsigned int cabd_checksum(
   unsigned char *data, unsigned int bytes, unsigned int cksum);
+#ifdef CABD_SIMD
+static unsigned int cabd_checksum_sse2(
+  unsigned char *data, unsigned int bytes, unsigned int cksum);
+static unsigned int cabd_checksum_avx2(
+  unsigned char *data, unsigned int bytes, unsigned int cksum);
+#endif
 static struct noned_state *noned_init(
   struct mspack_system *sys, struct mspack_file *in, struct mspack_file *out,
   int bufsize);
@@ -126,6 +198,14 @@ static int cabd_param(
 
 static int cabd_error(
   struct mscab_decompressor *base);
+static int cabd_get_stats(
+  struct mscab_decompressor *base, struct mscabd_stats *stats);
+
+static struct mscabd_file *cabd_find_file(
+  struct mscab_decompressor *base, struct mscabd_cabinet *cab,
+  const char *filename, int flags);
+static void cabd_free_index(
+  struct mspack_system *sys, struct mscabd_cabinet *cab);
 
 
 /***************************************
@@ -136,6 +216,7 @@ static int cabd_error(
 struct mscab_decompressor *
   mspack_create_cab_decompressor(struct mspack_system *sys)
 {
+  static const struct mscabd_stats stats_zero;
   struct mscab_decompressor_p *self = NULL;
 
   if (!sys) sys = mspack_default_system;
@@ -150,13 +231,24 @@ struct mscab_decompressor *
     self->base.append     = &cabd_append;
     self->base.set_param  = &cabd_param;
     self->base.last_error = &cabd_error;
+    self->base.find_file  = &cabd_find_file;
+    self->base.check_folder = &cabd_check_folder;
+    self->base.get_stats  = &cabd_get_stats;
     self->system          = sys;
     self->d               = NULL;
     self->error           = MSPACK_ERR_OK;
+    self->handles         = NULL;
+    self->handle_clock    = 0;
+    self->checksum        = cabd_checksum_select();
 
     self->param[MSCABD_PARAM_SEARCHBUF] = 32768;
     self->param[MSCABD_PARAM_FIXMSZIP]  = 0;
     self->param[MSCABD_PARAM_DECOMPBUF] = 4096;
+    self->param[MSCABD_PARAM_SEARCHTHREADS] = 1;
+    self->param[MSCABD_PARAM_MAXHANDLES] = 8;
+    self->param[MSCABD_PARAM_CHECKSUMS] = 1;
+    self->param[MSCABD_PARAM_STATS]     = 0;
+    self->stats = stats_zero;
   }
   return (struct mscab_decompressor *) self;
 }
@@ -171,10 +263,11 @@ void mspack_destroy_cab_decompressor(struct mscab_decompressor *base) {
   if (self) {
     struct mspack_system *sys = self->system;
     if (self->d) {
-      if (self->d->infh) sys->close(self->d->infh);
       cabd_free_decomp(self);
       sys->free(self->d);
     }
+    cabd_close_handles(self, NULL);
+    sys->free(self->handles);
     sys->free(self);
   }
 }
@@ -227,10 +320,8 @@ static void cabd_close(struct mscab_decompressor *base,
                        struct mscabd_cabinet *origcab)
 {
   struct mscab_decompressor_p *self = (struct mscab_decompressor_p *) base;
-  struct mscabd_folder_data *dat, *ndat;
   struct mscabd_cabinet *cab, *ncab;
-  struct mscabd_folder *fol, *nfol;
-  struct mscabd_file *fi, *nfi;
+  struct mscabd_folder *fol;
   struct mspack_system *sys;
 
   if (!base) return;
@@ -239,50 +330,31 @@ static void cabd_close(struct mscab_decompressor *base,
   self->error = MSPACK_ERR_OK;
 
   while (origcab) {
-    /* free files */
-    for (fi = origcab->files; fi; fi = nfi) {
-      nfi = fi->next;
-      sys->free(fi->filename);
-      sys->free(fi);
-    }
-
-    /* free folders */
-    for (fol = origcab->folders; fol; fol = nfol) {
-      nfol = fol->next;
-
-      /* free folder decompression state if it has been decompressed */
+    /* free folder decompression state if it has been decompressed */
+    for (fol = origcab->folders; fol; fol = fol->next) {
       if (self->d && (self->d->folder == (struct mscabd_folder_p *) fol)) {
-        if (self->d->infh) sys->close(self->d->infh);
         cabd_free_decomp(self);
         sys->free(self->d);
         self->d = NULL;
       }
-
-      /* free folder data segments */
-      for (dat = ((struct mscabd_folder_p *)fol)->data.next; dat; dat = ndat) {
-        ndat = dat->next;
-        sys->free(dat);
-      }
-      sys->free(fol);
     }
 
-    /* free predecessor cabinets (and the original cabinet's strings) */
+    /* free predecessor cabinets (and the original cabinet's metadata).
+     * files, folders, folder data and strings all live in the arenas */
     for (cab = origcab; cab; cab = ncab) {
       ncab = cab->prevcab;
-      sys->free(cab->prevname);
-      sys->free(cab->nextname);
-      sys->free(cab->previnfo);
-      sys->free(cab->nextinfo);
+      cabd_close_handles(self, cab);
+      cabd_free_index(sys, cab);
+      cabd_arena_free(sys, (struct mscabd_cabinet_p *) cab);
       if (cab != origcab) sys->free(cab);
     }
 
     /* free successor cabinets */
     for (cab = origcab->nextcab; cab; cab = ncab) {
       ncab = cab->nextcab;
-      sys->free(cab->prevname);
-      sys->free(cab->nextname);
-      sys->free(cab->previnfo);
-      sys->free(cab->nextinfo);
+      cabd_close_handles(self, cab);
+      cabd_free_index(sys, cab);
+      cabd_arena_free(sys, (struct mscabd_cabinet_p *) cab);
       sys->free(cab);
     }
 
@@ -313,6 +385,8 @@ static int cabd_read_headers(struct mspack_system *sys,
   unsigned char buf[64];
 
   /* initialise pointers */
+  cab->arena         = NULL;
+  cab->index         = NULL;
   cab->base.next     = NULL;
   cab->base.files    = NULL;
   cab->base.folders  = NULL;
@@ -356,6 +430,14 @@ static int cabd_read_headers(struct mspack_system *sys,
     return MSPACK_ERR_DATAFORMAT;
   }
 
+  /* size the first metadata chunk to hold every folder and file, along
+   * with a filename of typical length */
+  if (cabd_arena_grow(sys, cab, num_folders * sizeof(struct mscabd_folder_p) +
+                      num_files * (sizeof(struct mscabd_file) + 32)))
+  {
+    return MSPACK_ERR_NOMEMORY;
+  }
+
   /* check cabinet version */
   if ((buf[cfhead_MajorVersion] != 1) && (buf[cfhead_MinorVersion] != 3)) {
     if (!quiet) sys->message(fh, "WARNING; cabinet version is not 1.3");
@@ -390,14 +472,14 @@ static int cabd_read_headers(struct mspack_system *sys,
 
   /* read name and info of preceeding cabinet in set, if present */
   if (cab->base.flags & cfheadPREV_CABINET) {
-    cab->base.prevname = cabd_read_string(sys, fh, &x); if (x) return x;
-    cab->base.previnfo = cabd_read_string(sys, fh, &x); if (x) return x;
+    cab->base.prevname = cabd_read_string(sys, fh, cab, &x); if (x) return x;
+    cab->base.previnfo = cabd_read_string(sys, fh, cab, &x); if (x) return x;
   }
 
   /* read name and info of next cabinet in set, if present */
   if (cab->base.flags & cfheadNEXT_CABINET) {
-    cab->base.nextname = cabd_read_string(sys, fh, &x); if (x) return x;
-    cab->base.nextinfo = cabd_read_string(sys, fh, &x); if (x) return x;
+    cab->base.nextname = cabd_read_string(sys, fh, cab, &x); if (x) return x;
+    cab->base.nextinfo = cabd_read_string(sys, fh, cab, &x); if (x) return x;
   }
 
   /* read folders */
@@ -411,16 +493,18 @@ static int cabd_read_headers(struct mspack_system *sys,
       }
     }
 
-    if (!(fol = (struct mscabd_folder_p *) sys->alloc(sys, sizeof(struct mscabd_folder_p)))) {
+    if (!(fol = (struct mscabd_folder_p *) cabd_arena_alloc(sys, cab, sizeof(struct mscabd_folder_p)))) {
       return MSPACK_ERR_NOMEMORY;
     }
     fol->base.next       = NULL;
     fol->base.comp_type  = EndGetI16(&buf[cffold_CompType]);
     fol->base.num_blocks = EndGetI16(&buf[cffold_NumBlocks]);
+    fol->base.data_length = 0;
     fol->data.next       = NULL;
     fol->data.cab        = (struct mscabd_cabinet_p *) cab;
     fol->data.offset     = offset + (off_t)
       ( (unsigned int) EndGetI32(&buf[cffold_DataOffset]) );
+    fol->base.data_offset = fol->data.offset;
     fol->merge_prev      = NULL;
     fol->merge_next      = NULL;
 
@@ -429,6 +513,7 @@ static int cabd_read_headers(struct mspack_system *sys,
     else linkfol->base.next = (struct mscabd_folder *) fol;
     linkfol = fol;
   }
+  cabd_folder_lengths(cab, offset);
 
   /* read files */
   for (i = 0; i < num_files; i++) {
@@ -436,7 +521,7 @@ static int cabd_read_headers(struct mspack_system *sys,
       return MSPACK_ERR_READ;
     }
 
-    if (!(file = (struct mscabd_file *) sys->alloc(sys, sizeof(struct mscabd_file)))) {
+    if (!(file = (struct mscabd_file *) cabd_arena_alloc(sys, cab, sizeof(struct mscabd_file)))) {
       return MSPACK_ERR_NOMEMORY;
     }
 
@@ -455,7 +540,6 @@ static int cabd_read_headers(struct mspack_system *sys,
       file->folder = ifol;
 
       if (!ifol) {
-        sys->free(file);
         D(("invalid folder index"))
         return MSPACK_ERR_DATAFORMAT;
       }
@@ -501,11 +585,8 @@ static int cabd_read_headers(struct mspack_system *sys,
     file->date_y = (x >> 9) + 1980;
 
     /* get filename */
-    file->filename = cabd_read_string(sys, fh, &x);
-    if (x) { 
-      sys->free(file);
-      return x;
-    }
+    file->filename = cabd_read_string(sys, fh, cab, &x);
+    if (x) return x;
 
     /* link file entry into file list */
     if (!linkfile) cab->base.files = file;
@@ -516,8 +597,42 @@ static int cabd_read_headers(struct mspack_system *sys,
   return MSPACK_ERR_OK;
 }
 
+/* works out how many bytes of data blocks each folder of a cabinet has,
+ * from where the next folder's data blocks start, or where the cabinet
+ * ends. folders almost always have their data blocks in the same order as
+ * the folders themselves, so the next folder is tried first */
+static void cabd_folder_lengths(struct mscabd_cabinet_p *cab, off_t offset)
+{
+  struct mscabd_folder_p *fol, *next, *f;
+  off_t end;
+
+  for (fol = (struct mscabd_folder_p *) cab->base.folders; fol;
+       fol = (struct mscabd_folder_p *) fol->base.next)
+  {
+    end = offset + (off_t) cab->base.length;
+    next = (struct mscabd_folder_p *) fol->base.next;
+    if (next && next->data.offset >= fol->data.offset &&
+        next->data.offset <= end)
+    {
+      end = next->data.offset;
+    }
+    else {
+      for (f = (struct mscabd_folder_p *) cab->base.folders; f;
+           f = (struct mscabd_folder_p *) f->base.next)
+      {
+        if (f->data.offset > fol->data.offset && f->data.offset < end) {
+          end = f->data.offset;
+        }
+      }
+    }
+    fol->base.data_length = (end > fol->data.offset)
+      ? end - fol->data.offset : 0;
+  }
+}
+
 static char *cabd_read_string(struct mspack_system *sys,
-                              struct mspack_file *fh, int *error)
+                              struct mspack_file *fh,
+                              struct mscabd_cabinet_p *cab, int *error)
 {
   off_t base = sys->tell(fh);
   char buf[256], *str;
@@ -541,7 +656,7 @@ static char *cabd_read_string(struct mspack_system *sys,
     return NULL;
   }
 
-  if (!(str = (char *) sys->alloc(sys, len))) {
+  if (!(str = (char *) cabd_arena_alloc(sys, cab, len))) {
     *error = MSPACK_ERR_NOMEMORY;
     return NULL;
   }
@@ -550,6 +665,59 @@ static char *cabd_read_string(struct mspack_system *sys,
   *error = MSPACK_ERR_OK;
   return str;
 }
+
+/***************************************
+ * CABD_ARENA_GROW, CABD_ARENA_ALLOC, CABD_ARENA_FREE
+ ***************************************
+ * cabd_arena_grow starts a new chunk in a cabinet's metadata arena.
+ *
+ * cabd_arena_alloc hands out memory for a cabinet's metadata from the
+ * cabinet's current arena chunk, starting a new chunk if it is full.
+ * Nothing allocated this way is ever freed individually.
+ *
+ * cabd_arena_free releases every chunk of a cabinet's arena at once
+ */
+static int cabd_arena_grow(struct mspack_system *sys,
+                           struct mscabd_cabinet_p *cab, size_t size)
+{
+  struct mscabd_arena *chunk;
+  chunk = (struct mscabd_arena *) sys->alloc(sys, CAB_ARENA_HDR + size);
+  if (!chunk) return MSPACK_ERR_NOMEMORY;
+  chunk->next = cab->arena;
+  chunk->size = size;
+  chunk->used = 0;
+  cab->arena  = chunk;
+  return MSPACK_ERR_OK;
+}
+
+static void *cabd_arena_alloc(struct mspack_system *sys,
+                              struct mscabd_cabinet_p *cab, size_t bytes)
+{
+  struct mscabd_arena *chunk;
+
+  /* keep every allocation aligned */
+  bytes = (bytes + (CAB_ARENA_ALIGN - 1)) & ~((size_t) CAB_ARENA_ALIGN - 1);
+
+  chunk = cab->arena;
+  if (!chunk || (chunk->size - chunk->used) < bytes) {
+    if (cabd_arena_grow(sys, cab, (bytes > CAB_ARENA_CHUNK)
+                        ? bytes : CAB_ARENA_CHUNK)) return NULL;
+    chunk = cab->arena;
+  }
+  chunk->used += bytes;
+  return &((unsigned char *) chunk)[CAB_ARENA_HDR + chunk->used - bytes];
+}
+
+static void cabd_arena_free(struct mspack_system *sys,
+                            struct mscabd_cabinet_p *cab)
+{
+  struct mscabd_arena *chunk, *next;
+  for (chunk = cab->arena; chunk; chunk = next) {
+    next = chunk->next;
+    sys->free(chunk);
+  }
+  cab->arena = NULL;
+}
     
 /***************************************
  * CABD_SEARCH, CABD_FIND
@@ -560,7 +728,9 @@ static char *cabd_read_string(struct mspack_system *sys,
  * list of results
  *
  * cabd_find is the inner loop of cabd_search, to make it easier to
- * break out of the loop and be sure that all resources are freed
+ * break out of the loop and be sure that all resources are freed.
+ * cabd_find_threaded does the same job with several threads, if
+ * MSCABD_PARAM_SEARCHTHREADS allows it and the file is large enough
  */
 static struct mscabd_cabinet *cabd_search(struct mscab_decompressor *base,
                                           const char *filename)
@@ -571,6 +741,7 @@ static struct mscabd_cabinet *cabd_search(struct mscab_decompressor *base,
   unsigned char *search_buf;
   struct mspack_file *fh;
   off_t filelen, firstlen = 0;
+  int threads;
 
   if (!base) return NULL;
   sys = self->system;
@@ -585,6 +756,17 @@ static struct mscabd_cabinet *cabd_search(struct mscab_decompressor *base,
   /* open file and get its full file length */
   if ((fh = sys->open(sys, filename, MSPACK_SYS_OPEN_READ))) {
     if (!(self->error = mspack_sys_filelen(sys, fh, &filelen))) {
+      threads = self->param[MSCABD_PARAM_SEARCHTHREADS];
+      if (threads > (filelen / CAB_SEARCH_RANGEMIN)) {
+        threads = (int) (filelen / CAB_SEARCH_RANGEMIN);
+      }
+#if HAVE_PTHREAD_H
+      if (threads > 1) {
+        self->error = cabd_find_threaded(self, fh, filename, filelen,
+                                         threads, &firstlen, &cab);
+      }
+      else
+#endif
       self->error = cabd_find(self, search_buf, fh, filename,
                               filelen, &firstlen, &cab);
     }
@@ -620,12 +802,13 @@ static int cabd_find(struct mscab_decompressor_p *self, unsigned char *buf,
                      struct mspack_file *fh, const char *filename,
                      off_t flen, off_t *firstlen, struct mscabd_cabinet_p **firstcab)
 {
-  struct mscabd_cabinet_p *cab, *link = NULL;
+  struct mscabd_cabinet_p *link = NULL;
   off_t caboff, offset, length;
   struct mspack_system *sys = self->system;
+  cabd_scan_fn scan = cabd_scan_select();
   unsigned char *p, *pend, state = 0;
   unsigned int cablen_u32 = 0, foffset_u32 = 0;
-  int false_cabs = 0;
+  int false_cabs = 0, err;
 
 #ifndef LARGEFILE_SUPPORT
   /* detect 32-bit off_t overflow */
@@ -661,17 +844,30 @@ static int cabd_find(struct mscab_decompressor_p *self, unsigned char *buf,
       switch (state) {
         /* starting state */
       case 0:
-        /* we spend most of our time in this while loop, looking for
-         * a leading 'M' of the 'MSCF' signature */
-        while (p < pend && *p != 0x4D) p++;
-        /* if we found tht 'M', advance state */
-        if (p++ < pend) state = 1;
+        /* we spend most of our time in scan(), looking for the 'MSCF'
+         * signature. It stops early if the buffer ends with part of it */
+        p = scan(p, pend);
+        if (p >= pend) break;
+        if ((pend - p) >= 20) {
+          /* the whole header is in the buffer, so read the fields now
+           * and let state 19 consume the final byte and validate them */
+          cablen_u32  = EndGetI32(&p[8]);
+          foffset_u32 = p[16] | (p[17] << 8) | (p[18] << 16);
+          p += 19;
+          state = 19;
+        }
+        else {
+          /* the header crosses into the next buffer, go byte by byte */
+          p++;
+          state = 1;
+        }
         break;
 
-      /* verify that the next 3 bytes are 'S', 'C' and 'F' */
-      case 1: state = (*p++ == 0x53) ? 2 : 0; break;
-      case 2: state = (*p++ == 0x43) ? 3 : 0; break;
-      case 3: state = (*p++ == 0x46) ? 4 : 0; break;
+      /* verify that the next 3 bytes are 'S', 'C' and 'F'. On a mismatch,
+       * go back to state 0 without consuming the byte, it may be an 'M' */
+      case 1: if (*p == 0x53) p++, state = 2; else state = 0; break;
+      case 2: if (*p == 0x43) p++, state = 3; else state = 0; break;
+      case 3: if (*p == 0x46) p++, state = 4; else state = 0; break;
 
       /* we don't care about bytes 4-7 (see default: for action) */
 
@@ -692,54 +888,12 @@ static int cabd_find(struct mscab_decompressor_p *self, unsigned char *buf,
          * the offset in the file of this potential cabinet */
         caboff = offset + (p - &buf[0]) - 20;
 
-        /* should reading cabinet fail, restart search just after 'MSCF' */
-        offset = caboff + 4;
-
-        /* capture the "length of cabinet" field if there is a cabinet at
-         * offset 0 in the file, regardless of whether the cabinet can be
-         * read correctly or not */
-        if (caboff == 0) *firstlen = (off_t) cablen_u32;
-
-        /* check that the files offset is less than the alleged length of
-         * the cabinet, and that the offset + the alleged length are
-         * 'roughly' within the end of overall file length */
-        if ((foffset_u32 < cablen_u32) &&
-            ((caboff + (off_t) foffset_u32) < (flen + 32)) &&
-            ((caboff + (off_t) cablen_u32)  < (flen + 32)) )
+        /* try reading it, which also tells us where to search next */
+        if ((err = cabd_find_cab(self, fh, filename, flen, caboff,
+                                 cablen_u32, foffset_u32, firstlen,
+                                 firstcab, &link, &false_cabs, &offset)))
         {
-          /* likely cabinet found -- try reading it */
-          if (!(cab = (struct mscabd_cabinet_p *) sys->alloc(sys, sizeof(struct mscabd_cabinet_p)))) {
-            return MSPACK_ERR_NOMEMORY;
-          }
-          cab->base.filename = filename;
-          if (cabd_read_headers(sys, fh, cab, caboff, 1)) {
-            /* destroy the failed cabinet */
-            cabd_close((struct mscab_decompressor *) self,
-                       (struct mscabd_cabinet *) cab);
-            false_cabs++;
-          }
-          else {
-            /* cabinet read correctly! */
-
-            /* link the cab into the list */
-            if (!link) *firstcab = cab;
-            else {
-              link->base.next = (struct mscabd_cabinet *) cab;
-              ((struct mscabd_cabinet *)cab)->prev = &link->base;
-            }
-            link = cab;
-
-            /* cause the search to restart after this cab's data. */
-            offset = caboff + (off_t) cablen_u32;
-
-#ifndef LARGEFILE_SUPPORT
-            /* detect 32-bit off_t overflow */
-            if (offset < caboff) {
-              sys->message(fh, largefile_msg);
-              return MSPACK_ERR_OK;
-            }
-#endif        
-          }
+          return err;
         }
 
         /* restart search */
@@ -766,6 +920,335 @@ static int cabd_find(struct mscab_decompressor_p *self, unsigned char *buf,
   return MSPACK_ERR_OK;
 }
                                              
+/***************************************
+ * CABD_FIND_CAB
+ ***************************************
+ * cabd_find_cab is given a possible cabinet header found at caboff by a
+ * search. If the header looks likely, it tries to read the cabinet and
+ * links it into the search results. It sets *offset to where the search
+ * should continue: after the cabinet's data if it was read, otherwise just
+ * after the 'MSCF' signature.
+ */
+#define cabd_likely_cab(caboff, cablen, foffset, flen) \
+  (((foffset) < (cablen)) &&                           \
+   (((caboff) + (off_t) (foffset)) < ((flen) + 32)) && \
+   (((caboff) + (off_t) (cablen))  < ((flen) + 32)))
+
+static int cabd_find_cab(struct mscab_decompressor_p *self,
+                         struct mspack_file *fh, const char *filename,
+                         off_t flen, off_t caboff, unsigned int cablen_u32,
+                         unsigned int foffset_u32, off_t *firstlen,
+                         struct mscabd_cabinet_p **firstcab,
+                         struct mscabd_cabinet_p **link,
+                         int *false_cabs, off_t *offset)
+{
+  struct mspack_system *sys = self->system;
+  struct mscabd_cabinet_p *cab;
+
+  /* should reading cabinet fail, restart search just after 'MSCF' */
+  *offset = caboff + 4;
+
+  /* capture the "length of cabinet" field if there is a cabinet at
+   * offset 0 in the file, regardless of whether the cabinet can be
+   * read correctly or not */
+  if (caboff == 0) *firstlen = (off_t) cablen_u32;
+
+  /* check that the files offset is less than the alleged length of
+   * the cabinet, and that the offset + the alleged length are
+   * 'roughly' within the end of overall file length */
+  if (!cabd_likely_cab(caboff, cablen_u32, foffset_u32, flen)) {
+    return MSPACK_ERR_OK;
+  }
+
+  /* likely cabinet found -- try reading it */
+  if (!(cab = (struct mscabd_cabinet_p *) sys->alloc(sys, sizeof(struct mscabd_cabinet_p)))) {
+    return MSPACK_ERR_NOMEMORY;
+  }
+  cab->base.filename = filename;
+  if (cabd_read_headers(sys, fh, cab, caboff, 1)) {
+    /* destroy the failed cabinet */
+    cabd_close((struct mscab_decompressor *) self,
+               (struct mscabd_cabinet *) cab);
+    (*false_cabs)++;
+  }
+  else {
+    /* cabinet read correctly! */
+
+    /* link the cab into the list */
+    if (!*link) *firstcab = cab;
+    else {
+      (*link)->base.next = (struct mscabd_cabinet *) cab;
+      ((struct mscabd_cabinet *)cab)->prev = &(*link)->base;
+    }
+    *link = cab;
+
+    /* cause the search to restart after this cab's data. */
+    *offset = caboff + (off_t) cablen_u32;
+
+#ifndef LARGEFILE_SUPPORT
+    /* detect 32-bit off_t overflow */
+    if (*offset < caboff) {
+      sys->message(fh, largefile_msg);
+      *offset = flen;
+    }
+#endif
+  }
+  return MSPACK_ERR_OK;
+}
+
+#if HAVE_PTHREAD_H
+/***************************************
+ * CABD_FIND_THREADED, CABD_SEARCH_RANGE
+ ***************************************
+ * cabd_find_threaded splits the file into one range per thread. Each
+ * range is scanned by cabd_search_range, which reads it with its own file
+ * handle and lists the likely cabinet headers in it. The first range is
+ * scanned by the calling thread.
+ *
+ * The lists are then walked in offset order, trying each header with
+ * cabd_find_cab exactly as cabd_find would have done. Headers inside
+ * a cabinet that was read successfully are skipped, just like cabd_find
+ * skips over the cabinet's data, so the results are the same.
+ */
+static int cabd_find_threaded(struct mscab_decompressor_p *self,
+                              struct mspack_file *fh, const char *filename,
+                              off_t flen, int threads, off_t *firstlen,
+                              struct mscabd_cabinet_p **firstcab)
+{
+  struct mspack_system *sys = self->system;
+  struct mscabd_cabinet_p *link = NULL;
+  struct mscabd_search_range *ranges;
+  struct mscabd_candidate *c;
+  unsigned char buf[4];
+  pthread_t *tids;
+  int i, started, false_cabs = 0, err = MSPACK_ERR_OK;
+  off_t next = 0;
+  unsigned int j;
+
+  /* FAQ avoidance strategy */
+  if (sys->read(fh, &buf[0], 4) != 4) return MSPACK_ERR_READ;
+  if (EndGetI32(&buf[0]) == 0x28635349) {
+    sys->message(fh, "WARNING; found InstallShield header. "
+                 "This is probably an InstallShield file. "
+                 "Use UNSHIELD from www.synce.org to unpack it.");
+  }
+
+  ranges = (struct mscabd_search_range *) sys->alloc(sys,
+    threads * sizeof(struct mscabd_search_range));
+  tids = (pthread_t *) sys->alloc(sys, threads * sizeof(pthread_t));
+  if (!ranges || !tids) {
+    sys->free(ranges);
+    sys->free(tids);
+    return MSPACK_ERR_NOMEMORY;
+  }
+
+  for (i = 0; i < threads; i++) {
+    ranges[i].self      = self;
+    ranges[i].filename  = filename;
+    ranges[i].start     = (flen / threads) * i;
+    ranges[i].end       = (i == threads-1) ? flen : (flen / threads) * (i+1);
+    ranges[i].flen      = flen;
+    ranges[i].cands     = NULL;
+    ranges[i].num_cands = ranges[i].max_cands = 0;
+    ranges[i].error     = MSPACK_ERR_OK;
+  }
+
+  /* start threads for all but the first range. If a thread can't be
+   * started, its range and all later ones are scanned by this thread */
+  for (started = 1; started < threads; started++) {
+    if (pthread_create(&tids[started], NULL, &cabd_search_range,
+                       &ranges[started])) break;
+  }
+  cabd_search_range(&ranges[0]);
+  for (i = started; i < threads; i++) cabd_search_range(&ranges[i]);
+  for (i = 1; i < started; i++) pthread_join(tids[i], NULL);
+
+  /* try the headers found, in offset order */
+  for (i = 0; i < threads; i++) {
+    for (j = 0; !err && j < ranges[i].num_cands; j++) {
+      c = &ranges[i].cands[j];
+      if (c->offset < next) continue;
+      err = cabd_find_cab(self, fh, filename, flen, c->offset, c->length,
+                          c->foffset, firstlen, firstcab, &link,
+                          &false_cabs, &next);
+    }
+    /* results after a range that couldn't be fully read are unreliable */
+    if (!err) err = ranges[i].error;
+    sys->free(ranges[i].cands);
+  }
+  sys->free(ranges);
+  sys->free(tids);
+
+  if (false_cabs) {
+    D(("%d false cabinets found", false_cabs))
+  }
+  return err;
+}
+
+static void *cabd_search_range(void *arg) {
+  struct mscabd_search_range *r = (struct mscabd_search_range *) arg;
+  struct mspack_system *sys = r->self->system;
+  cabd_scan_fn scan = cabd_scan_select();
+  struct mscabd_candidate *cands;
+  unsigned int cablen_u32, foffset_u32;
+  unsigned char *buf, *p, *pend;
+  struct mspack_file *fh;
+  off_t pos, stop, caboff;
+  int bufsize, length;
+
+  /* the buffer must hold at least one whole header */
+  bufsize = r->self->param[MSCABD_PARAM_SEARCHBUF];
+  if (bufsize < 64) bufsize = 64;
+
+  /* headers of signatures near the end of the range extend past it */
+  stop = r->end + 19;
+  if (stop > r->flen) stop = r->flen;
+
+  if (!(buf = (unsigned char *) sys->alloc(sys, (size_t) bufsize))) {
+    r->error = MSPACK_ERR_NOMEMORY;
+    return NULL;
+  }
+  if (!(fh = sys->open(sys, r->filename, MSPACK_SYS_OPEN_READ))) {
+    sys->free(buf);
+    r->error = MSPACK_ERR_OPEN;
+    return NULL;
+  }
+
+  /* consecutive reads overlap by 19 bytes, so every signature that
+   * doesn't have its whole header in one read is looked at in the next */
+  for (pos = r->start; (stop - pos) >= 20; pos += length - 19) {
+    length = ((stop - pos) > bufsize) ? bufsize : (int) (stop - pos);
+    if (sys->seek(fh, pos, MSPACK_SYS_SEEK_START)) {
+      r->error = MSPACK_ERR_SEEK;
+      break;
+    }
+    if (sys->read(fh, &buf[0], length) != length) {
+      r->error = MSPACK_ERR_READ;
+      break;
+    }
+
+    pend = &buf[length];
+    for (p = &buf[0]; (pend - (p = scan(p, pend))) >= 20; p += 4) {
+      caboff = pos + (p - &buf[0]);
+      if (caboff >= r->end) break;
+      cablen_u32  = EndGetI32(&p[8]);
+      foffset_u32 = EndGetI32(&p[16]);
+
+      /* keep likely headers, and any header at offset 0 as its length
+       * is reported even if it's not a cabinet */
+      if (caboff != 0 &&
+          !cabd_likely_cab(caboff, cablen_u32, foffset_u32, r->flen))
+      {
+        continue;
+      }
+
+      if (r->num_cands == r->max_cands) {
+        r->max_cands = r->max_cands ? r->max_cands * 2 : 64;
+        cands = (struct mscabd_candidate *) sys->alloc(sys,
+          r->max_cands * sizeof(struct mscabd_candidate));
+        if (!cands) {
+          r->error = MSPACK_ERR_NOMEMORY;
+          break;
+        }
+        if (r->cands) {
+          sys->copy(r->cands, cands,
+                    r->num_cands * sizeof(struct mscabd_candidate));
+          sys->free(r->cands);
+        }
+        r->cands = cands;
+      }
+      r->cands[r->num_cands].offset  = caboff;
+      r->cands[r->num_cands].length  = cablen_u32;
+      r->cands[r->num_cands].foffset = foffset_u32;
+      r->num_cands++;
+    }
+    if (r->error) break;
+  }
+
+  sys->close(fh);
+  sys->free(buf);
+  return NULL;
+}
+#endif
+
+/***************************************
+ * CABD_SCAN_SELECT, CABD_SCAN_SIG, CABD_SCAN_SIG_SSE2, CABD_SCAN_SIG_AVX2
+ ***************************************
+ * the signature scanners return a pointer to the first 'MSCF' signature
+ * between p and pend. If there is none, but the buffer ends with 'M',
+ * 'MS' or 'MSC', they return a pointer to that partial signature instead,
+ * otherwise they return pend.
+ *
+ * the SSE2 and AVX2 scanners compare 16 or 32 candidate positions at once,
+ * testing all four signature bytes for each of them. They leave the end
+ * of the buffer to cabd_scan_sig(). cabd_scan_select() returns the best
+ * scanner the CPU can run.
+ */
+static cabd_scan_fn cabd_scan_select(void) {
+#ifdef CABD_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return &cabd_scan_sig_avx2;
+  if (__builtin_cpu_supports("sse2")) return &cabd_scan_sig_sse2;
+#endif
+  return &cabd_scan_sig;
+}
+
+static unsigned char *cabd_scan_sig(unsigned char *p, unsigned char *pend) {
+  for (; p < pend; p++) {
+    if (!(p = (unsigned char *) memchr(p, 0x4D, (size_t) (pend - p)))) break;
+    if ((p + 1 >= pend || p[1] == 0x53) &&
+        (p + 2 >= pend || p[2] == 0x43) &&
+        (p + 3 >= pend || p[3] == 0x46)) return p;
+  }
+  return pend;
+}
+
+#ifdef CABD_SIMD
+__attribute__((target("sse2")))
+static unsigned char *cabd_scan_sig_sse2(unsigned char *p, unsigned char *pend)
+{
+  const __m128i m = _mm_set1_epi8(0x4D), s = _mm_set1_epi8(0x53);
+  const __m128i c = _mm_set1_epi8(0x43), f = _mm_set1_epi8(0x46);
+  __m128i v0, v1, v2, v3;
+  unsigned int mask;
+
+  /* each pass reads 19 bytes: 16 candidates plus 3 following bytes */
+  for (; (pend - p) >= 19; p += 16) {
+    v0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[0]), m);
+    v1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[1]), s);
+    v2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[2]), c);
+    v3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[3]), f);
+    v0 = _mm_and_si128(_mm_and_si128(v0, v1), _mm_and_si128(v2, v3));
+    if ((mask = (unsigned int) _mm_movemask_epi8(v0))) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return cabd_scan_sig(p, pend);
+}
+
+__attribute__((target("avx2")))
+static unsigned char *cabd_scan_sig_avx2(unsigned char *p, unsigned char *pend)
+{
+  const __m256i m = _mm256_set1_epi8(0x4D), s = _mm256_set1_epi8(0x53);
+  const __m256i c = _mm256_set1_epi8(0x43), f = _mm256_set1_epi8(0x46);
+  __m256i v0, v1, v2, v3;
+  unsigned int mask;
+
+  /* each pass reads 35 bytes: 32 candidates plus 3 following bytes */
+  for (; (pend - p) >= 35; p += 32) {
+    v0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[0]), m);
+    v1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[1]), s);
+    v2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[2]), c);
+    v3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[3]), f);
+    v0 = _mm256_and_si256(_mm256_and_si256(v0, v1), _mm256_and_si256(v2, v3));
+    if ((mask = (unsigned int) _mm256_movemask_epi8(v0))) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return cabd_scan_sig_sse2(p, pend);
+}
+#endif
+
 /***************************************
  * CABD_MERGE, CABD_PREPEND, CABD_APPEND
  ***************************************
@@ -859,7 +1342,9 @@ static int cabd_merge(struct mscab_decompressor *base,
     }
 
     /* allocate a new folder data structure */
-    if (!(data = (struct mscabd_folder_data *) sys->alloc(sys, sizeof(struct mscabd_folder_data)))) {
+    if (!(data = (struct mscabd_folder_data *) cabd_arena_alloc(sys,
+          (struct mscabd_cabinet_p *) rcab, sizeof(struct mscabd_folder_data))))
+    {
       return self->error = MSPACK_ERR_NOMEMORY;
     }
 
@@ -879,6 +1364,7 @@ static int cabd_merge(struct mscab_decompressor *base,
      * rfol->merge_next is going to be deleted, so keep lfol's version
      * instead */
     lfol->base.num_blocks += rfol->base.num_blocks - 1;
+    lfol->base.data_length += rfol->base.data_length;
     if ((rfol->merge_next == NULL) ||
         (rfol->merge_next->folder != (struct mscabd_folder *) rfol))
     {
@@ -889,8 +1375,7 @@ static int cabd_merge(struct mscab_decompressor *base,
     while (lfol->base.next) lfol = (struct mscabd_folder_p *) lfol->base.next;
     lfol->base.next = rfol->base.next;
 
-    /* free disused merge folder */
-    sys->free(rfol);
+    /* the disused merge folder stays in rcab's arena until closed */
 
     /* attach rfol's files */
     fi = lcab->files;
@@ -901,26 +1386,27 @@ static int cabd_merge(struct mscab_decompressor *base,
     lfi = NULL;
     for (fi = lcab->files; fi ; fi = rfi) {
       rfi = fi->next;
-      /* if file's folder matches the merge folder, unlink and free it */
+      /* if file's folder matches the merge folder, unlink it */
       if (fi->folder == (struct mscabd_folder *) rfol) {
         if (lfi) lfi->next = rfi; else lcab->files = rfi;
-        sys->free(fi->filename);
-        sys->free(fi);
       }
       else lfi = fi;
     }
   }
 
   /* all done! fix files and folders pointers in all cabs so they all
-   * point to the same list  */
+   * point to the same list. Any filename index is now out of date */
+  cabd_free_index(sys, lcab);
   for (cab = lcab->prevcab; cab; cab = cab->prevcab) {
     cab->files   = lcab->files;
     cab->folders = lcab->folders;
+    cabd_free_index(sys, cab);
   }
 
   for (cab = lcab->nextcab; cab; cab = cab->nextcab) {
     cab->files   = lcab->files;
     cab->folders = lcab->folders;
+    cabd_free_index(sys, cab);
   }
 
   return self->error = MSPACK_ERR_OK;
@@ -1035,13 +1521,10 @@ static int cabd_extract(struct mscab_decompressor *base,
     /* free any existing decompressor */
     cabd_free_decomp(self);
 
-    /* do we need to open a new cab file? */
+    /* do we need to change to a different cab file? */
     if (!self->d->infh || (fol->data.cab != self->d->incab)) {
-      /* close previous file handle if from a different cab */
-      if (self->d->infh) sys->close(self->d->infh);
       self->d->incab = fol->data.cab;
-      self->d->infh = sys->open(sys, fol->data.cab->base.filename,
-                                MSPACK_SYS_OPEN_READ);
+      self->d->infh = cabd_open_handle(self, fol->data.cab);
       if (!self->d->infh) return self->error = MSPACK_ERR_OPEN;
     }
     /* seek to start of data blocks */
@@ -1053,6 +1536,7 @@ static int cabd_extract(struct mscab_decompressor *base,
     if (cabd_init_decomp(self, (unsigned int) fol->base.comp_type)) {
       return self->error;
     }
+    self->stats.folder_resets++;
 
     /* initialise new folder state */
     self->d->folder = fol;
@@ -1082,16 +1566,34 @@ static int cabd_extract(struct mscab_decompressor *base,
      *   and pass back MSPACK_ERR_READ
      */
     self->d->outfh = NULL;
-    if ((bytes = file->offset - self->d->offset)) {
-      error = self->d->decompress(self->d->state, bytes);
+    bytes = file->offset - self->d->offset;
+    if (bytes && ((self->d->comp_type & cffoldCOMPTYPE_MASK) ==
+                  cffoldCOMPTYPE_NONE))
+    {
+      bytes -= cabd_skip_blocks(self, bytes);
+    }
+    if (bytes) {
+      error = cabd_decompress(self, bytes);
       self->error = (error == MSPACK_ERR_READ) ? self->read_error : error;
     }
 
     /* if getting to the correct offset was error free, unpack file */
     if (!self->error) {
       self->d->outfh = fh;
-      error = self->d->decompress(self->d->state, (off_t) file->length);
-      self->error = (error == MSPACK_ERR_READ) ? self->read_error : error;
+      bytes = (off_t) file->length;
+      if (sys->transfer && ((self->d->comp_type & cffoldCOMPTYPE_MASK) ==
+                            cffoldCOMPTYPE_NONE))
+      {
+        double start = self->param[MSCABD_PARAM_STATS] ? mspack_clock() : 0.0;
+        bytes -= cabd_copy_blocks(self, fh, bytes);
+        if (self->param[MSCABD_PARAM_STATS]) {
+          self->stats.write_time += mspack_clock() - start;
+        }
+      }
+      if (bytes && !self->error) {
+        error = cabd_decompress(self, bytes);
+        self->error = (error == MSPACK_ERR_READ) ? self->read_error : error;
+      }
     }
   }
 
@@ -1102,6 +1604,31 @@ static int cabd_extract(struct mscab_decompressor *base,
   return self->error;
 }
 
+/***************************************
+ * CABD_DECOMPRESS
+ ***************************************
+ * runs the folder's decompressor for the given number of output bytes.
+ * if MSCABD_PARAM_STATS is set, the time it takes is added to the decode
+ * time, less the time spent in reading, checksums, E8 translation and
+ * writing while it ran, as those are timed on their own
+ */
+static int cabd_decompress(struct mscab_decompressor_p *self, off_t bytes)
+{
+  struct mscabd_stats *s = &self->stats;
+  double start, nested;
+  int error;
+
+  if (!self->param[MSCABD_PARAM_STATS]) {
+    return self->d->decompress(self->d->state, bytes);
+  }
+  nested = s->read_time + s->checksum_time + s->e8_time + s->write_time;
+  start  = mspack_clock();
+  error  = self->d->decompress(self->d->state, bytes);
+  s->decode_time += (mspack_clock() - start) -
+    (s->read_time + s->checksum_time + s->e8_time + s->write_time - nested);
+  return error;
+}
+
 /***************************************
  * CABD_INIT_DECOMP, CABD_FREE_DECOMP
  ***************************************
@@ -1141,6 +1668,9 @@ static int cabd_init_decomp(struct mscab_decompressor_p *self, unsigned int ct)
     self->d->decompress = (int (*)(void *, off_t)) &lzxd_decompress;
     self->d->state = lzxd_init(&self->d->sys, fh, fh, (int) (ct >> 8) & 0x1f, 0,
                                self->param[MSCABD_PARAM_DECOMPBUF], (off_t)0,0);
+    if (self->d->state && self->param[MSCABD_PARAM_STATS]) {
+      ((struct lzxd_stream *) self->d->state)->stats = &self->stats;
+    }
     break;
   default:
     return self->error = MSPACK_ERR_DATAFORMAT;
@@ -1204,9 +1734,19 @@ static int cabd_sys_read(struct mspack_file *file, void *buffer, int bytes) {
         break;
       }
 
-      /* read a block */
-      self->read_error = cabd_sys_read_block(sys, self->d, &outlen, ignore_cksum);
+      /* read a block. the time spent checking its checksum is not
+       * counted as time spent reading it */
+      if (self->param[MSCABD_PARAM_STATS]) {
+        double start = mspack_clock(), cksum_time = self->stats.checksum_time;
+        self->read_error = cabd_sys_read_block(self, &outlen, ignore_cksum);
+        self->stats.read_time += (mspack_clock() - start) -
+          (self->stats.checksum_time - cksum_time);
+      }
+      else {
+        self->read_error = cabd_sys_read_block(self, &outlen, ignore_cksum);
+      }
       if (self->read_error) return -1;
+      self->stats.blocks++;
 
       /* special Quantum hack -- trailer byte to allow the decompressor
        * to realign itself. CAB Quantum blocks, unlike LZX blocks, can have
@@ -1240,7 +1780,14 @@ static int cabd_sys_read(struct mspack_file *file, void *buffer, int bytes) {
 static int cabd_sys_write(struct mspack_file *file, void *buffer, int bytes) {
   struct mscab_decompressor_p *self = (struct mscab_decompressor_p *) file;
   self->d->offset += bytes;
+  self->stats.out_bytes += bytes;
   if (self->d->outfh) {
+    if (self->param[MSCABD_PARAM_STATS]) {
+      double start = mspack_clock();
+      int written = self->system->write(self->d->outfh, buffer, bytes);
+      self->stats.write_time += mspack_clock() - start;
+      return written;
+    }
     return self->system->write(self->d->outfh, buffer, bytes);
   }
   return bytes;
@@ -1252,10 +1799,11 @@ static int cabd_sys_write(struct mspack_file *file, void *buffer, int bytes) {
  * reads a whole data block from a cab file. the block may span more than
  * one cab file, if it does then the fragments will be reassembled
  */
-static int cabd_sys_read_block(struct mspack_system *sys,
-                               struct mscabd_decompress_state *d,
+static int cabd_sys_read_block(struct mscab_decompressor_p *self,
                                int *out, int ignore_cksum)
 {
+  struct mspack_system *sys = self->system;
+  struct mscabd_decompress_state *d = self->d;
   unsigned char hdr[cfdata_SIZEOF];
   unsigned int cksum;
   int len;
@@ -1295,10 +1843,22 @@ static int cabd_sys_read_block(struct mspack_system *sys,
     if (sys->read(d->infh, d->i_end, len) != len) {
       return MSPACK_ERR_READ;
     }
+    self->stats.in_bytes += cfdata_SIZEOF + d->data->cab->block_resv + len;
 
     /* perform checksum test on the block (if one is stored) */
-    if ((cksum = EndGetI32(&hdr[cfdata_CheckSum]))) {
-      unsigned int sum2 = cabd_checksum(d->i_end, (unsigned int) len, 0);
+    if (self->param[MSCABD_PARAM_CHECKSUMS] &&
+        (cksum = EndGetI32(&hdr[cfdata_CheckSum])))
+    {
+      unsigned int sum2;
+      if (self->param[MSCABD_PARAM_STATS]) {
+        double start = mspack_clock();
+        sum2 = self->checksum(d->i_end, (unsigned int) len, 0);
+        self->stats.checksum_time += mspack_clock() - start;
+      }
+      else {
+        sum2 = self->checksum(d->i_end, (unsigned int) len, 0);
+      }
+      self->stats.checksums++;
       if (cabd_checksum(&hdr[4], 4, sum2) != cksum) {
         if (!ignore_cksum) return MSPACK_ERR_CHECKSUM;
         sys->message(d->infh, "WARNING; bad block checksum found");
@@ -1319,9 +1879,6 @@ static int cabd_sys_read_block(struct mspack_system *sys,
     }
 
     /* otherwise, advance to next cabinet */
-
-    /* close current file handle */
-    sys->close(d->infh);
     d->infh = NULL;
 
     /* advance to next member in the cabinet set */
@@ -1330,11 +1887,9 @@ static int cabd_sys_read_block(struct mspack_system *sys,
       return MSPACK_ERR_DATAFORMAT;
     }
 
-    /* open next cab file */
+    /* get next cab file, the current one stays in the handle cache */
     d->incab = d->data->cab;
-    if (!(d->infh = sys->open(sys, d->incab->base.filename,
-                              MSPACK_SYS_OPEN_READ)))
-    {
+    if (!(d->infh = cabd_open_handle(self, d->incab))) {
       return MSPACK_ERR_OPEN;
     }
 
@@ -1348,6 +1903,373 @@ static int cabd_sys_read_block(struct mspack_system *sys,
   return MSPACK_ERR_OK;
 }
 
+/***************************************
+ * CABD_SKIP_BLOCKS
+ ***************************************
+ * skips forward in a folder with no compression, without reading the data
+ * skipped. the rest of the current block is dropped, then whole blocks
+ * are passed over by reading only their headers. it stops before a block
+ * that holds the target offset, that is split across cabinets, or that
+ * doesn't look like stored data, and leaves that to the decompressor.
+ * skipped blocks don't have their checksums checked, as their data is not
+ * used. returns the number of bytes skipped
+ */
+static off_t cabd_skip_blocks(struct mscab_decompressor_p *self, off_t bytes)
+{
+  struct mspack_system *sys = self->system;
+  struct mscabd_decompress_state *d = self->d;
+  unsigned char hdr[cfdata_SIZEOF];
+  unsigned int len, out;
+  off_t skipped, pos;
+
+  /* drop the unread part of the current block */
+  skipped = d->i_end - d->i_ptr;
+  if (skipped > bytes) skipped = bytes;
+  d->i_ptr += skipped;
+
+  while (d->i_ptr == d->i_end && skipped < bytes &&
+         d->block < d->folder->base.num_blocks)
+  {
+    if ((pos = sys->tell(d->infh)) < 0) break;
+    if (sys->read(d->infh, &hdr[0], cfdata_SIZEOF) != cfdata_SIZEOF) {
+      sys->seek(d->infh, pos, MSPACK_SYS_SEEK_START);
+      break;
+    }
+    len = EndGetI16(&hdr[cfdata_CompressedSize]);
+    out = EndGetI16(&hdr[cfdata_UncompressedSize]);
+    if (!out || len != out || (off_t) out > (bytes - skipped) ||
+        sys->seek(d->infh, (off_t) (d->data->cab->block_resv + len),
+                  MSPACK_SYS_SEEK_CUR))
+    {
+      sys->seek(d->infh, pos, MSPACK_SYS_SEEK_START);
+      break;
+    }
+    d->block++;
+    skipped += out;
+    self->stats.in_bytes += cfdata_SIZEOF;
+  }
+
+  d->offset += skipped;
+  self->stats.out_bytes += skipped;
+  return skipped;
+}
+
+/***************************************
+ * CABD_COPY_BLOCKS
+ ***************************************
+ * copies a file's data from a folder with no compression, using the
+ * system's transfer() method to copy it straight from the cabinet file
+ * to the output file. the rest of the current block is written out as
+ * usual, then whole blocks are copied one at a time, reading only their
+ * headers. blocks with a checksum are read and written out as usual if
+ * checksums are being checked. it stops before a block that isn't wholly
+ * in the file, is split across cabinets, doesn't look like stored data or
+ * has a bad checksum, or if transfer() can't copy, and leaves that to the
+ * decompressor. returns the number of bytes written out; if that fails,
+ * self->error is set
+ */
+static off_t cabd_copy_blocks(struct mscab_decompressor_p *self,
+                              struct mspack_file *fh, off_t bytes)
+{
+  struct mspack_system *sys = self->system;
+  struct mscabd_decompress_state *d = self->d;
+  unsigned char hdr[cfdata_SIZEOF];
+  unsigned int len, out, cksum, sum2;
+  off_t copied, pos, done;
+
+  /* write out the unread part of the current block */
+  copied = d->i_end - d->i_ptr;
+  if (copied > bytes) copied = bytes;
+  if (copied && sys->write(fh, d->i_ptr, (int) copied) != (int) copied) {
+    self->error = MSPACK_ERR_WRITE;
+    return 0;
+  }
+  d->i_ptr += copied;
+  d->offset += (unsigned int) copied;
+
+  while (d->i_ptr == d->i_end && copied < bytes &&
+         d->block < d->folder->base.num_blocks)
+  {
+    if ((pos = sys->tell(d->infh)) < 0) break;
+    if (sys->read(d->infh, &hdr[0], cfdata_SIZEOF) != cfdata_SIZEOF) {
+      sys->seek(d->infh, pos, MSPACK_SYS_SEEK_START);
+      break;
+    }
+    len = EndGetI16(&hdr[cfdata_CompressedSize]);
+    out = EndGetI16(&hdr[cfdata_UncompressedSize]);
+    if (!out || len != out || (off_t) out > (bytes - copied) ||
+        (d->data->cab->block_resv &&
+         sys->seek(d->infh, (off_t) d->data->cab->block_resv,
+                   MSPACK_SYS_SEEK_CUR)))
+    {
+      sys->seek(d->infh, pos, MSPACK_SYS_SEEK_START);
+      break;
+    }
+
+    if (self->param[MSCABD_PARAM_CHECKSUMS] &&
+        (cksum = EndGetI32(&hdr[cfdata_CheckSum])))
+    {
+      /* the block must be read to check it, so write it out as usual */
+      if (sys->read(d->infh, &d->input[0], (int) len) != (int) len) {
+        sys->seek(d->infh, pos, MSPACK_SYS_SEEK_START);
+        break;
+      }
+      sum2 = self->checksum(&d->input[0], len, 0);
+      self->stats.checksums++;
+      if (cabd_checksum(&hdr[4], 4, sum2) != cksum) {
+        sys->seek(d->infh, pos, MSPACK_SYS_SEEK_START);
+        break;
+      }
+      if (sys->write(fh, &d->input[0], (int) len) != (int) len) {
+        self->error = MSPACK_ERR_WRITE;
+        break;
+      }
+    }
+    else {
+      if ((done = sys->transfer(d->infh, fh, (off_t) len)) < 0) {
+        self->error = MSPACK_ERR_WRITE;
+        break;
+      }
+      if (done < (off_t) len) {
+        /* the rest of the block becomes the current block */
+        d->i_ptr = d->i_end = &d->input[0];
+        if (sys->read(d->infh, &d->input[0], (int) (len - done))
+            != (int) (len - done))
+        {
+          self->error = MSPACK_ERR_READ;
+          break;
+        }
+        d->i_end += len - done;
+        d->block++;
+        d->offset += (unsigned int) done;
+        copied += done;
+        self->stats.blocks++;
+        self->stats.in_bytes += cfdata_SIZEOF + d->data->cab->block_resv + len;
+        break;
+      }
+    }
+    d->block++;
+    d->offset += out;
+    copied += out;
+    self->stats.blocks++;
+    self->stats.in_bytes += cfdata_SIZEOF + d->data->cab->block_resv + len;
+  }
+  self->stats.out_bytes += copied;
+
+  /* a failed copy leaves the folder's input in an unknown state */
+  if (self->error) cabd_free_decomp(self);
+  return copied;
+}
+
+/***************************************
+ * CABD_CHECK_FOLDER
+ ***************************************
+ * reads every data block of a folder, following split blocks into the
+ * next cabinet like cabd_sys_read_block() does, and checks their headers
+ * and checksums. nothing is decompressed. the decompressor's current
+ * folder is dropped, as the file handle it reads from may be moved
+ */
+static int cabd_check_folder(struct mscab_decompressor *base,
+                             struct mscabd_folder *folder,
+                             unsigned int *block, unsigned int *unchecked)
+{
+  struct mscab_decompressor_p *self = (struct mscab_decompressor_p *) base;
+  struct mscabd_folder_p *fol = (struct mscabd_folder_p *) folder;
+  struct mscabd_folder_data *data;
+  struct mspack_system *sys;
+  struct mspack_file *fh;
+  unsigned char hdr[cfdata_SIZEOF], *buf;
+  unsigned int blk = 0, nosum = 0, len, out, total, cksum;
+  int stored, summed, err = MSPACK_ERR_OK;
+
+  if (!self) return MSPACK_ERR_ARGS;
+  if (!fol) return self->error = MSPACK_ERR_ARGS;
+  sys = self->system;
+
+  if (block) *block = 0;
+  if (unchecked) *unchecked = 0;
+
+  /* the whole folder must be in the loaded cabinet set */
+  if (fol->merge_prev || fol->merge_next) {
+    sys->message(NULL, "ERROR; folder cannot be checked, "
+                 "cabinet set is incomplete.");
+    return self->error = MSPACK_ERR_DATAFORMAT;
+  }
+
+  /* the current folder must be restarted, as opening handles below can
+   * close its input file handle */
+  cabd_free_decomp(self);
+  if (self->d) {
+    self->d->infh  = NULL;
+    self->d->incab = NULL;
+  }
+  if (!(buf = (unsigned char *) sys->alloc(sys, (size_t) CAB_INPUTMAX))) {
+    return self->error = MSPACK_ERR_NOMEMORY;
+  }
+  stored = (fol->base.comp_type & cffoldCOMPTYPE_MASK) == cffoldCOMPTYPE_NONE;
+
+  data = &fol->data;
+  if (!(fh = cabd_open_handle(self, data->cab))) {
+    err = MSPACK_ERR_OPEN;
+  }
+  else if (sys->seek(fh, data->offset, MSPACK_SYS_SEEK_START)) {
+    err = MSPACK_ERR_SEEK;
+  }
+
+  for (; !err && blk < fol->base.num_blocks; blk++) {
+    total = 0;
+    summed = 1;
+    while (1) {
+      /* read the block header, skipping any reserved block headers */
+      if (sys->read(fh, &hdr[0], cfdata_SIZEOF) != cfdata_SIZEOF) {
+        err = MSPACK_ERR_READ;
+        break;
+      }
+      if (data->cab->block_resv &&
+          sys->seek(fh, (off_t) data->cab->block_resv, MSPACK_SYS_SEEK_CUR))
+      {
+        err = MSPACK_ERR_SEEK;
+        break;
+      }
+
+      /* the same limits as cabd_sys_read_block() */
+      len = EndGetI16(&hdr[cfdata_CompressedSize]);
+      out = EndGetI16(&hdr[cfdata_UncompressedSize]);
+      if ((total += len) > CAB_INPUTMAX || out > CAB_BLOCKMAX) {
+        err = MSPACK_ERR_DATAFORMAT;
+        break;
+      }
+
+      if (sys->read(fh, buf, (int) len) != (int) len) {
+        err = MSPACK_ERR_READ;
+        break;
+      }
+      if ((cksum = EndGetI32(&hdr[cfdata_CheckSum]))) {
+        if (cabd_checksum(&hdr[4], 4, self->checksum(buf, len, 0)) != cksum) {
+          err = MSPACK_ERR_CHECKSUM;
+          break;
+        }
+      }
+      else {
+        summed = 0;
+      }
+
+      /* a non-zero uncompressed size ends the block */
+      if (out) {
+        /* something must decompress to the data, stored data is itself */
+        if (!total || (stored && total != out)) err = MSPACK_ERR_DATAFORMAT;
+        break;
+      }
+
+      /* the rest of the block is in the next cabinet in the set */
+      if (!(data = data->next)) {
+        err = MSPACK_ERR_DATAFORMAT;
+        break;
+      }
+      if (!(fh = cabd_open_handle(self, data->cab))) {
+        err = MSPACK_ERR_OPEN;
+        break;
+      }
+      if (sys->seek(fh, data->offset, MSPACK_SYS_SEEK_START)) {
+        err = MSPACK_ERR_SEEK;
+        break;
+      }
+    }
+    if (err) break;
+    if (!summed) nosum++;
+  }
+
+  sys->free(buf);
+  if (block) *block = err ? blk : fol->base.num_blocks;
+  if (unchecked) *unchecked = nosum;
+  return self->error = err;
+}
+
+/***************************************
+ * CABD_OPEN_HANDLE, CABD_CLOSE_HANDLES
+ ***************************************
+ * cabd_open_handle returns an open file handle for a cabinet's file. The
+ * decompressor keeps up to MSCABD_PARAM_MAXHANDLES of them open, so that
+ * moving back and forth between the cabinets of a set doesn't reopen
+ * their files. If the cache is full, the least recently used file is
+ * closed. Callers must seek before reading, as a cached file is left
+ * wherever it was last read.
+ *
+ * cabd_close_handles closes the cached file of a cabinet, or all cached
+ * files if cab is NULL
+ */
+static struct mspack_file *cabd_open_handle(struct mscab_decompressor_p *self,
+                                            struct mscabd_cabinet_p *cab)
+{
+  struct mspack_system *sys = self->system;
+  struct mscabd_handle *h, *lru = NULL;
+  int i, max = self->param[MSCABD_PARAM_MAXHANDLES];
+
+  if (!self->handles) {
+    self->handles = (struct mscabd_handle *) sys->alloc(sys,
+      max * sizeof(struct mscabd_handle));
+    if (!self->handles) return NULL;
+    for (i = 0; i < max; i++) self->handles[i].cab = NULL;
+  }
+
+  /* find the cabinet's file, or else a free or least recently used slot */
+  for (i = 0; i < max; i++) {
+    h = &self->handles[i];
+    if (h->cab == cab) {
+      h->last_use = ++self->handle_clock;
+      return h->fh;
+    }
+    if (!lru || (lru->cab && (!h->cab || h->last_use < lru->last_use))) {
+      lru = h;
+    }
+  }
+
+  if (lru->cab) sys->close(lru->fh);
+  if (!(lru->fh = sys->open(sys, cab->base.filename, MSPACK_SYS_OPEN_READ))) {
+    lru->cab = NULL;
+    return NULL;
+  }
+  lru->cab = cab;
+  lru->last_use = ++self->handle_clock;
+  return lru->fh;
+}
+
+static void cabd_close_handles(struct mscab_decompressor_p *self,
+                               struct mscabd_cabinet *cab)
+{
+  int i;
+  if (!self->handles) return;
+  for (i = 0; i < self->param[MSCABD_PARAM_MAXHANDLES]; i++) {
+    if (self->handles[i].cab && (!cab ||
+        self->handles[i].cab == (struct mscabd_cabinet_p *) cab))
+    {
+      self->system->close(self->handles[i].fh);
+      self->handles[i].cab = NULL;
+    }
+  }
+}
+
+/***************************************
+ * CABD_CHECKSUM_SELECT, CABD_CHECKSUM, CABD_CHECKSUM_SSE2/AVX2
+ ***************************************
+ * a block's checksum is the XOR of its little-endian 32-bit words, with
+ * any last 1 to 3 bytes making one more word, most significant first.
+ *
+ * the SSE2 and AVX2 versions XOR 16 or 32 bytes at once, then fold the
+ * lanes together, which gives the same result as XOR is associative.
+ * they leave the end of the data to cabd_checksum(). they are only built
+ * for x86, which is little-endian like the checksum.
+ * cabd_checksum_select() returns the best version the CPU can run.
+ */
+static cabd_checksum_fn cabd_checksum_select(void) {
+#ifdef CABD_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return &cabd_checksum_avx2;
+  if (__builtin_cpu_supports("sse2")) return &cabd_checksum_sse2;
+#endif
+  return &cabd_checksum;
+}
+
 static unsigned int cabd_checksum(unsigned char *data, unsigned int bytes,
                                   unsigned int cksum)
 {
@@ -1367,6 +2289,43 @@ static unsigned int cabd_checksum(unsigned char *data, unsigned int bytes,
   return cksum;
 }
 
+#ifdef CABD_SIMD
+__attribute__((target("sse2")))
+static unsigned int cabd_checksum_sse2(unsigned char *data,
+                                       unsigned int bytes, unsigned int cksum)
+{
+  __m128i acc = _mm_setzero_si128();
+  unsigned int len;
+
+  for (len = bytes >> 4; len--; data += 16) {
+    acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *) data));
+  }
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+  cksum ^= (unsigned int) _mm_cvtsi128_si32(acc);
+  return cabd_checksum(data, bytes & 15, cksum);
+}
+
+__attribute__((target("avx2")))
+static unsigned int cabd_checksum_avx2(unsigned char *data,
+                                       unsigned int bytes, unsigned int cksum)
+{
+  __m256i acc = _mm256_setzero_si256();
+  __m128i acc2;
+  unsigned int len;
+
+  for (len = bytes >> 5; len--; data += 32) {
+    acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *) data));
+  }
+  acc2 = _mm_xor_si128(_mm256_castsi256_si128(acc),
+                       _mm256_extracti128_si256(acc, 1));
+  acc2 = _mm_xor_si128(acc2, _mm_srli_si128(acc2, 8));
+  acc2 = _mm_xor_si128(acc2, _mm_srli_si128(acc2, 4));
+  cksum ^= (unsigned int) _mm_cvtsi128_si32(acc2);
+  return cabd_checksum_sse2(data, bytes & 31, cksum);
+}
+#endif
+
 /***************************************
  * NONED_INIT, NONED_DECOMPRESS, NONED_FREE
  ***************************************
@@ -1444,12 +2403,147 @@ static int cabd_param(struct mscab_decompressor *base, int param, int value) {
     if (value < 4) return MSPACK_ERR_ARGS;
     self->param[MSCABD_PARAM_DECOMPBUF] = value;
     break;
+  case MSCABD_PARAM_SEARCHTHREADS:
+    if (value < 1) return MSPACK_ERR_ARGS;
+    self->param[MSCABD_PARAM_SEARCHTHREADS] = value;
+    break;
+  case MSCABD_PARAM_MAXHANDLES:
+    if (value < 1) return MSPACK_ERR_ARGS;
+    /* the cache is resized by discarding it. The current folder must be
+     * restarted, as its input file handle is closed */
+    if (self->handles) {
+      if (self->d) {
+        cabd_free_decomp(self);
+        self->d->infh = NULL;
+      }
+      cabd_close_handles(self, NULL);
+      self->system->free(self->handles);
+      self->handles = NULL;
+    }
+    self->param[MSCABD_PARAM_MAXHANDLES] = value;
+    break;
+  case MSCABD_PARAM_CHECKSUMS:
+    self->param[MSCABD_PARAM_CHECKSUMS] = value;
+    break;
+  case MSCABD_PARAM_STATS:
+    /* an LZX decompressor already set up keeps its choice until the
+     * folder is restarted */
+    self->param[MSCABD_PARAM_STATS] = value;
+    break;
   default:
     return MSPACK_ERR_ARGS;
   }
   return MSPACK_ERR_OK;
 }
 
+/***************************************
+ * CABD_FIND_FILE, CABD_FREE_INDEX
+ ***************************************
+ * cabd_find_file looks up a file by name using a hash index of the
+ * cabinet's filenames, building the index on first use. Names are
+ * compared after cabd_name_char() has normalised each character according
+ * to the MSCABD_FIND_* flags.
+ *
+ * cabd_free_index discards a cabinet's filename index
+ */
+static int cabd_name_char(unsigned char c, int flags) {
+  if ((flags & MSCABD_FIND_ANYSLASH) && c == '\\') return '/';
+  if ((flags & MSCABD_FIND_CASEFOLD) && c >= 'A' && c <= 'Z') return c + 32;
+  return c;
+}
+
+static const unsigned char *cabd_name_start(const char *name, int flags) {
+  const unsigned char *p = (const unsigned char *) name;
+  if (flags & MSCABD_FIND_ANYSLASH) while (*p == '/' || *p == '\\') p++;
+  return p;
+}
+
+/* FNV-1a hash of a normalised filename */
+static unsigned int cabd_name_hash(const char *name, int flags) {
+  const unsigned char *p = cabd_name_start(name, flags);
+  unsigned int hash = 2166136261U;
+  while (*p) hash = (hash ^ cabd_name_char(*p++, flags)) * 16777619U;
+  return hash;
+}
+
+static int cabd_name_equal(const char *a, const char *b, int flags) {
+  const unsigned char *p = cabd_name_start(a, flags);
+  const unsigned char *q = cabd_name_start(b, flags);
+  while (*p && cabd_name_char(*p, flags) == cabd_name_char(*q, flags)) {
+    p++, q++;
+  }
+  return cabd_name_char(*p, flags) == cabd_name_char(*q, flags);
+}
+
+static struct mscabd_file *cabd_find_file(struct mscab_decompressor *base,
+                                          struct mscabd_cabinet *cab,
+                                          const char *filename, int flags)
+{
+  struct mscab_decompressor_p *self = (struct mscab_decompressor_p *) base;
+  struct mscabd_name_index *index;
+  struct mscabd_file *fi, *match;
+  unsigned int num_files, slots, i;
+  struct mspack_system *sys;
+
+  if (!self) return NULL;
+  if (!cab || !filename) {
+    self->error = MSPACK_ERR_ARGS;
+    return NULL;
+  }
+  sys = self->system;
+  self->error = MSPACK_ERR_OK;
+
+  /* discard an index built with different flags */
+  index = ((struct mscabd_cabinet_p *) cab)->index;
+  if (index && index->flags != flags) {
+    cabd_free_index(sys, cab);
+    index = NULL;
+  }
+
+  if (!index) {
+    /* size the table so it is never more than half full */
+    for (num_files = 0, fi = cab->files; fi; fi = fi->next) num_files++;
+    for (slots = 16; slots < (num_files * 2); slots <<= 1);
+
+    index = (struct mscabd_name_index *) sys->alloc(sys,
+      sizeof(struct mscabd_name_index) +
+      (slots - 1) * sizeof(struct mscabd_file *));
+    if (!index) {
+      self->error = MSPACK_ERR_NOMEMORY;
+      return NULL;
+    }
+    index->flags = flags;
+    index->mask  = slots - 1;
+    for (i = 0; i < slots; i++) index->slot[i] = NULL;
+
+    /* insert files in list order, so the first of any duplicates wins */
+    for (fi = cab->files; fi; fi = fi->next) {
+      i = cabd_name_hash(fi->filename, flags) & index->mask;
+      while ((match = index->slot[i])) {
+        if (cabd_name_equal(match->filename, fi->filename, flags)) break;
+        i = (i + 1) & index->mask;
+      }
+      if (!match) index->slot[i] = fi;
+    }
+    ((struct mscabd_cabinet_p *) cab)->index = index;
+  }
+
+  i = cabd_name_hash(filename, flags) & index->mask;
+  while ((match = index->slot[i])) {
+    if (cabd_name_equal(match->filename, filename, flags)) return match;
+    i = (i + 1) & index->mask;
+  }
+  return NULL;
+}
+
+static void cabd_free_index(struct mspack_system *sys,
+                            struct mscabd_cabinet *cab)
+{
+  struct mscabd_cabinet_p *cabp = (struct mscabd_cabinet_p *) cab;
+  sys->free(cabp->index);
+  cabp->index = NULL;
+}
+
 /***************************************
  * CABD_ERROR
  ***************************************
@@ -1459,3 +2553,17 @@ static int cabd_error(struct mscab_decompressor *base) {
   struct mscab_decompressor_p *self = (struct mscab_decompressor_p *) base;
   return (self) ? self->error : MSPACK_ERR_ARGS;
 }
+
+/***************************************
+ * CABD_GET_STATS
+ ***************************************
+ * gives the counters and times kept by extract()
+ */
+static int cabd_get_stats(struct mscab_decompressor *base,
+                          struct mscabd_stats *stats)
+{
+  struct mscab_decompressor_p *self = (struct mscab_decompressor_p *) base;
+  if (!self || !stats) return MSPACK_ERR_ARGS;
+  *stats = self->stats;
+  return MSPACK_ERR_OK;
+}
@@ -53,6 +53,8 @@ struct lzxd_stream {
   off_t   offset;                 /* number of bytes actually output         */
   off_t   length;                 /* overall decompressed length of stream   */
 
+  struct mscabd_stats *stats;     /* if not NULL, E8 translation is timed    */
+
   unsigned char *window;          /* decoding window                         */
   unsigned int   window_size;     /* window size                             */
   unsigned int   ref_data_size;   /* LZX DELTA reference data size           */
@@ -324,6 +324,7 @@ struct lzxd_stream *lzxd_init(struct mspack_system *system,
   lzx->output          = output;
   lzx->offset          = 0;
   lzx->length          = output_length;
+  lzx->stats           = NULL;
 
   lzx->inbuf_size      = input_buffer_size;
   lzx->window_size     = 1 << window_bits;
@@ -824,6 +825,7 @@ int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
       signed int curpos      = lzx->intel_curpos;
       signed int filesize    = lzx->intel_filesize;
       signed int abs_off, rel_off;
+      double start = lzx->stats ? mspack_clock() : 0.0;
 
       /* copy e8 block to the e8 buffer and tweak if needed */
       lzx->o_ptr = data;
@@ -843,6 +845,10 @@ int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
 	curpos += 5;
       }
       lzx->intel_curpos += frame_size;
+      if (lzx->stats) {
+        lzx->stats->e8_time  += mspack_clock() - start;
+        lzx->stats->e8_bytes += frame_size;
+      }
     }
     else {
       lzx->o_ptr = &lzx->window[lzx->frame_posn];
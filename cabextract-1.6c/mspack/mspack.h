@@ -443,6 +443,30 @@ struct mspack_system {
 	       void *dest,
 	       size_t bytes);
 
+  /**
+   * Copies bytes straight from one file to another, without them having
+   * to be read into memory and written out again. This method is
+   * optional, and may be NULL.
+   *
+   * The bytes are copied from the input file's current position, which
+   * is advanced past them, and added to the end of what has been written
+   * to the output file, exactly as if they had been read with read() and
+   * written with write(). Only available if mspack_version(
+   * MSPACK_VER_SYSTEM) returns 2 or greater.
+   *
+   * @param input  a file handle opened for reading
+   * @param output a file handle opened for writing
+   * @param bytes  the number of bytes to copy
+   * @return the number of bytes copied. This may be less than requested,
+   *         including zero if the files can't be copied between this way;
+   *         the rest is then read and written as usual. If there was an
+   *         error, -1 is returned.
+   * @see read(), write()
+   */
+  off_t (*transfer)(struct mspack_file *input,
+		    struct mspack_file *output,
+		    off_t bytes);
+
   /**
    * A null pointer to mark the end of mspack_system. It must equal NULL.
    *
@@ -826,6 +850,28 @@ struct mscabd_folder {
    * one cabinet.
    */
   unsigned int num_blocks;
+
+  /**
+   * The number of bytes of data blocks used by this folder, including
+   * their headers. This includes data blocks present in other files, if
+   * this folder spans more than one cabinet. It is worked out from where
+   * the data blocks of the next folder start, or where the cabinet ends,
+   * so no data blocks are read to get it.
+   *
+   * This field is only present if mspack_version(MSPACK_VER_MSCABD)
+   * returns 5 or greater.
+   */
+  off_t data_length;
+
+  /**
+   * The offset of the folder's first data block in the file it is in.
+   * For a folder spanning more than one cabinet, this is where it starts
+   * in the first of them.
+   *
+   * This field is only present if mspack_version(MSPACK_VER_MSCABD)
+   * returns 7 or greater.
+   */
+  off_t data_offset;
 };
 
 /**
@@ -933,12 +979,71 @@ struct mscabd_file {
 #define MSCABD_PARAM_FIXMSZIP  (1)
 /** mscab_decompressor::set_param() parameter: size of decompression buffer */
 #define MSCABD_PARAM_DECOMPBUF (2)
+/** mscab_decompressor::set_param() parameter: number of search threads */
+#define MSCABD_PARAM_SEARCHTHREADS (3)
+/** mscab_decompressor::set_param() parameter: number of open cabinet files */
+#define MSCABD_PARAM_MAXHANDLES (4)
+/** mscab_decompressor::set_param() parameter: check data block checksums? */
+#define MSCABD_PARAM_CHECKSUMS (5)
+/** mscab_decompressor::set_param() parameter: time extract()'s stages? */
+#define MSCABD_PARAM_STATS     (6)
+
+/** mscab_decompressor::find_file() flag: compare filenames ignoring the
+ * case of ASCII letters. */
+#define MSCABD_FIND_CASEFOLD   (0x01)
+/** mscab_decompressor::find_file() flag: treat '/' and '\\' as the same path
+ * separator, and ignore any leading path separators. */
+#define MSCABD_FIND_ANYSLASH   (0x02)
 
 /** TODO */
 struct mscab_compressor {
   int dummy; 
 };
 
+/**
+ * What a CAB decompressor has done, as given by
+ * mscab_decompressor::get_stats(). Times are in seconds.
+ */
+struct mscabd_stats {
+  /** Bytes of data blocks read by extract(), including their headers. */
+  off_t in_bytes;
+
+  /** Bytes decoded by extract(), whether they were written out or were
+   *  only decoded or skipped over to reach a file further on in a
+   *  folder. */
+  off_t out_bytes;
+
+  /** Data blocks read by extract(). */
+  unsigned long blocks;
+
+  /** Data block checksums checked by extract(). */
+  unsigned long checksums;
+
+  /** Times extract() set up a decompressor for a folder, either to start
+   *  a new folder or to go back to the start of the same one. */
+  unsigned long folder_resets;
+
+  /** Time spent reading data blocks, not counting checking checksums. */
+  double read_time;
+
+  /** Time spent checking data block checksums. */
+  double checksum_time;
+
+  /** Time spent decoding, not counting reading data blocks, E8
+   *  translation or writing out. */
+  double decode_time;
+
+  /** Time spent on LZX E8 translation. */
+  double e8_time;
+
+  /** Bytes that LZX E8 translation was done on. */
+  off_t e8_bytes;
+
+  /** Time spent writing out decoded data, including copying data from
+   *  folders with no compression straight to the output file. */
+  double write_time;
+};
+
 /**
  * A decompressor for .CAB (Microsoft Cabinet) files
  *
@@ -1144,6 +1249,34 @@ struct mscab_decompressor {
    * - #MSCABD_PARAM_DECOMPBUF: How many bytes should be used as an input
    *   bit buffer by decompressors? The minimum value is 4. The default
    *   value is 4096.
+   * - #MSCABD_PARAM_SEARCHTHREADS: How many threads may search() use to
+   *   scan a large file? Each thread opens the file again and reads its
+   *   own part of it, so the mspack_system's open(), read(), seek(),
+   *   close(), alloc() and free() must be safe to call from several
+   *   threads at once, on different file handles. The results are the
+   *   same as a single-threaded search. The minimum value is 1. The
+   *   default value is 1 (don't use threads). This parameter is only
+   *   available if mspack_version(MSPACK_VER_MSCABD) returns 2 or greater,
+   *   and is ignored if libmspack was built without thread support.
+   * - #MSCABD_PARAM_MAXHANDLES: How many cabinet files may extract() keep
+   *   open? Extracting from a cabinet set opens each cabinet file as its
+   *   data is needed. Files are kept open until the cabinet is closed, or
+   *   until this many files are open, when the least recently used one is
+   *   closed. The minimum value is 1. The default value is 8. This
+   *   parameter is only available if mspack_version(MSPACK_VER_MSCABD)
+   *   returns 2 or greater.
+   * - #MSCABD_PARAM_CHECKSUMS: If zero, extract() won't check the
+   *   checksums of data blocks. Files in folders with no compression can
+   *   then be copied with mspack_system::transfer() without being read.
+   *   The default value is 1 (check checksums). This parameter is only
+   *   available if mspack_version(MSPACK_VER_MSCABD) returns 3 or
+   *   greater.
+   * - #MSCABD_PARAM_STATS: If non-zero, extract() times how long it
+   *   spends reading data blocks, checking their checksums, decoding them
+   *   and writing out what they decode to, for get_stats(). Its counters
+   *   are kept either way. The default value is 0 (don't time anything).
+   *   This parameter is only available if
+   *   mspack_version(MSPACK_VER_MSCABD) returns 6 or greater.
    *
    * @param  self     a self-referential pointer to the mscab_decompressor
    *                  instance being called
@@ -1169,6 +1302,95 @@ struct mscab_decompressor {
    * @see open(), search()
    */
   int (*last_error)(struct mscab_decompressor *self);
+
+  /**
+   * Finds a file in a cabinet or cabinet set by its filename.
+   *
+   * The first call builds a hash index of the filenames in the cabinet or
+   * cabinet set, which is kept with the cabinet and used by later calls.
+   * The index is discarded when the cabinet is closed, appended to or
+   * prepended to, or when a call uses different flags from those the index
+   * was built with.
+   *
+   * If more than one file matches, the file appearing first in the
+   * mscabd_cabinet::files list is returned.
+   *
+   * If no file matches, NULL is returned and last_error() returns
+   * MSPACK_ERR_OK. If the index can't be built, NULL is returned and
+   * last_error() returns an error code.
+   *
+   * This method is only available if mspack_version(MSPACK_VER_MSCABD)
+   * returns 2 or greater.
+   *
+   * @param  self     a self-referential pointer to the mscab_decompressor
+   *                  instance being called
+   * @param  cab      the cabinet or cabinet set to search
+   * @param  filename the filename to look for, in the same form as
+   *                  mscabd_file::filename
+   * @param  flags    zero, or a combination of #MSCABD_FIND_CASEFOLD and
+   *                  #MSCABD_FIND_ANYSLASH
+   * @return a pointer to the matching mscabd_file, or NULL
+   * @see open(), search(), last_error()
+   */
+  struct mscabd_file * (*find_file)(struct mscab_decompressor *self,
+				    struct mscabd_cabinet *cab,
+				    const char *filename,
+				    int flags);
+
+  /**
+   * Checks the data blocks of a folder without decompressing them.
+   *
+   * Every data block in the folder is read, including the parts of
+   * blocks split across the cabinets of a cabinet set. The block headers
+   * are checked for sizes that can't be right, and each block's checksum
+   * is checked if it has one. The data is not decompressed, so errors in
+   * the compressed data itself will not be found, but this is much faster
+   * than extracting every file.
+   *
+   * Checksums are checked whatever #MSCABD_PARAM_CHECKSUMS and
+   * #MSCABD_PARAM_FIXMSZIP are set to.
+   *
+   * If the folder continues from a cabinet that isn't part of the cabinet
+   * set, or into one that isn't, MSPACK_ERR_DATAFORMAT is returned.
+   *
+   * This method is only available if mspack_version(MSPACK_VER_MSCABD)
+   * returns 4 or greater.
+   *
+   * @param  self      a self-referential pointer to the mscab_decompressor
+   *                   instance being called
+   * @param  folder    the folder to check
+   * @param  block     if not NULL, receives the number of blocks that
+   *                   were checked without error. If an error is
+   *                   returned, this is the index of the block at fault
+   * @param  unchecked if not NULL, receives the number of blocks that had
+   *                   no checksum to check
+   * @return an error code, or MSPACK_ERR_OK if the folder's blocks are
+   *         all correct. MSPACK_ERR_CHECKSUM means a block's checksum
+   *         was wrong and MSPACK_ERR_DATAFORMAT means a block's header
+   *         was wrong
+   * @see extract()
+   */
+  int (*check_folder)(struct mscab_decompressor *self,
+		      struct mscabd_folder *folder,
+		      unsigned int *block,
+		      unsigned int *unchecked);
+
+  /**
+   * Gets the counters and times kept by extract() since this
+   * decompressor was created. Times are only measured while
+   * #MSCABD_PARAM_STATS is set.
+   *
+   * This method is only available if mspack_version(MSPACK_VER_MSCABD)
+   * returns 6 or greater.
+   *
+   * @param  self  a self-referential pointer to the mscab_decompressor
+   *               instance being called
+   * @param  stats receives the counters and times
+   * @return MSPACK_ERR_OK, or MSPACK_ERR_ARGS if either parameter is NULL
+   * @see set_param(), extract()
+   */
+  int (*get_stats)(struct mscab_decompressor *self,
+		   struct mscabd_stats *stats);
 };
 
 /* --- support for .CHM (HTMLHelp) file format ----------------------------- */
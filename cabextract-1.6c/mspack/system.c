@@ -13,6 +13,10 @@
 
 #include <system.h>
 
+#if HAVE_CLOCK_GETTIME
+# include <time.h>
+#endif
+
 #ifndef LARGEFILE_SUPPORT
 const char *largefile_msg = "library not compiled to support large files.";
 #endif
@@ -28,9 +32,30 @@ int mspack_version(int entity) {
     */
   case MSPACK_VER_MSCHMD:
     return 2;
-  case MSPACK_VER_LIBRARY:
-  case MSPACK_VER_SYSTEM:
+   /* CAB decoder version 1 -> 2 changes:
+    * - added mscab_decompressor::find_file()
+    * - added MSCABD_PARAM_SEARCHTHREADS
+    * - added MSCABD_PARAM_MAXHANDLES
+    * CAB decoder version 2 -> 3 changes:
+    * - added MSCABD_PARAM_CHECKSUMS
+    * CAB decoder version 3 -> 4 changes:
+    * - added mscab_decompressor::check_folder()
+    * CAB decoder version 4 -> 5 changes:
+    * - added mscabd_folder::data_length
+    * CAB decoder version 5 -> 6 changes:
+    * - added MSCABD_PARAM_STATS
+    * - added mscab_decompressor::get_stats()
+    * CAB decoder version 6 -> 7 changes:
+    * - added mscabd_folder::data_offset
+    */
   case MSPACK_VER_MSCABD:
+    return 7;
+   /* mspack_system version 1 -> 2 changes:
+    * - added mspack_system::transfer()
+    */
+  case MSPACK_VER_SYSTEM:
+    return 2;
+  case MSPACK_VER_LIBRARY:
   case MSPACK_VER_MSSZDDD:
   case MSPACK_VER_MSKWAJD:
   case MSPACK_VER_MSOABD:
@@ -88,6 +113,18 @@ int mspack_sys_filelen(struct mspack_system *system,
   return MSPACK_ERR_OK;
 }
 
+/* returns a time in seconds, only for measuring how long things take, or
+ * always 0 if there is no clock to measure them with */
+double mspack_clock(void) {
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+  }
+#endif
+  return 0.0;
+}
+
 
 
 /* definition of mspack_default_system -- if the library is compiled with
@@ -231,7 +268,7 @@ static void msp_copy(void *src, void *dest, size_t bytes) {
 
 static struct mspack_system msp_system = {
   &msp_open, &msp_close, &msp_read,  &msp_write, &msp_seek,
-  &msp_tell, &msp_msg, &msp_alloc, &msp_free, &msp_copy, NULL
+  &msp_tell, &msp_msg, &msp_alloc, &msp_free, &msp_copy, NULL, NULL
 };
 
 struct mspack_system *mspack_default_system = &msp_system;
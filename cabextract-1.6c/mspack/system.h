@@ -105,6 +105,9 @@ extern int mspack_sys_filelen(struct mspack_system *system,
 /* validates a system structure */
 extern int mspack_valid_system(struct mspack_system *sys);
 
+/* returns a time in seconds, for measuring how long things take */
+extern double mspack_clock(void);
+
 #if HAVE_STRINGS_H
 # include <strings.h>
 #endif
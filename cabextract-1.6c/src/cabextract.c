@@ -71,6 +71,48 @@
 # include <sys/stat.h>
 #endif
 
+#if HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#if HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#if HAVE_SYS_IOCTL_H && HAVE_LINUX_FS_H
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
+
+#if HAVE_MKDIRAT && HAVE_OPENAT && HAVE_FCNTL_H
+# define USE_DIRFD 1
+# ifndef O_DIRECTORY
+#  define O_DIRECTORY 0
+# endif
+#endif
+
+#if HAVE_FCNTL_H && HAVE_UNISTD_H
+# define USE_OUTPUT_FD 1
+#endif
+
+/* io_uring is used without liburing, through its system calls */
+#if USE_OUTPUT_FD && HAVE_LINUX_IO_URING_H && HAVE_SYS_SYSCALL_H && \
+    HAVE_SYS_MMAN_H && defined(__GNUC__)
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+# if defined(__NR_io_uring_setup) && defined(IORING_FEAT_FAST_POLL)
+#  define USE_IO_URING 1
+# endif
+#endif
+
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
 # include <time.h>
@@ -146,9 +188,31 @@ extern time_t mktime(struct tm *tp);
 #endif
 
 #include <mspack.h>
-#include <md5.h>
+#include <digest.h>
 
 /* structures and global variables */
+
+/* values for options that only have a long form */
+enum {
+  OPT_STREAM = 256,
+  OPT_EXCLUDE,
+  OPT_FILES_FROM,
+  OPT_DIRECT,
+  OPT_DROP_CACHE,
+  OPT_NO_CHECKSUMS,
+  OPT_SPARSE,
+  OPT_DIGEST,
+  OPT_MANIFEST,
+  OPT_VERIFY,
+  OPT_FAIL_FAST,
+  OPT_VERIFY_BLOCKS,
+  OPT_TO_TAR,
+  OPT_DEDUP,
+  OPT_UPDATE,
+  OPT_JSON,
+  OPT_STATS
+};
+
 struct option optlist[] = {
   { "directory", 1, NULL, 'd' },
   { "fix",       0, NULL, 'f' },
@@ -162,6 +226,23 @@ struct option optlist[] = {
   { "test",      0, NULL, 't' },
   { "version",   0, NULL, 'v' },
   { "stdin-fname",   0, NULL, 'n' },
+  { "stream",    0, NULL, OPT_STREAM },
+  { "exclude",   1, NULL, OPT_EXCLUDE },
+  { "files-from", 1, NULL, OPT_FILES_FROM },
+  { "direct",    0, NULL, OPT_DIRECT },
+  { "drop-cache", 0, NULL, OPT_DROP_CACHE },
+  { "no-checksums", 0, NULL, OPT_NO_CHECKSUMS },
+  { "sparse",    0, NULL, OPT_SPARSE },
+  { "digest",    1, NULL, OPT_DIGEST },
+  { "manifest",  1, NULL, OPT_MANIFEST },
+  { "verify",    1, NULL, OPT_VERIFY },
+  { "fail-fast", 0, NULL, OPT_FAIL_FAST },
+  { "verify-blocks", 0, NULL, OPT_VERIFY_BLOCKS },
+  { "to-tar",    0, NULL, OPT_TO_TAR },
+  { "dedup",     2, NULL, OPT_DEDUP },
+  { "update",    2, NULL, OPT_UPDATE },
+  { "json",      0, NULL, OPT_JSON },
+  { "stats",     0, NULL, OPT_STATS },
   { NULL,        0, NULL, 0   }
 };
 
@@ -172,9 +253,44 @@ struct file_mem {
   char *from;
 };
 
+struct file_entry {
+  unsigned int folder, index;
+  struct mscabd_file *file;
+  char *name;
+};
+
+/* a set of shell patterns to match file names against. patterns without
+ * wildcards are kept in a hash table. the others are compiled together
+ * into one automaton, with a bit for each position in each pattern, so
+ * all of them are matched in a single pass over the name. any pattern the
+ * automaton can't handle is matched with fnmatch() */
+struct name_matcher {
+  char **names;             /* hash table of names, NULL for empty slots */
+  unsigned int names_mask;  /* number of hash table slots, minus one */
+  unsigned long *glob;      /* 256 byte masks, then star, start, accept */
+  unsigned long *state;     /* two masks of working space for matching */
+  unsigned int words;       /* number of words in each mask */
+  char **others;            /* patterns to match with fnmatch() */
+  int num_others;
+};
+
+/* directories that ensure_filepath() has created or found to exist, so
+ * they are never looked up again. The last directory it reached is also
+ * kept open, so directories below it can be made with mkdirat() */
+struct dir_cache {
+  char **dirs;              /* hash table of paths, NULL for empty slots */
+  unsigned int mask;        /* number of hash table slots, minus one */
+  unsigned int num;         /* number of paths in the hash table */
+  int fd;                   /* the last directory reached, or -1 */
+  char *fd_path;            /* the path of that directory */
+};
+
 struct cabextract_args {
-  int help, lower, pipe, view, quiet, single, fix, test;
-  char *dir, *filter, *stdin_fname;
+  int help, lower, pipe, view, quiet, single, fix, test, stream;
+  int direct, drop_cache, no_checksums, sparse, digest, fail_fast;
+  int verify_blocks, tar, dedup, update, json, stats;
+  char *dir, *stdin_fname, *manifest, *verify;
+  struct name_matcher *include, *exclude;
 };
 
 /* global variables */
@@ -186,37 +302,52 @@ struct file_mem *cab_seen = NULL;
 
 mode_t user_umask;
 
+int search_threads = 1;
+
+struct dir_cache dir_cache = { NULL, 0, 0, -1, NULL };
+
 struct cabextract_args args = {
-  0, 0, 0, 0, 0, 0, 0, 0,
-  NULL, NULL, NULL
+  0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, DIGEST_MD5, 0,
+  0, 0, 0, 0, 0, 0,
+  NULL, NULL, NULL, NULL,
+  NULL, NULL
 };
 
-int cabxbuf_open(FILE *fh);
+int cabxbuf_open(FILE *fh, int stream);
+int cabxbuf_load();
+void cabxbuf_commit();
 void cabxbuf_close();
 int cabxbuf_read(void *, int);
 int cabxbuf_seek(off_t, int);
-int cabxbuf_tell();
+off_t cabxbuf_tell();
 
 #ifdef DEBUG
 #define debug printf
 #else
 #define debug 1 ? (void) 0 : printf
 #endif /* DEBUG */
-#define DATA_SIZE 256
 #define IS_STDIN(fname) (strncmp((fname), "/dev/stdin", 10) == 0 || \
                          strncmp((fname), "-", 1) == 0)
 
-typedef struct cabx_data {
-  char data[DATA_SIZE];
-  size_t len;
-  struct cabx_data *next;
-} cabx_data_t;
+/* stdin is read in chunks of at least CABXBUF_CHUNK bytes, and is kept in
+ * memory until it is larger than CABXBUF_MEMMAX bytes */
+#define CABXBUF_CHUNK  (65536)
+#define CABXBUF_MEMMAX (64 * 1024 * 1024)
 
 typedef struct cabx_buf {
-  cabx_data_t *head;
-  cabx_data_t *current;
-  size_t size;
-  off_t offset;
+  unsigned char *data;   /* stdin from base, or NULL if only in spool file */
+  size_t size;           /* number of bytes of stdin held from base */
+  size_t alloc;          /* number of bytes allocated for data */
+  off_t base;            /* offset of the first byte held; 0 unless streaming */
+  off_t offset;          /* current read offset */
+  FILE *in;              /* stdin */
+  FILE *spool;           /* temporary file holding stdin, or NULL */
+  int mapped;            /* non-zero if data is a mapping of the spool file */
+  int open;              /* non-zero once stdin has been opened */
+  int stream;            /* non-zero while stdin is read on demand */
+  int keep;              /* non-zero to keep all data read while streaming */
+  int eof;               /* non-zero once streaming has reached end of stdin */
 } cabx_buf_t;
 
 cabx_buf_t g_cabxbuf = {0};
@@ -230,21 +361,371 @@ cabx_buf_t g_cabxbuf = {0};
 const char *STDOUT_FNAME = "stdout";
 
 /** A special filename. Extracting to this filename will send the output
- * through an MD5 checksum calculator, instead of a file on disk. The
+ * through a digest calculator, instead of a file on disk. The
  * magic happens in cabx_open() when the TEST_FNAME pointer is given as a
  * filename, so treat this like a constant rather than a string. 
  */
 
 const char *TEST_FNAME = "test";
 
-/** A global MD5 context, used when a file is written to TEST_FNAME */
-struct md5_ctx md5_context;
+/** A global digest context, used when a file is written to TEST_FNAME.
+ * The digest is chosen with --digest, and is MD5 by default */
+struct digest_ctx test_digest;
+
+/** The resultant digest, used when a file is written to TEST_FNAME */
+unsigned char test_result[DIGEST_MAX];
+
+/** The file that --manifest writes the path, size and digest of each
+ * tested file to, or NULL */
+FILE *manifest_fh = NULL;
+
+/* --verify reads a manifest written by --manifest, and compares each
+ * tested file with the entry that has its path. The entries are kept in
+ * the order of the manifest, with a hash table of their indices */
+struct verify_entry {
+  char *path;                       /* the path of the file */
+  unsigned int length;              /* the expected size of the file */
+  int seen;                         /* non-zero once a file had this entry */
+  unsigned char digest[DIGEST_MAX]; /* the expected digest of the file */
+};
+
+struct verify_table {
+  struct verify_entry *list;        /* the entries, in manifest order */
+  unsigned int num, max;            /* entries used and allocated */
+  unsigned int *slots;              /* hash table of indices plus one */
+  unsigned int mask;                /* number of slots, minus one */
+  int errors;                       /* files that didn't match */
+  int stop;                         /* non-zero to stop, for --fail-fast */
+};
+
+struct verify_table verify = { NULL, 0, 0, NULL, 0, 0, 0 };
+
+/* with one CPU, small files written to TEST_FNAME are collected in a
+ * batch, if the digest can hash several files at once with digest_many().
+ * The batch is hashed and its results printed when it's full, and before
+ * any other result is printed, so results are still printed in order.
+ * Each --verify worker batches the small files of its folders the same
+ * way, handing back their results when the batch is hashed */
+#define TEST_BATCH_FILES (256)
+#define TEST_BATCH_SIZE  (1024 * 1024)
+#define TEST_BATCH_MAX   (65536)    /* the largest file that is batched */
+
+struct test_batch {
+  int active;                       /* non-zero if files are batched */
+  int filling;                      /* non-zero while a file is written */
+  unsigned char *data;              /* the files, one after another */
+  size_t used;                      /* bytes of data in batched files */
+  size_t fill;                      /* bytes of the file being written */
+  int num;                          /* the number of batched files */
+  const char *names[TEST_BATCH_FILES];
+  const unsigned char *buffers[TEST_BATCH_FILES];
+  size_t lengths[TEST_BATCH_FILES];
+  unsigned char digests[TEST_BATCH_FILES][DIGEST_MAX];
+};
+
+struct test_batch batch;
+
+/** A special filename. Extracting to this filename will collect the
+ * output in dedup.buf, for --dedup to hash. The magic happens in
+ * cabx_open() when the DEDUP_FNAME pointer is given as a filename, so
+ * treat this like a constant rather than a string.
+ */
+const char *DEDUP_FNAME = "dedup";
+
+/* --dedup keeps an index of the files extracted to disk, by length. A
+ * file is only hashed if another file has its length, in the index or in
+ * the same cabinet. Such a file is decompressed to memory and hashed, and
+ * if a file already written has the same content, compared byte for
+ * byte, it becomes a hard link or reflink to that file instead of being
+ * written. Files longer than DEDUP_BUFMAX are hashed while they are
+ * written, and replaced with a link afterwards. Files in the index that
+ * weren't hashed are hashed from disk when a file of their length is */
+#define DEDUP_HARDLINK (1)
+#define DEDUP_REFLINK  (2)
+#define DEDUP_BUFMAX   (16 * 1024 * 1024)
+#define DEDUP_CHUNK    (16384)      /* bytes read at a time from disk */
+
+struct dedup_entry {
+  struct dedup_entry *next;         /* the next entry in the same slot */
+  char *path;                       /* the file extracted */
+  unsigned int length;              /* the size of the file */
+  int hashed;                       /* 1 if digest is set, -1 if unreadable */
+  unsigned char digest[DIGEST_MAX]; /* the XXH3 digest of the file */
+};
+
+struct dedup_index {
+  struct dedup_entry **slots;       /* hash table of entries, by length */
+  unsigned int mask;                /* number of slots, minus one */
+  unsigned int num;                 /* number of entries */
+  unsigned char *buf;               /* the file written to DEDUP_FNAME */
+  size_t size, used;                /* bytes allocated and used in buf */
+  int hashing;                      /* non-zero to hash output_name */
+  struct digest_ctx digest;         /* the digest of output_name */
+  int unsupported;                  /* non-zero if files can't be linked */
+  unsigned int linked;              /* the number of files linked */
+};
+
+struct dedup_index dedup;
+
+/** A special filename. Extracting to this filename will compare the
+ * output with update.fh, for --update=content. The magic happens in
+ * cabx_open() when the UPDATE_FNAME pointer is given as a filename, so
+ * treat this like a constant rather than a string.
+ */
+const char *UPDATE_FNAME = "update";
+
+/* --update leaves files that are already extracted alone. A file on disk
+ * with the length and date the file would be given is up to date, as the
+ * date is only set once a file has been written in full. With
+ * --update=content, a file of the right length but another date is
+ * decompressed and compared with the file on disk instead, and if they
+ * match, only its date and permissions are set. Otherwise, everything
+ * up to the first difference is already on disk, so the rest is written
+ * over the file as it's decompressed, and the file is never decompressed
+ * twice. A folder with no files left to extract is never decompressed */
+#define UPDATE_DATE    (1)
+#define UPDATE_CONTENT (2)
+#define UPDATE_WRITTEN (3)
+
+struct update_state {
+  FILE *fh;                         /* the file on disk being compared */
+  off_t offset;                     /* bytes compared so far */
+  int differs;                      /* non-zero once it doesn't match */
+  unsigned int files;               /* files left alone */
+  unsigned int folders;             /* folders not decompressed at all */
+};
+
+struct update_state update;
+
+/* --json lists cabinets as lines of JSON. They are built in json.buf, and
+ * written to stdout in one go once JSON_FLUSH bytes are waiting, rather
+ * than with a printf() for each field */
+#define JSON_FLUSH (65536)
+
+struct json_buffer {
+  char *buf;                        /* lines waiting to be written */
+  size_t used, size;                /* bytes used and allocated */
+  int error;                        /* errno, if anything went wrong */
+};
+
+struct json_buffer json;
+
+/* --stats counts the calls cabextract makes to read, write and make
+ * directories, and times its writes and directory making. libmspack
+ * times the rest of extraction itself. Times are in nanoseconds. The
+ * counters can be added to by search threads and --verify workers */
+struct cabx_stats {
+  uint64_t start;                   /* when cabextract started */
+  unsigned long opens, reads, seeks;  /* cabinet and output file calls */
+  off_t read_bytes;
+  unsigned long writes;             /* calls to cabx_write() */
+  off_t write_bytes;
+  uint64_t write_time;
+  unsigned long paths;              /* calls to ensure_filepath() */
+  uint64_t path_time;
+  unsigned long mkdirs, pwrites, ring_enters, copies;  /* system calls */
+  struct mscabd_stats workers;      /* added up from --verify workers */
+};
+
+struct cabx_stats stats;
+
+#if HAVE_PTHREAD_H && defined(__GNUC__)
+# define STATS_ADD(field, n) do { if (args.stats) \
+    __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED); } while (0)
+#else
+# define STATS_ADD(field, n) do { if (args.stats) stats.field += (n); \
+  } while (0)
+#endif
+
+#if HAVE_PTHREAD_H
+/* with more than one CPU, files written to TEST_FNAME are hashed by a
+ * separate thread, so decoding and hashing overlap. cabx_write() copies
+ * the data into a queue of HASHQ_SLOTS chunks, and the result of each
+ * file waits in a queue of HASHQ_RESULTS results until its checksum is
+ * ready, so results are still printed in order. A chunk is only queued
+ * once it's full or its file ends, so a small file is a single chunk, and
+ * the thread hashes all the small files waiting in the queue at once with
+ * digest_many() */
+#define HASHQ_SLOTS   (16)
+#define HASHQ_CHUNK   (65536)
+#define HASHQ_RESULTS (64)
+
+struct hash_result {
+  const char *name;         /* the name of the file */
+  unsigned int length;      /* the size of the file */
+  char *error;              /* a copy of why the file failed, or NULL */
+  int failed;               /* non-zero if the file failed to extract */
+  int done;                 /* non-zero once digest has been set */
+  unsigned char digest[DIGEST_MAX]; /* the digest of the file */
+};
+
+struct hash_queue {
+  int running;              /* non-zero while the hashing thread runs */
+  int quit;                 /* non-zero to stop the thread once idle */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;      /* broadcast whenever either queue changes */
+  unsigned char *data;      /* HASHQ_SLOTS chunks of HASHQ_CHUNK bytes */
+  size_t len[HASHQ_SLOTS];  /* the number of bytes in each chunk */
+  int result[HASHQ_SLOTS];  /* the result a file's last chunk ends, or -1 */
+  unsigned int head, count; /* the chunks waiting to be hashed */
+  size_t fill;              /* bytes in the chunk after them, not queued */
+  struct hash_result results[HASHQ_RESULTS];
+  unsigned int r_head, r_count; /* the results waiting to be printed */
+};
+
+struct hash_queue hashq;
+
+/* with more than one CPU, --verify tests the folders of a cabinet on
+ * parallel workers. Each has its own decompressor, opened on its own copy
+ * of the cabinet, and its own copy of cabextract_system, so cabx_open()
+ * knows which digest a file written to TEST_FNAME goes to. The results
+ * are printed in order as they arrive */
+struct verify_job {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;              /* broadcast when a result is done */
+  struct file_entry *order;         /* the files to test */
+  struct verify_result *results;    /* a result for each file */
+  int num;                          /* the number of files */
+  int next;                         /* the first file not yet handed out */
+  int stop;                         /* non-zero to stop handing out files */
+};
+
+struct verify_result {
+  int done;                         /* non-zero once the file is tested */
+  int failed;                       /* non-zero if it failed to extract */
+  char *error;                      /* a copy of why it failed, or NULL */
+  unsigned char digest[DIGEST_MAX]; /* the digest of the file */
+};
+
+struct verify_worker {
+  struct mspack_system sys;         /* a copy of cabextract_system */
+  struct digest_ctx digest;         /* the digest of the file being tested */
+  unsigned char result[DIGEST_MAX]; /* the resultant digest */
+  struct mscab_decompressor *cabd;
+  struct mscabd_cabinet *cab;
+  struct mscabd_file **files;       /* the cabinet's files, by index */
+  struct verify_job *job;
+  struct test_batch *batch;         /* small files to hash, or NULL */
+  int batched[TEST_BATCH_FILES];    /* the file each of them is */
+  pthread_t thread;
+};
+#endif
+
+/** The name of the file being extracted to disk. cabx_open() writes
+ * this file through the output writer, which keeps it open after
+ * cabx_close(), so set_date_and_perm() can leave it to the writer to set
+ * the date and permissions of the open file rather than look up its name
+ * again. Compared by pointer, like STDOUT_FNAME.
+ */
+const char *output_name = NULL;
+
+/** The length of the file being extracted to disk */
+off_t output_length = 0;
+
+/** The number of bytes written to STDOUT_FNAME since this was last set
+ * to zero. --to-tar uses this to pad a file that failed to extract out to
+ * the length its tar header gave */
+off_t stdout_written = 0;
+
+/* extracted files are written from a buffer of CABX_OUTBUF bytes, with
+ * one write() each time it fills. files longer than that have their
+ * space allocated when opened, and --direct opens files of at least
+ * CABX_DIRECT_MIN bytes with O_DIRECT, which needs the buffer, file
+ * offset and write size to be multiples of CABX_ALIGN */
+#define CABX_OUTBUF     (1024 * 1024)
+#define CABX_DIRECT_MIN (16 * 1024 * 1024)
+#define CABX_ALIGN      (4096)
+
+/* a file extracted to disk, from when it's opened until it's closed */
+struct output_file {
+  int fd;                /* the open file, or -1 */
+  const char *name;      /* its name, for error messages */
+  int writes;            /* number of writes still in progress */
+  int error;             /* errno of the first failed write, or 0 */
+  int reported;          /* non-zero if the error was passed to libmspack */
+  int closed;            /* non-zero once output_close() hands it over */
+  int meta;              /* non-zero if mtime and mode should be set */
+  time_t mtime;          /* its last-modified time */
+  mode_t mode;           /* its permissions */
+  int truncate;          /* non-zero if space was allocated for all of it */
+  off_t end;             /* number of bytes written to it */
+  off_t data_end;        /* end of the last data written, not a hole */
+  off_t length;          /* its expected length */
+};
+
+struct cabx_output {
+  struct output_file *file; /* the file being extracted, or NULL */
+  struct output_file sync;  /* that file, when not using io_uring */
+  unsigned char *mem;    /* all buffers, aligned to CABX_ALIGN */
+  unsigned char *buf;    /* the buffer being filled */
+  size_t start;          /* offset in buf of the file's unwritten data */
+  size_t used;           /* number of bytes used in buf */
+  off_t offset;          /* file offset of buf[start] */
+  int direct;            /* non-zero while the file is using O_DIRECT */
+  int no_transfer;       /* non-zero once copy_file_range() has failed */
+};
+
+struct cabx_output output;
+
+#if USE_IO_URING
+/* with io_uring, the output writer has a ring of CABX_RING_BUFS buffers.
+ * when one fills, its writes are submitted and the next one is filled
+ * while they run. the end of each file is only queued, so the writes and
+ * closes of up to CABX_RING_FILES small files are submitted together,
+ * CABX_RING_BATCH operations at a time. */
+#define CABX_RING_ENTRIES (128)
+#define CABX_RING_OPS     (2 * CABX_RING_ENTRIES)
+#define CABX_RING_BUFS    (4)
+#define CABX_RING_FILES   (64)
+#define CABX_RING_BATCH   (16)
+
+enum { RING_OP_WRITE, RING_OP_CLOSE };
+
+/* an operation submitted to io_uring, found by its user_data */
+struct ring_op {
+  int type;              /* RING_OP_WRITE or RING_OP_CLOSE */
+  int next;              /* next free operation, or -1 */
+  struct output_file *file;
+  int buf;               /* the buffer written from */
+  unsigned char *data;   /* the data written */
+  size_t len;            /* the number of bytes written */
+  off_t offset;          /* the file offset written to */
+};
+
+struct cabx_ring {
+  int fd;                /* the io_uring instance, or -1 if not in use */
+  void *sq_map, *cq_map; /* the mapped submission and completion rings */
+  size_t sq_map_len, cq_map_len, sqes_len;
+  unsigned int *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+  unsigned int *cq_head, *cq_tail, cq_mask, cq_entries;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned int queued;   /* operations not yet submitted */
+  unsigned int inflight; /* operations submitted but not completed */
+  int errors;            /* errors reported by files finished in the ring */
+  int broken;            /* non-zero once io_uring_enter() has failed */
+  unsigned char *bufs[CABX_RING_BUFS];
+  int busy[CABX_RING_BUFS]; /* number of writes from each buffer */
+  int current;           /* the buffer being filled */
+  struct output_file files[CABX_RING_FILES];
+  struct ring_op ops[CABX_RING_OPS];
+  int free_op;           /* first free operation, or -1 */
+};
 
-/** The resultant MD5 checksum, used when a file is written to TEST_FNAME */
-unsigned char md5_result[16];
+struct cabx_ring ring;
+#endif
 
 /* prototypes */
 static int process_cabinet(char *cabname);
+static struct mscabd_cabinet *open_stream(char *basename,
+                                          struct file_entry **order,
+                                          int *num, int *errors);
+static struct file_entry *order_files(struct mscabd_cabinet *cab,
+                                      int isunix, int *num, int *errors);
+static void free_order(struct file_entry *order, int num);
+static int file_entry_cmp(const void *a, const void *b);
+static int file_entry_name_cmp(const void *a, const void *b);
 
 static void load_spanning_cabinets(struct mscabd_cabinet *basecab,
                                    char *basename);
@@ -256,11 +737,128 @@ static int unix_path_seperators(struct mscabd_file *files);
 static char *create_output_name(const char *fname, const char *dir,
                                 int lower, int isunix, int unicode);
 static void set_date_and_perm(struct mscabd_file *file, char *filename);
+static time_t file_mtime(struct mscabd_file *file);
+static mode_t file_mode(struct mscabd_file *file);
+static int tar_header(const char *name, struct mscabd_file *file);
+static int tar_block(char *block, const char *name, unsigned int size,
+                     time_t mtime, mode_t mode, int type);
+static void tar_octal(char *field, size_t len, unsigned long value);
+static int tar_end(unsigned int length);
 
 static void memorise_file(struct file_mem **fml, char *name, char *from);
 static int recall_file(struct file_mem *fml, char *name, char **from);
 static void forget_files(struct file_mem **fml);
+static int read_names(char *filename, char ***names, int *num);
+static struct name_matcher *matcher_create(char **patterns, int num_patterns,
+                                           char **names, int num_names);
+static int matcher_add_glob(struct name_matcher *m, const char *pattern,
+                            unsigned int pos);
+static int matcher_match(struct name_matcher *m, const char *name);
+static void matcher_free(struct name_matcher *m);
 static int ensure_filepath(char *path);
+static void unshare_file(const char *filename);
+static int make_filepath(char *path);
+static unsigned int dir_cache_hash(const char *path, size_t len);
+static int dir_cache_find(const char *path, size_t len);
+static void dir_cache_add(const char *path, size_t len);
+static void dir_cache_free(void);
+#if USE_DIRFD
+static int dir_cache_open(const char *path, size_t len);
+#endif
+#if USE_OUTPUT_FD
+static int open_output(const char *filename, int flags);
+static int output_alloc(void);
+static int output_open(const char *filename);
+static int output_write(void *buffer, int bytes);
+static int output_flush(void);
+static void output_put(struct output_file *f, unsigned char *buf,
+                       size_t len);
+static int output_zero_page(const unsigned char *page);
+static int output_undirect(int fd);
+static void output_next_buffer(void);
+static int output_close(void);
+static int output_settle(struct output_file *f);
+static int output_sync(void);
+static void output_free(void);
+#endif
+#if USE_IO_URING
+static void ring_setup(void);
+static struct output_file *ring_file(const char *filename);
+static struct io_uring_sqe *ring_sqe(int type, struct output_file *f);
+static void ring_write(struct output_file *f, unsigned char *buf,
+                       size_t len, off_t offset);
+static void ring_finish(struct output_file *f);
+static void ring_submit(int wait);
+static void ring_fail(int error);
+static void ring_run(void);
+static void ring_reap(void);
+static void ring_complete(struct ring_op *op, int res);
+#endif
+static int check_blocks(struct mscabd_cabinet *cab);
+static void print_test_result(const char *name, unsigned int length,
+                              const char *error,
+                              const unsigned char *digest);
+static void manifest_path(const char *name);
+static int verify_load(const char *filename);
+static int verify_add(char *path, unsigned int length,
+                      const unsigned char *digest);
+static struct verify_entry *verify_find(const char *path);
+static void verify_file(const char *name, unsigned int length,
+                        const char *error, const unsigned char *digest);
+static int verify_finish(void);
+static void batch_start(void);
+static int batch_write(struct test_batch *b, void *buffer, int bytes);
+static void batch_add(struct test_batch *b, const char *name);
+static int batch_hash(struct test_batch *b);
+static void batch_flush(void);
+static void batch_stop(void);
+static char *dedup_shared(struct file_entry *order, int num);
+static int dedup_cmp_length(const void *a, const void *b);
+static int dedup_extract(struct mscabd_file *file, char *name, int shared);
+static int dedup_reserve(size_t length);
+static unsigned int dedup_slot(unsigned int length);
+static int dedup_has_length(unsigned int length);
+static struct dedup_entry *dedup_match(unsigned int length,
+                                       const unsigned char *digest,
+                                       const unsigned char *data,
+                                       const char *name, int *errors);
+static void dedup_hash(struct dedup_entry *e);
+static int dedup_same(const char *path, const unsigned char *data,
+                      const char *other, unsigned int length);
+static int dedup_link(const char *target, const char *name, int written);
+static void dedup_add(const char *name, unsigned int length,
+                      const unsigned char *digest);
+static void dedup_free(void);
+static int update_current(struct mscabd_file *file, char *name);
+static int update_write(void *buffer, int bytes);
+static void json_cabinet(const char *basename, struct mscabd_cabinet *cab);
+static void json_file(const char *basename, struct file_entry *entry);
+static void json_begin(const char *type, const char *cabinet);
+static void json_key(const char *key);
+static void json_string(const char *key, const char *value);
+static void json_number(const char *key, unsigned long value);
+static void json_raw(const char *data, size_t len);
+static void json_end(void);
+static int json_flush(void);
+static uint64_t stats_clock(void);
+static void stats_add(struct mscabd_stats *to, struct mscabd_stats *from);
+static void stats_stage(const char *name, double time, off_t bytes);
+static void stats_report(void);
+#if HAVE_PTHREAD_H
+static void hashq_start(void);
+static void *hashq_main(void *arg);
+static unsigned int hashq_tail(void);
+static void hashq_queue(int result);
+static void hashq_write(unsigned char *buffer, size_t bytes);
+static void hashq_end(const char *name, unsigned int length,
+                      const char *error);
+static void hashq_report(int wait);
+static void hashq_stop(void);
+static int verify_folders(char *basename, struct mscabd_cabinet *cab,
+                          struct file_entry *order, int num);
+static void *verify_main(void *arg);
+static void verify_flush(struct verify_worker *w);
+#endif
 static char *cab_error(struct mscab_decompressor *cd);
 
 static struct mspack_file *cabx_open(struct mspack_system *this,
@@ -268,12 +866,16 @@ static struct mspack_file *cabx_open(struct mspack_system *this,
 static void cabx_close(struct mspack_file *file);
 static int cabx_read(struct mspack_file *file, void *buffer, int bytes);
 static int cabx_write(struct mspack_file *file, void *buffer, int bytes);
+static int cabx_write_data(struct mspack_file *file, void *buffer,
+                           int bytes);
 static int cabx_seek(struct mspack_file *file, off_t offset, int mode);
 static off_t cabx_tell(struct mspack_file *file);
 static void cabx_msg(struct mspack_file *file, const char *format, ...);
 static void *cabx_alloc(struct mspack_system *this, size_t bytes);
 static void cabx_free(void *buffer);
 static void cabx_copy(void *src, void *dest, size_t bytes);
+static off_t cabx_transfer(struct mspack_file *input,
+                           struct mspack_file *out, off_t bytes);
 
 /**
  * A cabextract-specific implementation of mspack_system that allows
@@ -282,18 +884,33 @@ static void cabx_copy(void *src, void *dest, size_t bytes);
  */
 static struct mspack_system cabextract_system = {
   &cabx_open, &cabx_close, &cabx_read,  &cabx_write, &cabx_seek,
-  &cabx_tell, &cabx_msg, &cabx_alloc, &cabx_free, &cabx_copy, NULL
+  &cabx_tell, &cabx_msg, &cabx_alloc, &cabx_free, &cabx_copy,
+  &cabx_transfer, NULL
 };
 
 int main(int argc, char *argv[]) {
-  int i, err;
+  char **includes, **excludes, **names = NULL;
+  int num_includes = 0, num_excludes = 0, num_names = 0;
+  int i, err = 0;
+
+  /* each pattern option uses up at least one argument */
+  includes = malloc(argc * sizeof(char *));
+  excludes = malloc(argc * sizeof(char *));
+  if (!includes || !excludes) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    free(includes);
+    free(excludes);
+    return EXIT_FAILURE;
+  }
 
-  /* parse options */
-  while ((i = getopt_long(argc, argv, "d:fF:hlLpqstvn:", optlist, NULL)) != -1) {
+  /* parse options, stopping at the first bad one */
+  while (!err &&
+         (i = getopt_long(argc, argv, "d:fF:hlLpqstvn:", optlist, NULL)) != -1)
+  {
     switch (i) {
     case 'd': args.dir    = optarg; break;
     case 'f': args.fix    = 1;      break;
-    case 'F': args.filter = optarg; break;
+    case 'F': includes[num_includes++] = optarg; break;
     case 'h': args.help   = 1;      break;
     case 'l': args.view   = 1;      break;
     case 'L': args.lower  = 1;      break;
@@ -303,9 +920,75 @@ int main(int argc, char *argv[]) {
     case 't': args.test   = 1;      break;
     case 'v': args.view   = 1;      break;
     case 'n': args.stdin_fname = optarg; break;
+    case OPT_STREAM: args.stream = 1; break;
+    case OPT_DIRECT: args.direct = 1; break;
+    case OPT_DROP_CACHE: args.drop_cache = 1; break;
+    case OPT_NO_CHECKSUMS: args.no_checksums = 1; break;
+    case OPT_SPARSE: args.sparse = 1; break;
+    case OPT_DIGEST:
+      if ((args.digest = digest_lookup(optarg)) < 0) {
+        fprintf(stderr, "%s: unknown digest '%s' (try md5, sha256, xxh3 "
+                "or crc32c)\n", argv[0], optarg);
+        err = 1;
+      }
+      break;
+    case OPT_MANIFEST: args.manifest = optarg; args.test = 1; break;
+    case OPT_VERIFY: args.verify = optarg; args.test = 1; break;
+    case OPT_FAIL_FAST: args.fail_fast = 1; break;
+    case OPT_VERIFY_BLOCKS: args.verify_blocks = 1; break;
+    case OPT_TO_TAR: args.tar = 1; args.pipe = 1; break;
+    case OPT_DEDUP:
+      if (!optarg || !strcmp(optarg, "hardlink")) {
+        args.dedup = DEDUP_HARDLINK;
+      }
+      else if (!strcmp(optarg, "reflink")) {
+        args.dedup = DEDUP_REFLINK;
+      }
+      else {
+        fprintf(stderr, "%s: unknown --dedup method '%s' (try hardlink or "
+                "reflink)\n", argv[0], optarg);
+        err = 1;
+      }
+      break;
+    case OPT_JSON: args.json = 1; args.view = 1; break;
+    case OPT_STATS: args.stats = 1; break;
+    case OPT_UPDATE:
+      if (!optarg || !strcmp(optarg, "date")) {
+        args.update = UPDATE_DATE;
+      }
+      else if (!strcmp(optarg, "content")) {
+        args.update = UPDATE_CONTENT;
+      }
+      else {
+        fprintf(stderr, "%s: unknown --update method '%s' (try date or "
+                "content)\n", argv[0], optarg);
+        err = 1;
+      }
+      break;
+    case OPT_EXCLUDE: excludes[num_excludes++] = optarg; break;
+    case OPT_FILES_FROM: err = read_names(optarg, &names, &num_names); break;
     }
   }
 
+  /* build the file name matchers */
+  if (!err && (num_includes || num_names)) {
+    args.include = matcher_create(includes, num_includes, names, num_names);
+  }
+  if (!err && num_excludes) {
+    args.exclude = matcher_create(excludes, num_excludes, NULL, 0);
+  }
+  for (i = 0; i < num_names; i++) free(names[i]);
+  free(names);
+  free(includes);
+  free(excludes);
+  if (err) return EXIT_FAILURE;
+  if (((num_includes || num_names) && !args.include) ||
+      (num_excludes && !args.exclude))
+  {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
   if (args.help) {
     fprintf(stderr,
       "Usage: %s [options] [-d dir] <cabinet file(s)>\n\n"
@@ -325,8 +1008,27 @@ int main(int argc, char *argv[]) {
       "  -p   --pipe        pipe extracted files to stdout\n"
       "  -s   --single      restrict search to cabs on the command line\n"
       "  -F   --filter      extract only files that match the given pattern\n"
+      "       --exclude     don't extract files that match the given pattern\n"
+      "       --files-from  extract only files named in the given file\n"
       "  -d   --directory   extract all files to the given directory\n\n"
-      "  -n   --stdin-fname name of cabfile which from stdin\n\n"
+      "  -n   --stdin-fname name of cabfile which from stdin\n"
+      "       --stream      extract a cabinet from stdin as it is read\n"
+      "       --direct      write large files without the page cache\n"
+      "       --drop-cache  remove extracted files from the page cache\n"
+      "       --no-checksums don't check data block checksums\n"
+      "       --sparse      leave pages of zeros as holes in extracted files\n"
+      "       --digest      digest for --test: md5, sha256, xxh3 or crc32c\n"
+      "       --manifest    test, writing path, size and digest to a file\n"
+      "       --verify      test, comparing files with a manifest\n"
+      "       --fail-fast   stop verifying at the first file that fails\n"
+      "       --verify-blocks check data block checksums without decompressing\n"
+      "       --to-tar      write the files to stdout as a pax archive\n"
+      "       --dedup       link files with the same content to each other,\n"
+      "                     as hard links, or with --dedup=reflink, reflinks\n"
+      "       --update      skip files already extracted with the same size and\n"
+      "                     date, or with --update=content, the same content\n"
+      "       --json        list cabinets, folders and files as lines of JSON\n"
+      "       --stats       report where the time went, when finished\n\n"
       "cabextract %s (C) 2000-2011 Stuart Caie <kyzer@4u.net>\n"
       "This is free software with ABSOLUTELY NO WARRANTY.\n",
       VERSION);
@@ -339,6 +1041,45 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  if (args.verify_blocks && (args.test || args.view)) {
+    fprintf(stderr, "%s: You cannot use --verify-blocks with --test, --list, "
+            "--manifest or --verify.\nTry '%s --help' for more information.\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (args.tar && (args.test || args.view || args.verify_blocks)) {
+    fprintf(stderr, "%s: You cannot use --to-tar with --test, --list or "
+            "--verify-blocks.\nTry '%s --help' for more information.\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (args.dedup && (args.test || args.view || args.pipe ||
+                     args.verify_blocks))
+  {
+    fprintf(stderr, "%s: You cannot use --dedup with --test, --list, "
+            "--pipe, --to-tar\nor --verify-blocks.\nTry '%s --help' for "
+            "more information.\n", argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (args.update && (args.test || args.view || args.pipe ||
+                      args.verify_blocks))
+  {
+    fprintf(stderr, "%s: You cannot use --update with --test, --list, "
+            "--pipe, --to-tar\nor --verify-blocks.\nTry '%s --help' for "
+            "more information.\n", argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (args.manifest && args.verify) {
+    fprintf(stderr, "%s: You cannot use --manifest and --verify at the same "
+            "time.\nTry '%s --help' for more information.\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
   if (optind == argc) {
     /* no arguments other than the options */
     if (args.view) {
@@ -360,6 +1101,21 @@ int main(int argc, char *argv[]) {
   /* extracting to stdout implies shutting up on stdout */
   if (args.pipe && !args.view) args.quiet = 1;
 
+  /* as does listing as JSON */
+  if (args.json) args.quiet = 1;
+
+  /* open the manifest, and write its header */
+  if (args.manifest) {
+    if (!(manifest_fh = fopen(args.manifest, "w"))) {
+      fprintf(stderr, "%s: %s\n", args.manifest, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    fprintf(manifest_fh, "path\tsize\t%s\n", digest_name(args.digest));
+  }
+
+  /* read the manifest to verify against */
+  if (args.verify && verify_load(args.verify)) return EXIT_FAILURE;
+
   /* open libmspack */
   MSPACK_SYS_SELFTEST(err);
   if (err) {
@@ -388,17 +1144,96 @@ int main(int argc, char *argv[]) {
   /* turn on/off 'fix MSZIP' mode */
   cabd->set_param(cabd, MSCABD_PARAM_FIXMSZIP, args.fix);
 
+  /* turn on/off checking data block checksums */
+  cabd->set_param(cabd, MSCABD_PARAM_CHECKSUMS, !args.no_checksums);
+
+  /* time each stage of extraction for --stats */
+  if (args.stats) {
+    stats.start = stats_clock();
+    cabd->set_param(cabd, MSCABD_PARAM_STATS, 1);
+  }
+
+  /* search large files for cabinets with one thread per CPU */
+#if HAVE_UNISTD_H && defined(_SC_NPROCESSORS_ONLN)
+  search_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (search_threads < 1) search_threads = 1;
+#endif
+
+#if HAVE_PTHREAD_H
+  /* hash tested files on another CPU while decoding the next ones */
+  if (args.test && search_threads > 1) hashq_start();
+#endif
+
+  /* otherwise, hash small tested files several at a time */
+#if HAVE_PTHREAD_H
+  if (args.test && !hashq.running) batch_start();
+#else
+  if (args.test) batch_start();
+#endif
+
   /* process cabinets */
-  for (i = optind, err = 0; i < argc; i++) {
+  for (i = optind, err = 0; i < argc && !verify.stop; i++) {
     err += process_cabinet(argv[i]);
   }
 
+#if HAVE_PTHREAD_H
+  hashq_stop();
+#endif
+  batch_stop();
+
+  /* end the tar archive with two blocks of zeros */
+  if (args.tar) {
+    stdout_written = 0;
+    if (tar_end(1024) || fflush(stdout)) {
+      fprintf(stderr, "%s: %s\n", STDOUT_FNAME, strerror(errno));
+      err++;
+    }
+  }
+
+  /* write the rest of the JSON listing */
+  if (args.json) {
+    if (json_flush() || fflush(stdout)) {
+      fprintf(stderr, "%s: %s\n", STDOUT_FNAME,
+              strerror(json.error ? json.error : errno));
+      err++;
+    }
+    free(json.buf);
+  }
+
+  /* report files in the manifest that weren't found */
+  if (args.verify) err += verify_finish();
+
+  /* finish the manifest */
+  if (manifest_fh) {
+    i = ferror(manifest_fh);
+    if (fclose(manifest_fh) || i) {
+      fprintf(stderr, "%s: %s\n", args.manifest, strerror(errno));
+      err++;
+    }
+  }
+
+  /* report how many files --dedup linked */
+  if (args.dedup && !args.quiet && dedup.linked) {
+    printf("\nLinked %u file(s) to files with the same content.\n",
+           dedup.linked);
+  }
+
+  /* report how many files --update left alone */
+  if (args.update && !args.quiet && update.files) {
+    printf("\nSkipped %u up-to-date file(s); %u folder(s) weren't "
+           "decompressed at all.\n", update.files, update.folders);
+  }
+
   /* error summary */
   if (!args.quiet) {
-    if (err) printf("\nAll done, errors in processing %d file(s)\n", err);
+    if (err) printf("\nAll done, errors in processing %d %s\n", err,
+                    args.verify_blocks ? "folder(s)" : "file(s)");
     else printf("\nAll done, no errors.\n");
   }
 
+  /* report where the time went */
+  if (args.stats) stats_report();
+
   /* close libmspack */
   mspack_destroy_cab_decompressor(cabd);
 
@@ -407,6 +1242,21 @@ int main(int argc, char *argv[]) {
   forget_files(&cab_exts);
   forget_files(&cab_seen);
 
+  /* forget created directories */
+  dir_cache_free();
+
+  /* forget the files extracted for --dedup */
+  dedup_free();
+
+#if USE_OUTPUT_FD
+  /* free the output writer */
+  output_free();
+#endif
+
+  /* free file name matchers */
+  matcher_free(args.include);
+  matcher_free(args.exclude);
+
   /* close stdin buffer */
   cabxbuf_close();
 
@@ -422,10 +1272,11 @@ int main(int argc, char *argv[]) {
  *         failure
  */
 static int process_cabinet(char *basename) {
-  struct mscabd_cabinet *basecab, *cab, *cab2;
+  struct mscabd_cabinet *basecab = NULL, *cab, *cab2;
   struct mscabd_file *file;
-  int isunix, fname_offset, viewhdr = 0;
-  char *from, *name;
+  struct file_entry *order = NULL;
+  int isunix, viewhdr = 0, streamed = 0, num = 0, i, j, fresh = 0;
+  char *from, *name, *shared = NULL;
   int errors = 0;
 
   /* do not process repeat cabinets */
@@ -439,8 +1290,23 @@ static int process_cabinet(char *basename) {
   }
   memorise_file(&cab_seen, basename, NULL);
 
-  /* search the file for cabinets */
-  if (!(basecab = cabd->search(cabd, basename))) {
+  /* try to stream a cabinet from stdin. if it can't be streamed, read all
+   * of stdin and search it like any other file */
+  if (args.stream && !args.verify_blocks && IS_STDIN(basename)) {
+    if (!(basecab = open_stream(basename, &order, &num, &errors)) &&
+        cabxbuf_load())
+    {
+      fprintf(stderr, "%s: can't read stdin\n", basename);
+      return 1;
+    }
+    streamed = (basecab != NULL);
+  }
+
+  /* search the file for cabinets. stdin is read through one shared
+   * buffer, so it can't be searched by more than one thread */
+  cabd->set_param(cabd, MSCABD_PARAM_SEARCHTHREADS,
+                  IS_STDIN(basename) ? 1 : search_threads);
+  if (!basecab && !(basecab = cabd->search(cabd, basename))) {
     if (cabd->last_error(cabd)) {
       fprintf(stderr, "%s: %s\n", basename, cab_error(cabd));
     }
@@ -451,7 +1317,7 @@ static int process_cabinet(char *basename) {
   }
 
   /* iterate over all cabinets found in that file */
-  for (cab = basecab; cab; cab = cab->next) {
+  for (cab = basecab; cab && !verify.stop; cab = cab->next) {
 
     /* load all spanning cabinets */
     load_spanning_cabinets(cab, basename);
@@ -470,43 +1336,53 @@ static int process_cabinet(char *basename) {
       }
       else {
         if (!args.quiet) {
-          printf("%s cabinet: %s\n", args.test ? "Testing" : "Extracting",
-                                     basename);
+          printf("%s cabinet: %s\n", args.verify_blocks ? "Checking" :
+                 args.test ? "Testing" : "Extracting", basename);
         }
       }
       viewhdr = 1;
     }
 
-    /* the full UNIX output filename includes the output
-     * directory. However, for filtering purposes, we don't want to 
-     * include that. So, we work out where the filename part of the 
-     * output name begins. This is the same for every extracted file.
-     */
-    if (args.filter) {
-      fname_offset = args.dir ? (strlen(args.dir) + 1) : 0;
+    /* list the cabinet and its folders first, for --json */
+    if (args.json) json_cabinet(basename, cab);
+
+    /* work out which files to process, and in which order. a streamed
+     * cabinet has already done this. --verify-blocks processes no files,
+     * it checks the data blocks of each folder instead */
+    if (args.verify_blocks) {
+      errors += check_blocks(cab);
+    }
+    else if (!order && !(order = order_files(cab, isunix, &num, &errors))) {
+      fprintf(stderr, "%s: out of memory\n", basename);
+      errors++;
+      num = 0;
     }
 
-    /* process all files */
-    for (file = cab->files; file; file = file->next) {
-      /* create the full UNIX output filename */
-      if (!(name = create_output_name(file->filename, args.dir,
-            args.lower, isunix, file->attribs & MSCAB_ATTRIB_UTF_NAME)))
-      {
-        errors++;
-        continue;
-      }
+    /* --dedup only hashes files that share their length with another */
+    if (args.dedup && order) shared = dedup_shared(order, num);
+
+    /* verify the files on parallel workers, if they can be */
+    i = 0;
+#if HAVE_PTHREAD_H
+    if (args.verify && !streamed &&
+        (j = verify_folders(basename, cab, order, num)) >= 0)
+    {
+      errors += j;
+      i = num;
+    }
+#endif
 
-      /* if filtering, do so now. skip if file doesn't match filter */
-      if (args.filter &&
-          fnmatch(args.filter, &name[fname_offset], FNM_CASEFOLD))
-      {
-        free(name);
-        continue;
-      }
+    /* process the selected files */
+    for (; i < num && !verify.stop; i++) {
+      file = order[i].file;
+      name = order[i].name;
 
       /* view, extract or test the file */
       if (args.view) {
-        if (args.quiet) {
+        if (args.json) {
+          json_file(basename, &order[i]);
+        }
+        else if (args.quiet) {
           printf("%s\n", name);
         } else {
           printf("%10u | %02d.%02d.%04d %02d:%02d:%02d | %s\n",
@@ -515,40 +1391,80 @@ static int process_cabinet(char *basename) {
         }
       }
       else if (args.test) {
+        const char *error = NULL;
+        /* small files wait in the batch, if there's one */
+        if (batch.active && file->length <= TEST_BATCH_MAX) {
+          if (batch.num == TEST_BATCH_FILES ||
+              batch.used + file->length > TEST_BATCH_SIZE) batch_flush();
+          batch.filling = 1;
+        }
         if (cabd->extract(cabd, file, TEST_FNAME)) {
           /* file failed to extract */
-          printf("  %s  failed (%s)\n", name, cab_error(cabd));
+          error = cab_error(cabd);
           errors++;
         }
-        else {
-          /* file extracted OK, print the MD5 checksum in md5_result. Print
-           * the checksum right-aligned to 79 columns if that's possible,
-           * otherwise just print it 2 spaces after the filename and "OK" */
-
-          /* "  filename  OK  " is 8 chars + the length of filename,
-           * the MD5 checksum itself is 32 chars. */
-          int spaces = 79 - (strlen(name) + 8 + 32);
-          printf("  %s  OK  ", name);
-          while (spaces-- > 0) putchar(' ');
-          printf("%02x%02x%02x%02x%02x%02x%02x%02x"
-                 "%02x%02x%02x%02x%02x%02x%02x%02x\n",
-                 md5_result[0], md5_result[1], md5_result[2], md5_result[3],
-                 md5_result[4], md5_result[5], md5_result[6], md5_result[7],
-                 md5_result[8], md5_result[9], md5_result[10],md5_result[11],
-                 md5_result[12],md5_result[13],md5_result[14],md5_result[15]);
+        if (batch.filling) {
+          batch.filling = 0;
+          if (!error) {
+            batch_add(&batch, name);
+            continue;
+          }
         }
+        /* print the batched results first */
+        batch_flush();
+        if (verify.stop) break;
+#if HAVE_PTHREAD_H
+        if (hashq.running) {
+          /* print it once the hashing thread has its digest */
+          hashq_end(name, file->length, error);
+          continue;
+        }
+#endif
+        print_test_result(name, file->length, error, test_result);
       }
       else {
         /* extract the file */
         if (args.pipe) {
-          /* extracting to stdout */
+          /* extracting to stdout, after a tar header with --to-tar */
+          if (args.tar && tar_header(name, file)) {
+            fprintf(stderr, "%s: %s\n", STDOUT_FNAME, strerror(errno));
+            errors++;
+            break;
+          }
+          stdout_written = 0;
           if (cabd->extract(cabd, file, STDOUT_FNAME)) {
             fprintf(stderr, "%s(%s): %s\n", STDOUT_FNAME, name,
                                             cab_error(cabd));
             errors++;
           }
+          if (args.tar && tar_end(file->length)) {
+            fprintf(stderr, "%s: %s\n", STDOUT_FNAME, strerror(errno));
+            errors++;
+            break;
+          }
         }
         else {
+          /* with --update, count the folders that only have files that
+           * are up to date by their date, so weren't decompressed */
+          if (args.update) {
+            if (i == 0 || order[i].folder != order[i-1].folder) {
+              update.folders += fresh;
+              fresh = 1;
+            }
+            j = update_current(file, name);
+            if (j != UPDATE_DATE) fresh = 0;
+            if (j == UPDATE_WRITTEN) {
+              if (!args.quiet) printf("  extracting %s\n", name);
+              if (args.dedup) dedup_add(name, file->length, NULL);
+              continue;
+            }
+            if (j) {
+              if (!args.quiet) printf("  up to date %s\n", name);
+              update.files++;
+              continue;
+            }
+          }
+
           /* extracting to a regular file */
           if (!args.quiet) printf("  extracting %s\n", name);
 
@@ -557,18 +1473,42 @@ static int process_cabinet(char *basename) {
             errors++;
           }
           else {
-            if (cabd->extract(cabd, file, name)) {
+            output_name = name;
+            output_length = (off_t) file->length;
+            if (args.dedup) {
+              errors += dedup_extract(file, name, !shared || shared[i]);
+            }
+            else if (cabd->extract(cabd, file, name)) {
               fprintf(stderr, "%s: %s\n", name, cab_error(cabd));
               errors++;
             }
             else {
               set_date_and_perm(file, name);
             }
+#if USE_OUTPUT_FD
+            /* report errors writing the end of the file */
+            errors += output_close();
+#endif
+            output_name = NULL;
           }
         }
       }
-      free(name);
     } /* for (all files in cab) */
+#if USE_OUTPUT_FD
+    /* wait for files still being written, while their names exist */
+    errors += output_sync();
+#endif
+#if HAVE_PTHREAD_H
+    /* print the results of files still being hashed */
+    if (hashq.running) hashq_report(2);
+#endif
+    batch_flush();
+    free(shared);
+    shared = NULL;
+    update.folders += fresh;
+    fresh = 0;
+    free_order(order, num);
+    order = NULL;
 
     /* free the spanning cabinet filenames [not freed by cabd->close()] */
     if (!IS_STDIN(basename)) {
@@ -577,11 +1517,212 @@ static int process_cabinet(char *basename) {
     }
   } /* for (all cabs) */
 
+  /* read the rest of streamed stdin, so it isn't cut off. anything after
+   * the cabinet is not searched. when filtering, stop reading once the
+   * selected files are done */
+  if (streamed && !args.include && !args.exclude) {
+    if (cabxbuf_seek(0, MSPACK_SYS_SEEK_END) == 0 &&
+        cabxbuf_tell() > (off_t) basecab->length)
+    {
+      fprintf(stderr, "%s: WARNING; possible %lu extra bytes at end of "
+              "file.\n", basename,
+              (unsigned long) (cabxbuf_tell() - (off_t) basecab->length));
+    }
+  }
+
   /* free all loaded cabinets */
   cabd->close(cabd, basecab);
   return errors;
 }
 
+/**
+ * Opens a cabinet at the start of stdin for streaming. This only works
+ * for a single cabinet, not part of a set, whose selected files can be
+ * read front to back. Until the cabinet is accepted for streaming, all of
+ * stdin read is kept, so it can still be searched if not.
+ *
+ * @param basename the name of stdin
+ * @param order    receives the files to process, from order_files()
+ * @param num      receives the number of files to process
+ * @param errors   incremented for each file whose name can't be created
+ * @return the opened cabinet, or NULL if it can't be streamed
+ */
+static struct mscabd_cabinet *open_stream(char *basename,
+                                          struct file_entry **order,
+                                          int *num, int *errors)
+{
+  struct mscabd_cabinet *cab;
+  struct file_entry *cur, *prev;
+  int i, errs = 0;
+
+  if (!(cab = cabd->open(cabd, basename))) return NULL;
+  if ((cab->flags & (MSCAB_HDR_PREVCAB | MSCAB_HDR_NEXTCAB)) ||
+      !(*order = order_files(cab, unix_path_seperators(cab->files),
+                             num, &errs)))
+  {
+    cabd->close(cabd, cab);
+    return NULL;
+  }
+
+  /* listing reads nothing more. otherwise, no file can need data that an
+   * earlier file has already read past. with --pipe, files come in the
+   * cabinet's own order, so folders must be in order across all of it,
+   * as must their data in stdin */
+  for (i = 0, prev = NULL; i < *num && !args.view; prev = &(*order)[i++]) {
+    cur = &(*order)[i];
+    if (!cur->file->folder || (prev &&
+        (cur->folder < prev->folder ||
+         cur->file->folder->data_offset < prev->file->folder->data_offset ||
+         (cur->folder == prev->folder && cur->file->offset <
+          prev->file->offset + prev->file->length))))
+    {
+      free_order(*order, *num);
+      *order = NULL;
+      cabd->close(cabd, cab);
+      return NULL;
+    }
+  }
+
+  cabxbuf_commit();
+  *errors += errs;
+  return cab;
+}
+
+/**
+ * Works out which files in a cabinet to process, and in which order.
+ * Files are selected by the filter, if there is one, before anything is
+ * decompressed. Unless listing or writing to stdout, where files keep the
+ * order of the cabinet's file table, the selected files are ordered by
+ * folder and then by offset within the folder, so each folder is
+ * decompressed at most once, only as far as its last selected file, and
+ * folders without selected files are never read. When extracting, only
+ * the last file listed with each output name is kept, as it is the one
+ * that would be left on disk if they were all extracted in turn.
+ *
+ * @param cab    the cabinet to select files from
+ * @param isunix non-zero if the cabinet uses UNIX path seperators
+ * @param num    receives the number of files selected
+ * @param errors incremented for each file whose name can't be created
+ * @return an array of the selected files and their output names, to be
+ *         freed with free_order(), or NULL if out of memory
+ */
+static struct file_entry *order_files(struct mscabd_cabinet *cab,
+                                      int isunix, int *num, int *errors)
+{
+  struct mscabd_folder *fol, *last = NULL;
+  struct mscabd_file *file;
+  struct file_entry *order;
+  unsigned int count = 0, idx = 0;
+  int fname_offset, i, j;
+  char *name;
+
+  /* the full UNIX output filename includes the output
+   * directory. However, for filtering purposes, we don't want to 
+   * include that. So, we work out where the filename part of the 
+   * output name begins. This is the same for every extracted file.
+   */
+  fname_offset = args.dir ? (strlen(args.dir) + 1) : 0;
+
+  for (file = cab->files; file; file = file->next) count++;
+  if (!(order = malloc((count + 1) * sizeof(*order)))) return NULL;
+
+  *num = 0;
+  for (count = 0, file = cab->files; file; file = file->next, count++) {
+    /* create the full UNIX output filename */
+    if (!(name = create_output_name(file->filename, args.dir,
+          args.lower, isunix, file->attribs & MSCAB_ATTRIB_UTF_NAME)))
+    {
+      (*errors)++;
+      continue;
+    }
+
+    /* if filtering, do so now. skip if file isn't included, or is
+     * excluded */
+    if ((args.include && !matcher_match(args.include, &name[fname_offset])) ||
+        (args.exclude && matcher_match(args.exclude, &name[fname_offset])))
+    {
+      free(name);
+      continue;
+    }
+
+    /* number the file's folder. files are usually grouped by folder, so
+     * try the folder following the last one first. files without a
+     * folder go last */
+    if (file->folder && file->folder != last) {
+      if (last && last->next == file->folder) {
+        idx++;
+      }
+      else {
+        for (fol = cab->folders, idx = 0; fol && fol != file->folder;
+             fol = fol->next) idx++;
+      }
+      last = file->folder;
+    }
+    order[*num].folder = file->folder ? idx : (unsigned int) -1;
+    order[*num].index  = count;
+    order[*num].file   = file;
+    order[*num].name   = name;
+    (*num)++;
+  }
+
+  if (args.view || args.pipe) return order;
+
+  /* drop all but the last-listed file with each output name */
+  if (!args.test && *num > 1) {
+    qsort(order, (size_t) *num, sizeof(*order), &file_entry_name_cmp);
+    for (i = 0, j = 0; i < *num; i++) {
+      if (i + 1 < *num && !strcmp(order[i].name, order[i+1].name)) {
+        free(order[i].name);
+      }
+      else {
+        order[j++] = order[i];
+      }
+    }
+    *num = j;
+  }
+
+  qsort(order, (size_t) *num, sizeof(*order), &file_entry_cmp);
+  return order;
+}
+
+/**
+ * Frees the array of files returned by order_files().
+ *
+ * @param order the array of files
+ * @param num   the number of files in the array
+ */
+static void free_order(struct file_entry *order, int num) {
+  int i;
+  if (order) {
+    for (i = 0; i < num; i++) free(order[i].name);
+    free(order);
+  }
+}
+
+/**
+ * Compares two files by folder, offset and position in the cabinet, for
+ * order_files().
+ */
+static int file_entry_cmp(const void *a, const void *b) {
+  const struct file_entry *x = a, *y = b;
+  if (x->folder != y->folder) return x->folder < y->folder ? -1 : 1;
+  if (x->file->offset != y->file->offset) {
+    return x->file->offset < y->file->offset ? -1 : 1;
+  }
+  return x->index < y->index ? -1 : x->index > y->index ? 1 : 0;
+}
+
+/**
+ * Compares two files by output name and position in the cabinet, for
+ * order_files().
+ */
+static int file_entry_name_cmp(const void *a, const void *b) {
+  const struct file_entry *x = a, *y = b;
+  int cmp = strcmp(x->name, y->name);
+  if (cmp) return cmp;
+  return x->index < y->index ? -1 : x->index > y->index ? 1 : 0;
+}
+
 /**
  * Follows the spanning cabinet chain specified in a cabinet, loading
  * and attaching the spanning cabinets as it goes.
@@ -998,127 +2139,3211 @@ static char *create_output_name(const char *fname, const char *dir,
  *                 file permissions will be set.
  */
 static void set_date_and_perm(struct mscabd_file *file, char *filename) {
-  mode_t mode;
-  struct tm tm;
+  mode_t mode = file_mode(file);
+  time_t mtime = file_mtime(file);
 #if HAVE_UTIME
   struct utimbuf utb;
 #elif HAVE_UTIMES
   struct timeval tv[2];
 #endif
 
-  /* set last modified date */
-  tm.tm_sec   = file->time_s;
-  tm.tm_min   = file->time_m;
-  tm.tm_hour  = file->time_h;
-  tm.tm_mday  = file->date_d;
-  tm.tm_mon   = file->date_m - 1;
-  tm.tm_year  = file->date_y - 1900;
-  tm.tm_isdst = -1;
+#if HAVE_FUTIMENS && HAVE_FCHMOD && USE_OUTPUT_FD
+  /* if the file is still open in the output writer, it sets them once
+   * it has finished writing the file */
+  if (output.file) {
+    output.file->meta  = 1;
+    output.file->mtime = mtime;
+    output.file->mode  = mode & ~user_umask;
+    return;
+  }
+#endif
 
 #if HAVE_UTIME
-  utb.actime = utb.modtime = mktime(&tm);
+  utb.actime = utb.modtime = mtime;
   utime(filename, &utb);
 #elif HAVE_UTIMES
-  tv[0].tv_sec  = tv[1].tv_sec  = mktime(&tm);
+  tv[0].tv_sec  = tv[1].tv_sec  = mtime;
   tv[0].tv_usec = tv[1].tv_usec = 0;
   utimes(filename, &tv[0]);
 #endif
+  chmod(filename, mode & ~user_umask);
+}
+
+/**
+ * Returns the last-modified time of a file in a cabinet. Cabinets store
+ * local times.
+ *
+ * @param file the internal CAB file
+ * @return the file's last-modified time
+ */
+static time_t file_mtime(struct mscabd_file *file) {
+  struct tm tm;
+  tm.tm_sec   = file->time_s;
+  tm.tm_min   = file->time_m;
+  tm.tm_hour  = file->time_h;
+  tm.tm_mday  = file->date_d;
+  tm.tm_mon   = file->date_m - 1;
+  tm.tm_year  = file->date_y - 1900;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+/**
+ * Returns the permissions for a file in a cabinet, before the umask is
+ * applied. Everyone may read it, and write it unless it's read-only, and
+ * run it if it's executable.
+ *
+ * @param file the internal CAB file
+ * @return the file's permissions
+ */
+static mode_t file_mode(struct mscabd_file *file) {
+  mode_t mode = 0444;
+  if (  file->attribs & MSCAB_ATTRIB_EXEC)    mode |= 0111;
+  if (!(file->attribs & MSCAB_ATTRIB_RDONLY)) mode |= 0222;
+  return mode;
+}
+
+/**
+ * Writes the tar header for a file to stdout, for --to-tar. The archive
+ * is a POSIX pax archive: a name that doesn't fit in a ustar header is
+ * written in an extended header before it, as a path record.
+ *
+ * @param name the name of the file
+ * @param file the internal CAB file, for its length, date and attributes
+ * @return zero if the header was written, non-zero if writing failed
+ */
+static int tar_header(const char *name, struct mscabd_file *file) {
+  char block[512], pax[512], num[24], *rec;
+  size_t len = strlen(name), n, rlen;
+  time_t mtime = file_mtime(file);
+  const char *base;
+  int err;
+
+  if (mtime < 0) mtime = 0;
+  if (tar_block(block, name, file->length, mtime, file_mode(file), '0')) {
+    /* the path record is "<length> path=<name>\n", where the length
+     * counts its own digits */
+    n = len + 7;
+    for (rlen = n + 1; n + (size_t) sprintf(num, "%lu", (unsigned long)
+         rlen) != rlen; rlen++);
+    if (!(rec = malloc(rlen + 1))) return 1;
+    n = (size_t) sprintf(rec, "%s path=%s\n", num, name);
+
+    /* the extended header is named after the file's last part */
+    base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    if (strlen(base) > 88) base += strlen(base) - 88;
+    sprintf(block, "PaxHeaders/%s", base);
+    tar_block(pax, block, (unsigned int) n, mtime, 0644, 'x');
+    err = fwrite(pax, 1, 512, stdout) != 512 ||
+          fwrite(rec, 1, n, stdout) != n;
+    free(rec);
+    stdout_written = (off_t) n;
+    if (err || tar_end((unsigned int) n)) return 1;
+
+    /* the ustar header has as much of the name as fits */
+    tar_block(block, name, file->length, mtime, file_mode(file), '0');
+  }
+  return fwrite(block, 1, 512, stdout) != 512;
+}
+
+/**
+ * Fills in a ustar header block. The name is split between the name and
+ * prefix fields at a slash, if it has to be. If it can't be split, the
+ * end of it that fits is used.
+ *
+ * @param block the 512 byte block to fill in
+ * @param name  the name of the entry
+ * @param size  the size of the entry's data
+ * @param mtime the last-modified time of the entry
+ * @param mode  the permissions of the entry
+ * @param type  the type of the entry, '0' for a file or 'x' for an
+ *              extended header
+ * @return zero if the whole name fits, non-zero if it doesn't
+ */
+static int tar_block(char *block, const char *name, unsigned int size,
+                     time_t mtime, mode_t mode, int type)
+{
+  size_t len = strlen(name), i;
+  unsigned int sum = 0;
+  int cut = 0;
+
+  memset(block, 0, 512);
+  if (len <= 100) {
+    memcpy(&block[0], name, len);
+  }
+  else {
+    /* the shortest prefix that leaves at most 100 bytes of name */
+    for (i = len - 101; i < len - 1 && i <= 155 && name[i] != '/'; i++);
+    if (i < len - 1 && i <= 155) {
+      memcpy(&block[345], name, i);
+      memcpy(&block[0], &name[i + 1], len - i - 1);
+    }
+    else {
+      memcpy(&block[0], &name[len - 100], 100);
+      cut = 1;
+    }
+  }
+
+  tar_octal(&block[100], 8, (unsigned long) mode);
+  tar_octal(&block[108], 8, 0);
+  tar_octal(&block[116], 8, 0);
+  tar_octal(&block[124], 12, (unsigned long) size);
+  tar_octal(&block[136], 12, (unsigned long) mtime);
+  block[156] = (char) type;
+  memcpy(&block[257], "ustar\0" "00", 8);
+
+  /* the checksum counts its own field as spaces */
+  memset(&block[148], ' ', 8);
+  for (i = 0; i < 512; i++) sum += (unsigned char) block[i];
+  tar_octal(&block[148], 7, (unsigned long) sum);
+  return cut;
+}
+
+/**
+ * Writes a number into a tar header field as zero-padded octal digits,
+ * followed by a NUL.
+ *
+ * @param field the field to write
+ * @param len   the size of the field, including the NUL
+ * @param value the number to write
+ */
+static void tar_octal(char *field, size_t len, unsigned long value) {
+  field[--len] = '\0';
+  while (len--) {
+    field[len] = (char) ('0' + (value & 7));
+    value >>= 3;
+  }
+}
+
+/**
+ * Ends the data of a tar entry, for --to-tar. If less than the entry's
+ * length was written, because the file failed to extract, the rest is
+ * written as zeros, so the archive stays readable. Then the data is
+ * padded out to a whole number of blocks.
+ *
+ * @param length the length the entry's header gave
+ * @return zero if the padding was written, non-zero if writing failed
+ */
+static int tar_end(unsigned int length) {
+  static const char zeros[512];
+  off_t pad = (off_t) length - stdout_written;
+  size_t run;
+
+  if (pad < 0) pad = 0;
+  pad += (512 - (length & 511)) & 511;
+  for (; pad > 0; pad -= (off_t) run) {
+    run = (pad > 512) ? 512 : (size_t) pad;
+    if (fwrite(zeros, 1, run, stdout) != run) return 1;
+  }
+  return 0;
+}
+
+/* ------- support functions ------- */
+
+/**
+ * Memorises a file by its device and inode number rather than its name. If
+ * the file does not exist, it will not be memorised.
+ *
+ * @param fml  address of the file_mem list that will memorise this file.
+ * @param name name of the file to memorise.
+ * @param from a string that, if not NULL, will be duplicated stored with
+ *             the memorised file.
+ * @see recall_file(), forget_files()
+ */
+static void memorise_file(struct file_mem **fml, char *name, char *from) {
+  struct file_mem *fm;
+  struct stat st_buf;
+  if (stat(name, &st_buf) != 0) return;
+  if (!(fm = malloc(sizeof(struct file_mem)))) return;
+  fm->st_dev = st_buf.st_dev;
+  fm->st_ino = st_buf.st_ino;
+  fm->from = (from) ? malloc(strlen(from)+1) : NULL;
+  if (fm->from) strcpy(fm->from, from);
+  fm->next = *fml;
+  *fml = fm;
+}
+
+/**
+ * Determines if a file has been memorised before, by its device and inode
+ * number. If the file does not exist, it cannot be recalled.
+ *
+ * @param fml  list to search for previously memorised file
+ * @param name name of file to recall.
+ * @param from if non-NULL, this is an address that the associated "from"
+ *             description pointer will be stored.
+ * @return non-zero if the file has been previously memorised, zero if the
+ *         file is unknown or does not exist.
+ * @see memorise_file(), forget_files()
+ */
+static int recall_file(struct file_mem *fml, char *name, char **from) {
+  struct file_mem *fm;
+  struct stat st_buf;
+  if (stat(name, &st_buf) != 0) return 0;
+  for (fm = fml; fm; fm = fm->next) {
+    if ((st_buf.st_ino == fm->st_ino) && (st_buf.st_dev == fm->st_dev)) {
+      if (from) *from = fm->from; return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Frees all memory used by a file_mem list.
+ *
+ * @param fml address of the list to free
+ * @see memorise_file()
+ */
+static void forget_files(struct file_mem **fml) {
+  struct file_mem *fm, *next;
+  for (fm = *fml; fm; fm = next) {
+    next = fm->next;
+    free(fm->from);
+    free(fm);
+  }
+  *fml = NULL;
+}
+
+/**
+ * Reads a list of file names, one per line, and adds them to an array.
+ * Empty lines are ignored.
+ *
+ * @param filename the file to read the names from
+ * @param names    the array of names to add to, which is reallocated
+ * @param num      the number of names in the array, which is updated
+ * @return zero if the names were read, or non-zero after printing why
+ *         they couldn't be
+ */
+static int read_names(char *filename, char ***names, int *num) {
+  char buf[4096], **list;
+  unsigned int line = 0;
+  FILE *fh;
+  size_t len;
+  int max = *num;
+
+  if (!(fh = fopen(filename, "r"))) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return 1;
+  }
+  while (fgets(buf, sizeof(buf), fh)) {
+    line++;
+    len = strlen(buf);
+    if ((len == 0 || buf[len-1] != '\n') && !feof(fh)) {
+      fprintf(stderr, "%s:%u: line too long\n", filename, line);
+      fclose(fh);
+      return 1;
+    }
+    while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r')) len--;
+    if (len == 0) continue;
+    buf[len] = '\0';
+
+    if (*num == max) {
+      max = max ? max * 2 : 64;
+      if (!(list = realloc(*names, max * sizeof(char *)))) break;
+      *names = list;
+    }
+    if (!((*names)[*num] = strdup(buf))) break;
+    (*num)++;
+  }
+  if (ferror(fh) || !feof(fh)) {
+    fprintf(stderr, "%s: %s\n", filename,
+            ferror(fh) ? strerror(errno) : "out of memory");
+    fclose(fh);
+    return 1;
+  }
+  fclose(fh);
+  return 0;
+}
+
+/** The number of bits in each word of a name_matcher mask */
+#define MATCHER_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/**
+ * Hashes a file name for a name_matcher's hash table, ignoring case.
+ */
+static unsigned int matcher_hash(const char *name) {
+  unsigned int hash = 2166136261U;
+  while (*name) {
+    hash ^= (unsigned char) tolower((unsigned char) *name++);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+/**
+ * Creates a matcher for a set of shell patterns and a set of exact names.
+ * Like the -F option always has, patterns are matched against the whole
+ * name and ignore case, and '*' also matches '/'.
+ *
+ * @param patterns     shell patterns to match
+ * @param num_patterns the number of shell patterns
+ * @param names        names to match exactly, except for case
+ * @param num_names    the number of names
+ * @return a new matcher, to be freed with matcher_free(), or NULL if out
+ *         of memory
+ */
+static struct name_matcher *matcher_create(char **patterns, int num_patterns,
+                                           char **names, int num_names)
+{
+  struct name_matcher *m;
+  unsigned int size, positions = 0, pos, slot;
+  const char *p;
+  int i, n, exact;
+
+  if (!(m = calloc(1, sizeof(struct name_matcher)))) return NULL;
+
+  /* size the hash table to at most half full. patterns without any
+   * special characters are exact names too. each pattern needs at most
+   * one automaton position per character, plus one to accept */
+  for (i = 0, n = num_names; i < num_patterns; i++) {
+    if (strpbrk(patterns[i], "*?[\\")) positions += strlen(patterns[i]) + 1;
+    else n++;
+  }
+  for (size = 16; size < (unsigned int) n * 2; size <<= 1);
+  m->names_mask = size - 1;
+  m->words = (positions + MATCHER_BITS - 1) / MATCHER_BITS;
+  if (!(m->names = calloc(size, sizeof(char *))) ||
+      !(m->others = malloc((num_patterns + 1) * sizeof(char *))) ||
+      (m->words && (!(m->glob = calloc(259 * m->words,
+                                       sizeof(unsigned long))) ||
+                    !(m->state = malloc(2 * m->words *
+                                        sizeof(unsigned long))))))
+  {
+    matcher_free(m);
+    return NULL;
+  }
+
+  for (i = 0, pos = 0; i < num_patterns + num_names; i++) {
+    p = (i < num_patterns) ? patterns[i] : names[i - num_patterns];
+    exact = (i >= num_patterns) || !strpbrk(p, "*?[\\");
+    if (exact) {
+      /* add the name to the hash table, unless it's already there */
+      for (slot = matcher_hash(p) & m->names_mask; m->names[slot];
+           slot = (slot + 1) & m->names_mask)
+      {
+        if (strcasecmp(m->names[slot], p) == 0) break;
+      }
+      if (!m->names[slot] && !(m->names[slot] = strdup(p))) {
+        matcher_free(m);
+        return NULL;
+      }
+    }
+    else {
+      /* compile the pattern, or leave it to fnmatch() */
+      if (matcher_add_glob(m, p, pos)) m->others[m->num_others++] = (char *) p;
+      pos += strlen(p) + 1;
+    }
+  }
+  return m;
+}
+
+/**
+ * Compiles a shell pattern into a name_matcher's automaton. Each position
+ * is a '*', or a set of bytes that can be matched there, and the position
+ * after the last is the accepting one. Positions are numbered from pos.
+ *
+ * @param m       the matcher to add the pattern to
+ * @param pattern the shell pattern to add
+ * @param pos     the first free position
+ * @return zero for success, or non-zero if the pattern uses features
+ *         that only fnmatch() understands
+ */
+static int matcher_add_glob(struct name_matcher *m, const char *pattern,
+                            unsigned int pos)
+{
+  unsigned long *star = &m->glob[256 * m->words];
+  unsigned long *start = &m->glob[257 * m->words];
+  unsigned long *accept = &m->glob[258 * m->words];
+  unsigned char set[256];
+  const unsigned char *p = (const unsigned char *) pattern, *q;
+  unsigned int base = pos;
+  int c, lo, hi, first, negate, laststar = 0;
+
+#define MATCHER_SET(mask, n) ((mask)[(n) / MATCHER_BITS] |= \
+  1UL << ((n) % MATCHER_BITS))
+
+  while (*p) {
+    /* runs of '*' are the same as one '*' */
+    if (*p == '*') {
+      if (!laststar) {
+        MATCHER_SET(star, pos);
+        pos++;
+      }
+      laststar = 1;
+      p++;
+      continue;
+    }
+    laststar = 0;
+
+    /* work out the set of bytes this position matches. like fnmatch(),
+     * both the name and the pattern are lowercased before comparing */
+    memset(&set[0], 0, sizeof(set));
+    if (*p == '?') {
+      memset(&set[0], 1, sizeof(set));
+      p++;
+    }
+    else if (*p == '[') {
+      /* a bracket expression, where ']' first is literal */
+      q = p + 1;
+      if ((negate = (*q == '!' || *q == '^'))) q++;
+      for (first = 1; *q && (first || *q != ']'); first = 0) {
+        if (*q == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.')) {
+          return 1;
+        }
+        if (*q == '\\' && q[1]) q++;
+        lo = hi = tolower(*q++);
+        if (*q == '-' && q[1] != ']') {
+          /* like fnmatch(), a range cut short never matches */
+          if (!*++q) return 0;
+          if (*q == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.')) {
+            return 1;
+          }
+          if (*q == '\\' && q[1]) q++;
+          hi = tolower(*q++);
+        }
+        for (c = 0; c < 256; c++) {
+          if (tolower(c) >= lo && tolower(c) <= hi) set[c] = 1;
+        }
+      }
+      if (*q) {
+        if (negate) for (c = 0; c < 256; c++) set[c] = !set[c];
+        p = q + 1;
+      }
+      else {
+        /* without a closing ']', '[' is literal */
+        memset(&set[0], 0, sizeof(set));
+        set['['] = 1;
+        p++;
+      }
+    }
+    else {
+      if (*p == '\\' && p[1]) p++;
+      lo = tolower(*p++);
+      for (c = 0; c < 256; c++) {
+        if (tolower(c) == lo) set[c] = 1;
+      }
+    }
+
+    for (c = 0; c < 256; c++) {
+      if (set[c]) MATCHER_SET(&m->glob[c * m->words], pos);
+    }
+    pos++;
+  }
+  /* only a fully compiled pattern can be started */
+  MATCHER_SET(start, base);
+  MATCHER_SET(accept, pos);
+#undef MATCHER_SET
+  return 0;
+}
+
+/**
+ * Matches a file name against a name_matcher.
+ *
+ * @param m    the matcher
+ * @param name the file name
+ * @return non-zero if the name matches any name or pattern in the matcher
+ */
+static int matcher_match(struct name_matcher *m, const char *name) {
+  unsigned long *cur, *next, *tmp, *mask, *star, *accept;
+  unsigned long x, any, carry, scarry;
+  const unsigned char *p;
+  unsigned int slot, w;
+  int i;
+
+  /* look for the exact name */
+  for (slot = matcher_hash(name) & m->names_mask; m->names[slot];
+       slot = (slot + 1) & m->names_mask)
+  {
+    if (strcasecmp(m->names[slot], name) == 0) return 1;
+  }
+
+  /* run all compiled patterns at once. a position is set in the state if
+   * the pattern up to that position matches the name so far. a byte moves
+   * each position on to the next if the byte is in its set, and keeps any
+   * '*' position where it is. reaching a '*' position also reaches the one
+   * after it, as '*' can match nothing. */
+  if (m->glob) {
+    star   = &m->glob[256 * m->words];
+    accept = &m->glob[258 * m->words];
+    cur    = &m->state[0];
+    next   = &m->state[m->words];
+    for (w = 0, scarry = 0; w < m->words; w++) {
+      x = m->glob[257 * m->words + w];
+      cur[w] = x | ((x & star[w]) << 1) | scarry;
+      scarry = (x & star[w]) >> (MATCHER_BITS - 1);
+    }
+    for (p = (const unsigned char *) name; *p; p++) {
+      mask = &m->glob[*p * m->words];
+      for (w = 0, any = 0, carry = 0, scarry = 0; w < m->words; w++) {
+        x = cur[w] & mask[w];
+        next[w] = (cur[w] & star[w]) | (x << 1) | carry;
+        carry = x >> (MATCHER_BITS - 1);
+        x = next[w] & star[w];
+        next[w] |= (x << 1) | scarry;
+        scarry = x >> (MATCHER_BITS - 1);
+        any |= next[w];
+      }
+      if (!any) break;
+      tmp = cur; cur = next; next = tmp;
+    }
+    if (!*p) {
+      for (w = 0; w < m->words; w++) if (cur[w] & accept[w]) return 1;
+    }
+  }
+
+  /* try the remaining patterns one by one */
+  for (i = 0; i < m->num_others; i++) {
+    if (fnmatch(m->others[i], name, FNM_CASEFOLD) == 0) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Frees a name_matcher created by matcher_create().
+ *
+ * @param m the matcher to free, or NULL
+ */
+static void matcher_free(struct name_matcher *m) {
+  unsigned int i;
+  if (m) {
+    if (m->names) {
+      for (i = 0; i <= m->names_mask; i++) free(m->names[i]);
+    }
+    free(m->names);
+    free(m->glob);
+    free(m->state);
+    free(m->others);
+    free(m);
+  }
+}
+
+/**
+ * Ensures that all directory components in a filepath exist. New directory
+ * components are created, if necessary. Directories that exist are
+ * remembered, so a path is only checked as far back as the closest
+ * directory already known to exist. Missing directories are created one
+ * below the other, each relative to the one before.
+ *
+ * @param path the filepath to check
+ * @return non-zero if all directory components in a filepath exist, zero
+ *         if components do not exist and cannot be created
+ */
+static int ensure_filepath(char *path) {
+  uint64_t start;
+  int ok;
+
+  if (!args.stats) return make_filepath(path);
+  start = stats_clock();
+  ok = make_filepath(path);
+  STATS_ADD(path_time, stats_clock() - start);
+  STATS_ADD(paths, 1);
+  return ok;
+}
+
+/**
+ * Does the work of ensure_filepath().
+ */
+static int make_filepath(char *path) {
+  char *p, *q, *end;
+#if USE_DIRFD
+  int fd, newfd;
+#else
+  struct stat st_buf;
+  int ok;
+#endif
+
+  /* the file's directory, not counting the root directory */
+  if (!(end = strrchr(path, '/')) || end == path) return 1;
+  if (dir_cache_find(path, (size_t) (end - path))) return 1;
+
+  /* find the closest directory known to exist */
+  for (p = end - 1; p > path; p--) {
+    if (*p == '/' && dir_cache_find(path, (size_t) (p - path))) break;
+  }
+
+#if USE_DIRFD
+  /* open that directory, if it isn't open already */
+  if (p == path) {
+    fd = (*path == '/') ? open("/", O_RDONLY | O_DIRECTORY) : AT_FDCWD;
+    if (fd != AT_FDCWD) STATS_ADD(opens, 1);
+  }
+  else {
+    fd = dir_cache_open(path, (size_t) (p - path));
+  }
+  if (fd == -1) return 0;
+
+  /* make and open each directory below it */
+  for (p = (*p == '/') ? p + 1 : p; p < end; p = q + 1) {
+    q = strchr(p, '/');
+    if (q == p) continue;
+    *q = '\0';
+    STATS_ADD(mkdirs, 1);
+    if (mkdirat(fd, p, 0777 & ~user_umask) == 0 || errno == EEXIST) {
+      STATS_ADD(opens, 1);
+      newfd = openat(fd, p, O_RDONLY | O_DIRECTORY);
+    }
+    else {
+      newfd = -1;
+    }
+    *q = '/';
+    if (fd != AT_FDCWD && fd != dir_cache.fd) close(fd);
+    if ((fd = newfd) == -1) return 0;
+    dir_cache_add(path, (size_t) (q - path));
+  }
+
+  /* keep the file's directory open */
+  if (fd != dir_cache.fd) {
+    if (dir_cache.fd != -1) close(dir_cache.fd);
+    free(dir_cache.fd_path);
+    dir_cache.fd = fd;
+    if ((dir_cache.fd_path = malloc((size_t) (end - path) + 1))) {
+      memcpy(dir_cache.fd_path, path, (size_t) (end - path));
+      dir_cache.fd_path[end - path] = '\0';
+    }
+  }
+#else
+  /* check or make each directory below it */
+  for (p = (*p == '/') ? p + 1 : p; p < end; p = q + 1) {
+    q = strchr(p, '/');
+    if (q == p) continue;
+    *q = '\0';
+    ok = (stat(path, &st_buf) == 0) && S_ISDIR(st_buf.st_mode);
+    if (!ok) {
+      STATS_ADD(mkdirs, 1);
+      ok = (mkdir(path, 0777 & ~user_umask) == 0);
+    }
+    *q = '/';
+    if (!ok) return 0;
+    dir_cache_add(path, (size_t) (q - path));
+  }
+#endif
+  return 1;
+}
+
+/**
+ * Removes a file that is about to be written over if it has other hard
+ * links, such as the ones --dedup makes, so writing it can't change the
+ * files it's linked to. The file is then written as a new file.
+ *
+ * @param filename the file about to be written
+ */
+static void unshare_file(const char *filename) {
+  struct stat st_buf;
+  if (stat(filename, &st_buf) == 0 && S_ISREG(st_buf.st_mode) &&
+      st_buf.st_nlink > 1)
+  {
+    unlink(filename);
+  }
+}
+
+#if USE_DIRFD
+/**
+ * Returns an open directory, keeping it open as the directory cache's
+ * last directory. If that is already the directory, nothing is opened.
+ *
+ * @param path the path of the directory, not necessarily null-terminated
+ * @param len  the length of the path
+ * @return a file descriptor for the directory, or -1 for an error
+ */
+static int dir_cache_open(const char *path, size_t len) {
+  char *dir;
+  int fd;
+
+  if (dir_cache.fd != -1 && dir_cache.fd_path &&
+      strncmp(dir_cache.fd_path, path, len) == 0 &&
+      dir_cache.fd_path[len] == '\0')
+  {
+    return dir_cache.fd;
+  }
+
+  if (!(dir = malloc(len + 1))) return -1;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  STATS_ADD(opens, 1);
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1) {
+    free(dir);
+    return -1;
+  }
+  if (dir_cache.fd != -1) close(dir_cache.fd);
+  free(dir_cache.fd_path);
+  dir_cache.fd = fd;
+  dir_cache.fd_path = dir;
+  return fd;
+}
+
+#endif
+
+#if USE_OUTPUT_FD
+/**
+ * Opens a file for writing. If it's in a directory, it's opened relative
+ * to that directory, so only the last part of its name is looked up.
+ *
+ * @param filename the file to open
+ * @param flags    extra flags for open()
+ * @return a file descriptor for the file, or -1 for an error
+ */
+static int open_output(const char *filename, int flags) {
+#if USE_DIRFD
+  const char *base = strrchr(filename, '/');
+  int dirfd;
+#endif
+
+  STATS_ADD(opens, 1);
+  unshare_file(filename);
+#if USE_DIRFD
+  /* files in the current or root directory are opened normally */
+  if (base && base != filename) {
+    dirfd = dir_cache_open(filename, (size_t) (base - filename));
+    if (dirfd == -1) return -1;
+    return openat(dirfd, base + 1, flags | O_WRONLY | O_CREAT | O_TRUNC,
+                  0666);
+  }
+#endif
+  return open(filename, flags | O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+/**
+ * Allocates the output writer's buffers, setting up io_uring for it if
+ * that's available. This is done when the first file is extracted to
+ * disk; until then, ring isn't set up.
+ *
+ * @return zero for success, or non-zero for an error
+ */
+static int output_alloc(void) {
+  size_t size = CABX_OUTBUF;
+  void *mem = NULL;
+#if USE_IO_URING
+  int i;
+
+  ring_setup();
+  if (ring.fd != -1) size *= CABX_RING_BUFS;
+#endif
+
+#if HAVE_POSIX_MEMALIGN
+  if (posix_memalign(&mem, CABX_ALIGN, size)) mem = NULL;
+#else
+  mem = malloc(size);
+#endif
+  if (!(output.mem = mem)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  output.buf = output.mem;
+  output.start = output.used = 0;
+#if USE_IO_URING
+  for (i = 0; i < CABX_RING_BUFS; i++) {
+    ring.bufs[i] = &output.mem[(ring.fd != -1) ? i * CABX_OUTBUF : 0];
+    ring.busy[i] = 0;
+  }
+  ring.current = 0;
+#endif
+  return 0;
+}
+
+/**
+ * Opens the file being extracted to disk, for output_write(). If it's
+ * too long to be written in one go, all its space is allocated at once.
+ * Its length is output_length.
+ *
+ * @param filename the file to open
+ * @return zero for success, or non-zero for an error
+ */
+static int output_open(const char *filename) {
+  struct output_file *f = &output.sync;
+  int flags = 0, direct = 0;
+
+  if (!output.mem && output_alloc()) return -1;
+#if USE_IO_URING
+  if (ring.fd != -1) f = ring_file(filename);
+#endif
+
+#if defined(O_DIRECT) && HAVE_POSIX_MEMALIGN
+  if (args.direct && output_length >= CABX_DIRECT_MIN) {
+    direct = 1;
+    flags = O_DIRECT;
+  }
+#endif
+  f->fd = open_output(filename, flags);
+#if defined(O_DIRECT) && HAVE_POSIX_MEMALIGN
+  /* not every file system allows O_DIRECT */
+  if (f->fd == -1 && direct && errno == EINVAL) {
+    direct = 0;
+    f->fd = open_output(filename, 0);
+  }
+#endif
+  if (f->fd == -1) return -1;
+
+  f->name     = filename;
+  f->writes   = 0;
+  f->error    = 0;
+  f->reported = 0;
+  f->closed   = 0;
+  f->meta     = 0;
+  f->truncate = 0;
+  f->end      = 0;
+  f->data_end = 0;
+  f->length   = output_length;
+
+  /* sparse files only have space for what isn't a hole */
+  if (output_length > CABX_OUTBUF && !args.sparse) {
+    /* space past what is written is freed by output_settle() */
+#if HAVE_FALLOCATE && defined(FALLOC_FL_KEEP_SIZE)
+    f->truncate = !fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, output_length);
+#elif HAVE_POSIX_FALLOCATE
+    f->truncate = !posix_fallocate(f->fd, 0, output_length);
+#endif
+  }
+
+  output.file   = f;
+  output.offset = 0;
+  output.direct = direct;
+
+  /* with io_uring, a file starts where the last one ended in the buffer,
+   * unless O_DIRECT needs it to start at an aligned place */
+  if (direct) {
+    output.used = (output.used + CABX_ALIGN - 1) & ~((size_t) CABX_ALIGN - 1);
+    if (output.used == CABX_OUTBUF) output_next_buffer();
+  }
+  output.start = output.used;
+  return 0;
+}
+
+/**
+ * Adds data to the end of the file being extracted to disk.
+ *
+ * @param buffer the data to write
+ * @param bytes  the number of bytes to write
+ * @return the number of bytes written, or -1 for an error
+ */
+static int output_write(void *buffer, int bytes) {
+  unsigned char *in = (unsigned char *) buffer;
+  size_t left = (size_t) bytes, n;
+
+  while (left > 0) {
+    n = CABX_OUTBUF - output.used;
+    if (n > left) n = left;
+    memcpy(&output.buf[output.used], in, n);
+    output.used += n;
+    in += n;
+    left -= n;
+    if (output.used == CABX_OUTBUF && output_flush()) {
+      output.file->reported = 1;
+      return -1;
+    }
+  }
+  return bytes;
+}
+
+/**
+ * Writes out, or with io_uring starts writing out, everything buffered
+ * for the file being extracted to disk. If the file has had an error,
+ * nothing more is written. With --sparse, whole pages of zeros are left
+ * as holes in the file instead of being written.
+ *
+ * @return zero for success, or -1 if the file has had an error, which is
+ *         also left in errno
+ */
+static int output_flush(void) {
+  struct output_file *f = output.file;
+  unsigned char *buf = &output.buf[output.start];
+  size_t left = output.used - output.start, run, page;
+
+  if (f->error) left = 0;
+  while (left > 0) {
+    run = left;
+    if (args.sparse) {
+      /* write up to the first page of zeros, then skip all of them */
+      page = (size_t) (CABX_ALIGN - (output.offset & (CABX_ALIGN - 1)))
+             & (CABX_ALIGN - 1);
+      while (page + CABX_ALIGN <= left && !output_zero_page(&buf[page])) {
+        page += CABX_ALIGN;
+      }
+      if (page + CABX_ALIGN <= left) run = page;
+    }
+    if (run > 0) {
+      output_put(f, buf, run);
+      if (f->error) break;
+      buf += run;
+      left -= run;
+    }
+    else {
+      do {
+        buf += CABX_ALIGN;
+        left -= CABX_ALIGN;
+        output.offset += CABX_ALIGN;
+      } while (CABX_ALIGN <= left && output_zero_page(buf));
+    }
+  }
+
+#if USE_IO_URING
+  if (ring.fd != -1) {
+    output.start = output.used;
+    if (output.used == CABX_OUTBUF) output_next_buffer();
+  }
+  else
+#endif
+  {
+    output.start = output.used = 0;
+  }
+
+  if (f->error) {
+    errno = f->error;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Writes, or with io_uring starts writing, part of the output writer's
+ * buffer to the file being extracted, at output.offset, which is moved
+ * on past it. If that fails, the error is left in f->error.
+ *
+ * @param f   the file being extracted
+ * @param buf the data to write, in output.buf
+ * @param len the number of bytes to write
+ */
+static void output_put(struct output_file *f, unsigned char *buf,
+                       size_t len)
+{
+  ssize_t n;
+
+  if (output.offset + (off_t) len > f->data_end) {
+    f->data_end = output.offset + (off_t) len;
+  }
+
+#if USE_IO_URING
+  if (ring.fd != -1) {
+    /* O_DIRECT can't write the unaligned end of the file, and the
+     * file's other writes must finish before it's turned off */
+    if (output.direct && (((size_t) (buf - output.buf) | len)
+                          & (CABX_ALIGN - 1)))
+    {
+      while (f->writes) ring_submit(1);
+      output_undirect(f->fd);
+      output.direct = 0;
+    }
+    ring_write(f, buf, len, output.offset);
+    output.offset += (off_t) len;
+    return;
+  }
+#endif
+
+  while (len > 0) {
+#if defined(O_DIRECT) && HAVE_POSIX_MEMALIGN
+    /* O_DIRECT can't write the unaligned end of the file, and may be
+     * refused even when aligned */
+    if (output.direct && ((len | (size_t) (buf - output.buf))
+                          & (CABX_ALIGN - 1)))
+    {
+      output_undirect(f->fd);
+      output.direct = 0;
+    }
+#endif
+    STATS_ADD(pwrites, 1);
+    if ((n = pwrite(f->fd, buf, len, output.offset)) < 0) {
+      if (errno == EINTR) continue;
+#if defined(O_DIRECT) && HAVE_POSIX_MEMALIGN
+      if (errno == EINVAL && output.direct && output_undirect(f->fd) == 0) {
+        output.direct = 0;
+        continue;
+      }
+#endif
+      f->error = errno;
+      return;
+    }
+    buf += n;
+    len -= (size_t) n;
+    output.offset += (off_t) n;
+  }
+}
+
+/**
+ * Checks if a page of CABX_ALIGN bytes is all zeros. Each 256 bytes are
+ * ORed together without branching, so compilers can vectorise it.
+ *
+ * @param page the page to check, which need not be aligned
+ * @return non-zero if the page is all zeros
+ */
+static int output_zero_page(const unsigned char *page) {
+  unsigned char acc;
+  size_t i, j;
+
+  for (i = 0; i < CABX_ALIGN; i += 256) {
+    acc = 0;
+    for (j = 0; j < 256; j++) acc |= page[i + j];
+    if (acc) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Turns off O_DIRECT for a file being extracted to disk.
+ *
+ * @param fd the file
+ * @return zero if O_DIRECT was turned off, or -1 if it wasn't on or
+ *         couldn't be turned off
+ */
+static int output_undirect(int fd) {
+#if defined(O_DIRECT) && HAVE_POSIX_MEMALIGN
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1 && (flags & O_DIRECT)) {
+    return fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+  }
+#endif
+  return -1;
+}
+
+/**
+ * Moves the output writer on to its next buffer once the current one is
+ * full. With io_uring, this waits until the next buffer's writes finish.
+ */
+static void output_next_buffer(void) {
+#if USE_IO_URING
+  if (ring.fd != -1) {
+    ring_submit(0);
+    ring.current = (ring.current + 1) % CABX_RING_BUFS;
+    while (ring.busy[ring.current]) ring_submit(1);
+    output.buf = ring.bufs[ring.current];
+  }
+#endif
+  output.start = output.used = 0;
+}
+
+/**
+ * Hands over the file being extracted to disk, once cabx_close() has
+ * flushed it. Without io_uring, it's finished and closed at once. With
+ * io_uring, that happens once all its writes are done, and any error is
+ * reported by output_sync().
+ *
+ * @return the number of errors reported, which is zero or one
+ */
+static int output_close(void) {
+  struct output_file *f = output.file;
+  int errors;
+
+  if (!f) return 0;
+  output.file = NULL;
+  f->end = output.offset;
+
+#if USE_IO_URING
+  if (ring.fd != -1) {
+    f->closed = 1;
+    if (f->writes == 0) ring_finish(f);
+    if (ring.queued >= CABX_RING_BATCH) ring_submit(0);
+    return 0;
+  }
+#endif
+
+  errors = output_settle(f);
+  if (close(f->fd) && !errors) {
+    fprintf(stderr, "%s: %s\n", f->name, strerror(errno));
+    errors = 1;
+  }
+  f->fd = -1;
+  return errors;
+}
+
+/**
+ * Finishes a file once everything has been written to it: cuts it back
+ * to what was written if it was allocated longer, sets the date and
+ * permissions that set_date_and_perm() gave it, drops it from the page
+ * cache if asked to, and reports any error not already reported.
+ *
+ * @param f the file to finish, which is still open
+ * @return the number of errors reported, which is zero or one
+ */
+static int output_settle(struct output_file *f) {
+#if HAVE_FUTIMENS && HAVE_FCHMOD
+  struct timespec ts[2];
+#endif
+
+  /* a file that ends in a hole, or is allocated longer than what was
+   * written, must be set to the length written. this also frees space
+   * allocated past its end when extracting it failed or stopped early */
+  if ((f->truncate && f->end != f->length) || f->end > f->data_end) {
+    if (ftruncate(f->fd, f->end) && !f->error) f->error = errno;
+  }
+#if HAVE_FUTIMENS && HAVE_FCHMOD
+  if (f->meta && !f->error) {
+    ts[0].tv_sec  = ts[1].tv_sec  = f->mtime;
+    ts[0].tv_nsec = ts[1].tv_nsec = 0;
+    futimens(f->fd, &ts[0]);
+    fchmod(f->fd, f->mode);
+  }
+#endif
+#if HAVE_POSIX_FADVISE && defined(POSIX_FADV_DONTNEED)
+  /* only written-back pages can be dropped from the page cache */
+  if (args.drop_cache) {
+# if HAVE_FDATASYNC
+    fdatasync(f->fd);
+# else
+    fsync(f->fd);
+# endif
+    posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+#endif
+  if (f->error && !f->reported) {
+    fprintf(stderr, "%s: %s\n", f->name, strerror(f->error));
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Waits until every file handed over by output_close() is finished and
+ * closed. Nothing is waited for without io_uring.
+ *
+ * @return the number of errors reported while finishing those files
+ */
+static int output_sync(void) {
+  int errors = 0;
+#if USE_IO_URING
+  if (output.mem && ring.fd != -1) {
+    while (ring.queued || ring.inflight) ring_submit(1);
+    errors = ring.errors;
+    ring.errors = 0;
+  }
+#endif
+  return errors;
+}
+
+/**
+ * Frees the output writer, once output_sync() has been called.
+ */
+static void output_free(void) {
+  if (!output.mem) return;
+#if USE_IO_URING
+  if (ring.fd != -1) {
+    munmap(ring.sq_map, ring.sq_map_len);
+    munmap(ring.cq_map, ring.cq_map_len);
+    munmap(ring.sqes, ring.sqes_len);
+    close(ring.fd);
+    ring.fd = -1;
+  }
+#endif
+  free(output.mem);
+  output.mem = output.buf = NULL;
+}
+#endif
+
+#if USE_IO_URING
+/**
+ * Sets up an io_uring instance for the output writer. If the kernel
+ * doesn't have io_uring, or doesn't support writes and closes with it,
+ * the output writer just uses write() and close().
+ */
+static void ring_setup(void) {
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t probe_len;
+  unsigned char *sq, *cq;
+  int fd, ok, i;
+
+  ring.fd = -1;
+  memset(&p, 0, sizeof(p));
+  if ((fd = (int) syscall(__NR_io_uring_setup, CABX_RING_ENTRIES, &p)) < 0) {
+    return;
+  }
+
+  /* check that writes and closes are supported */
+  probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  ok = 0;
+  if ((probe = calloc(1, probe_len))) {
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0 &&
+        probe->ops_len > IORING_OP_CLOSE &&
+        probe->ops_len > IORING_OP_WRITE &&
+        (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+    {
+      ok = 1;
+    }
+    free(probe);
+  }
+
+  ring.sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring.cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring.sqes_len   = p.sq_entries * sizeof(struct io_uring_sqe);
+  sq = cq = NULL;
+  ring.sqes = NULL;
+  if (ok) {
+    sq = mmap(NULL, ring.sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+              fd, IORING_OFF_SQ_RING);
+    cq = mmap(NULL, ring.cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+              fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, IORING_OFF_SQES);
+  }
+  if (!ok || sq == MAP_FAILED || cq == MAP_FAILED ||
+      ring.sqes == MAP_FAILED)
+  {
+    if (sq && sq != MAP_FAILED) munmap(sq, ring.sq_map_len);
+    if (cq && cq != MAP_FAILED) munmap(cq, ring.cq_map_len);
+    if (ring.sqes && ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqes_len);
+    close(fd);
+    return;
+  }
+
+  ring.sq_map     = sq;
+  ring.cq_map     = cq;
+  ring.sq_head    = (unsigned int *) &sq[p.sq_off.head];
+  ring.sq_tail    = (unsigned int *) &sq[p.sq_off.tail];
+  ring.sq_mask    = *(unsigned int *) &sq[p.sq_off.ring_mask];
+  ring.sq_array   = (unsigned int *) &sq[p.sq_off.array];
+  ring.cq_head    = (unsigned int *) &cq[p.cq_off.head];
+  ring.cq_tail    = (unsigned int *) &cq[p.cq_off.tail];
+  ring.cq_mask    = *(unsigned int *) &cq[p.cq_off.ring_mask];
+  ring.cqes       = (struct io_uring_cqe *) &cq[p.cq_off.cqes];
+  ring.sq_entries = p.sq_entries;
+  ring.cq_entries = p.cq_entries;
+  ring.queued = ring.inflight = 0;
+  ring.errors = 0;
+  ring.broken = 0;
+
+  for (i = 0; i < CABX_RING_FILES; i++) ring.files[i].fd = -1;
+  for (i = 0; i < CABX_RING_OPS; i++) ring.ops[i].next = i + 1;
+  ring.ops[CABX_RING_OPS - 1].next = -1;
+  ring.free_op = 0;
+  ring.fd = fd;
+}
+
+/**
+ * Finds a free slot for a file about to be extracted to disk. If all are
+ * in use, or another file with the same name is still being written, it
+ * waits for them to finish.
+ *
+ * @param filename the name of the file
+ * @return the slot for the file
+ */
+static struct output_file *ring_file(const char *filename) {
+  struct output_file *f, *free_file;
+  int i, same;
+
+  for (;;) {
+    free_file = NULL;
+    same = 0;
+    for (i = 0; i < CABX_RING_FILES; i++) {
+      f = &ring.files[i];
+      if (f->fd == -1) {
+        if (!free_file) free_file = f;
+      }
+      else if (strcmp(f->name, filename) == 0) {
+        same = 1;
+      }
+    }
+    if (free_file && !same) return free_file;
+    ring_submit(1);
+  }
+}
+
+/**
+ * Gets the next submission queue entry, and an operation to track it. If
+ * there is no room, it waits until there is.
+ *
+ * @param type the type of operation
+ * @param f    the file the operation is for
+ * @return the zeroed submission queue entry, with its user_data set
+ */
+static struct io_uring_sqe *ring_sqe(int type, struct output_file *f) {
+  struct io_uring_sqe *sqe;
+  unsigned int tail;
+  int op;
+
+  if (ring.queued == ring.sq_entries) ring_submit(0);
+  while (ring.free_op == -1 ||
+         ring.queued + ring.inflight >= ring.cq_entries)
+  {
+    ring_submit(1);
+  }
+
+  op = ring.free_op;
+  ring.free_op = ring.ops[op].next;
+  ring.ops[op].type = type;
+  ring.ops[op].file = f;
+
+  tail = *ring.sq_tail;
+  sqe = &ring.sqes[tail & ring.sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (unsigned long long) op;
+  ring.sq_array[tail & ring.sq_mask] = tail & ring.sq_mask;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.queued++;
+  return sqe;
+}
+
+/**
+ * Queues a write to a file from the output writer's current buffer.
+ *
+ * @param f      the file to write to
+ * @param buf    the data to write
+ * @param len    the number of bytes to write
+ * @param offset the file offset to write them at
+ */
+static void ring_write(struct output_file *f, unsigned char *buf,
+                       size_t len, off_t offset)
+{
+  struct io_uring_sqe *sqe = ring_sqe(RING_OP_WRITE, f);
+  struct ring_op *op = &ring.ops[sqe->user_data];
+
+  op->buf    = ring.current;
+  op->data   = buf;
+  op->len    = len;
+  op->offset = offset;
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd     = f->fd;
+  sqe->addr   = (unsigned long long) (size_t) buf;
+  sqe->len    = (unsigned int) len;
+  sqe->off    = (unsigned long long) offset;
+  f->writes++;
+  ring.busy[ring.current]++;
+}
+
+/**
+ * Finishes a file once output_close() has handed it over and all its
+ * writes are done, then queues it to be closed.
+ *
+ * @param f the file to finish
+ */
+static void ring_finish(struct output_file *f) {
+  struct io_uring_sqe *sqe;
+  ring.errors += output_settle(f);
+  sqe = ring_sqe(RING_OP_CLOSE, f);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd     = f->fd;
+}
+
+/**
+ * Submits queued operations to io_uring, then deals with any completed
+ * operations. Once io_uring has failed, the queued operations are done
+ * at once instead.
+ *
+ * @param wait if non-zero, waits for at least one operation to complete
+ */
+static void ring_submit(int wait) {
+  long n;
+
+  if (wait && !ring.queued && !ring.inflight) return;
+  if (ring.broken) {
+    ring_run();
+    return;
+  }
+  for (;;) {
+    STATS_ADD(ring_enters, 1);
+    n = syscall(__NR_io_uring_enter, ring.fd, ring.queued, wait ? 1 : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n >= 0) {
+      ring.queued -= (unsigned int) n;
+      ring.inflight += (unsigned int) n;
+      break;
+    }
+    if (errno == EAGAIN || errno == EBUSY) {
+      /* the completion queue is full, so empty it and try again */
+      ring_reap();
+    }
+    else if (errno != EINTR) {
+      ring_fail(errno);
+      ring_run();
+      return;
+    }
+  }
+  ring_reap();
+}
+
+/**
+ * Stops using io_uring after io_uring_enter() fails. Operations that
+ * have completed are dealt with as usual. Those still in flight can't be
+ * waited for, so their writes fail, and their closes are taken as done.
+ * From then on, ring_submit() does operations with ring_run().
+ *
+ * @param error why io_uring_enter() failed
+ */
+static void ring_fail(int error) {
+  unsigned char known[CABX_RING_OPS];
+  unsigned int i;
+  int op;
+
+  fprintf(stderr, "io_uring: %s\n", strerror(error));
+  ring_reap();
+
+  /* every operation that isn't free or queued is in flight */
+  memset(known, 0, sizeof(known));
+  for (op = ring.free_op; op != -1; op = ring.ops[op].next) known[op] = 1;
+  for (i = ring.queued; i > 0; i--) {
+    known[ring.sqes[(*ring.sq_tail - i) & ring.sq_mask].user_data] = 1;
+  }
+  ring.broken = 1;
+  ring.inflight = 0;
+  for (i = 0; i < CABX_RING_OPS; i++) {
+    if (known[i]) continue;
+    known[i] = 1;
+    ring_complete(&ring.ops[i], ring.ops[i].type == RING_OP_CLOSE ? 0 : -EIO);
+  }
+}
+
+/**
+ * Does the queued operations at once, in the order they were queued,
+ * after io_uring has failed. Writes are done with pwrite() by
+ * ring_complete(), as if io_uring had written nothing.
+ */
+static void ring_run(void) {
+  struct ring_op *op;
+  int res;
+
+  while (ring.queued > 0) {
+    op = &ring.ops[ring.sqes[(*ring.sq_tail - ring.queued)
+                             & ring.sq_mask].user_data];
+    ring.queued--;
+    res = 0;
+    if (op->type == RING_OP_CLOSE && close(op->file->fd)) res = -errno;
+    ring_complete(op, res);
+  }
+}
+
+/**
+ * Deals with every completed operation. Writes that fell short are
+ * finished with pwrite(), and files are finished once their last write
+ * completes.
+ */
+static void ring_reap(void) {
+  struct io_uring_cqe *cqe;
+  struct ring_op *op;
+  unsigned int head;
+  int res;
+
+  for (;;) {
+    head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) break;
+    cqe = &ring.cqes[head & ring.cq_mask];
+    op  = &ring.ops[cqe->user_data];
+    res = cqe->res;
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    ring.inflight--;
+    ring_complete(op, res);
+  }
+}
+
+/**
+ * Deals with a completed operation, and frees it.
+ *
+ * @param op  the operation
+ * @param res its result: bytes written or zero, or a negative errno
+ */
+static void ring_complete(struct ring_op *op, int res) {
+  struct output_file *f = op->file;
+  unsigned char *data;
+  size_t len;
+  off_t offset;
+  ssize_t n;
+
+  op->next = ring.free_op;
+  ring.free_op = (int) (op - ring.ops);
+
+  if (op->type == RING_OP_CLOSE) {
+    if (res < 0) {
+      fprintf(stderr, "%s: %s\n", f->name, strerror(-res));
+      ring.errors++;
+    }
+    f->fd = -1;
+    return;
+  }
+
+  /* finish a short or interrupted write in place */
+  data = op->data;
+  len = op->len;
+  offset = op->offset;
+  if (res >= 0) {
+    data += res;
+    len -= (size_t) res;
+    offset += res;
+  }
+  else if (res != -EINTR && res != -EAGAIN &&
+           !(res == -EINVAL && output_undirect(f->fd) == 0))
+  {
+    /* O_DIRECT refused writes are retried without it */
+    len = 0;
+    if (!f->error) f->error = -res;
+  }
+  while (len > 0 && !f->error) {
+    STATS_ADD(pwrites, 1);
+    if ((n = pwrite(f->fd, data, len, offset)) < 0) {
+      if (errno != EINTR) f->error = errno;
+      continue;
+    }
+    data += n;
+    len -= (size_t) n;
+    offset += n;
+  }
+
+  ring.busy[op->buf]--;
+  if (--f->writes == 0 && f->closed) ring_finish(f);
+}
+#endif
+
+/**
+ * Hashes the first len bytes of a path, for the directory cache.
+ */
+static unsigned int dir_cache_hash(const char *path, size_t len) {
+  unsigned int hash = 2166136261U;
+  while (len--) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+/**
+ * Looks for a directory in the directory cache.
+ *
+ * @param path the path of the directory, not necessarily null-terminated
+ * @param len  the length of the path
+ * @return non-zero if the directory is known to exist
+ */
+static int dir_cache_find(const char *path, size_t len) {
+  unsigned int slot;
+  char *dir;
+  if (!dir_cache.dirs) return 0;
+  for (slot = dir_cache_hash(path, len) & dir_cache.mask;
+       (dir = dir_cache.dirs[slot]); slot = (slot + 1) & dir_cache.mask)
+  {
+    if (strncmp(dir, path, len) == 0 && dir[len] == '\0') return 1;
+  }
+  return 0;
+}
+
+/**
+ * Adds a directory to the directory cache. The hash table doubles in
+ * size when it is half full. If there isn't enough memory, the directory
+ * is simply not remembered.
+ *
+ * @param path the path of the directory, not necessarily null-terminated
+ * @param len  the length of the path
+ */
+static void dir_cache_add(const char *path, size_t len) {
+  unsigned int i, slot, size;
+  char **dirs, *dir;
+
+  if (dir_cache_find(path, len)) return;
+
+  /* grow the hash table, if needed */
+  if ((dir_cache.num + 1) * 2 > dir_cache.mask + 1 || !dir_cache.dirs) {
+    size = dir_cache.dirs ? (dir_cache.mask + 1) * 2 : 256;
+    if (!(dirs = calloc(size, sizeof(char *)))) return;
+    for (i = 0; dir_cache.dirs && i <= dir_cache.mask; i++) {
+      if (!(dir = dir_cache.dirs[i])) continue;
+      for (slot = dir_cache_hash(dir, strlen(dir)) & (size - 1); dirs[slot];
+           slot = (slot + 1) & (size - 1));
+      dirs[slot] = dir;
+    }
+    free(dir_cache.dirs);
+    dir_cache.dirs = dirs;
+    dir_cache.mask = size - 1;
+  }
+
+  if (!(dir = malloc(len + 1))) return;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  for (slot = dir_cache_hash(path, len) & dir_cache.mask;
+       dir_cache.dirs[slot]; slot = (slot + 1) & dir_cache.mask);
+  dir_cache.dirs[slot] = dir;
+  dir_cache.num++;
+}
+
+/**
+ * Empties the directory cache and closes the directory kept open.
+ */
+static void dir_cache_free(void) {
+  unsigned int i;
+  if (dir_cache.dirs) {
+    for (i = 0; i <= dir_cache.mask; i++) free(dir_cache.dirs[i]);
+    free(dir_cache.dirs);
+  }
+  if (dir_cache.fd != -1) close(dir_cache.fd);
+  free(dir_cache.fd_path);
+  dir_cache.dirs = NULL;
+  dir_cache.mask = dir_cache.num = 0;
+  dir_cache.fd = -1;
+  dir_cache.fd_path = NULL;
+}
+
+/**
+ * Checks the data blocks of every folder in a cabinet or cabinet set, for
+ * --verify-blocks. Nothing is decompressed, only the block headers and
+ * checksums are checked. Prints a line for each folder, unless it's OK
+ * and --quiet is set.
+ *
+ * @param cab the cabinet to check
+ * @return the number of folders that failed
+ */
+static int check_blocks(struct mscabd_cabinet *cab) {
+  struct mscabd_folder *fol;
+  unsigned int block, unchecked;
+  int i, errors = 0;
+
+  /* folders and blocks are numbered from 0, as --json numbers them */
+  for (fol = cab->folders, i = 0; fol; fol = fol->next, i++) {
+    if (cabd->check_folder(cabd, fol, &block, &unchecked)) {
+      printf("  folder %d  failed at block %u (%s)\n", i, block,
+             cab_error(cabd));
+      errors++;
+    }
+    else if (!args.quiet) {
+      printf("  folder %d  OK  (%u blocks", i, block);
+      if (unchecked) printf(", %u without checksums", unchecked);
+      printf(")\n");
+    }
+  }
+  return errors;
+}
+
+/**
+ * Prints the result of testing a file. If the file extracted OK, its
+ * digest is printed right-aligned to 79 columns if that's possible,
+ * otherwise just 2 spaces after the filename and "OK". With --manifest,
+ * files that extracted OK are written to the manifest instead, and with
+ * --verify, files are compared with the manifest.
+ *
+ * @param name   the name of the file
+ * @param length the size of the file
+ * @param error  why the file failed to extract, or NULL if it didn't
+ * @param digest the digest of the file
+ */
+static void print_test_result(const char *name, unsigned int length,
+                              const char *error,
+                              const unsigned char *digest)
+{
+  size_t i, size = digest_size(args.digest);
+  FILE *fh = manifest_fh ? manifest_fh : stdout;
+  int spaces;
+
+  if (args.verify) {
+    verify_file(name, length, error, digest);
+    return;
+  }
+
+  if (error) {
+    printf("  %s  failed (%s)\n", name, error);
+    return;
+  }
+
+  if (manifest_fh) {
+    manifest_path(name);
+    fprintf(fh, "\t%u\t", length);
+  }
+  else {
+    /* "  filename  OK  " is 8 chars + the length of filename,
+     * the digest itself is two chars for each byte. */
+    spaces = 79 - (strlen(name) + 8 + size * 2);
+    printf("  %s  OK  ", name);
+    while (spaces-- > 0) putchar(' ');
+  }
+  for (i = 0; i < size; i++) fprintf(fh, "%02x", digest[i]);
+  putc('\n', fh);
+}
+
+/**
+ * Writes a path to the manifest. Backslashes, tabs and line breaks in the
+ * path are written as \\, \t, \n and \r, so each line of the manifest is
+ * one file and each tab separates two fields.
+ *
+ * @param name the path to write
+ */
+static void manifest_path(const char *name) {
+  const char *p;
+  for (p = name; *p; p++) {
+    switch (*p) {
+    case '\\': fputs("\\\\", manifest_fh); break;
+    case '\t': fputs("\\t", manifest_fh); break;
+    case '\n': fputs("\\n", manifest_fh); break;
+    case '\r': fputs("\\r", manifest_fh); break;
+    default:   putc(*p, manifest_fh); break;
+    }
+  }
+}
+
+/**
+ * Reads a manifest written by --manifest, for --verify. The manifest's
+ * first line names the digest it has, which becomes the digest used.
+ *
+ * @param filename the manifest to read
+ * @return zero if the manifest was read, or non-zero after printing why
+ *         it couldn't be
+ */
+static int verify_load(const char *filename) {
+  unsigned char digest[DIGEST_MAX];
+  char buf[8192], *path, *size, *hex, *end, *in, *out;
+  unsigned long length;
+  unsigned int line = 0;
+  size_t len, i, dsize = 0;
+  FILE *fh;
+  int type, c;
+
+  if (!(fh = fopen(filename, "r"))) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return 1;
+  }
+
+  while (fgets(buf, sizeof(buf), fh)) {
+    line++;
+    len = strlen(buf);
+    if (len > 0 && buf[len-1] == '\n') len--;
+    else if (!feof(fh)) goto bad_line; /* line too long */
+    if (len > 0 && buf[len-1] == '\r') len--;
+    buf[len] = '\0';
+
+    /* split the line into its three fields */
+    path = buf;
+    if (!(size = strchr(path, '\t'))) goto bad_line;
+    *size++ = '\0';
+    if (!(hex = strchr(size, '\t'))) goto bad_line;
+    *hex++ = '\0';
+
+    /* the first line names the fields, and the digest */
+    if (line == 1) {
+      if (strcmp(path, "path") || strcmp(size, "size") ||
+          (type = digest_lookup(hex)) < 0) goto bad_line;
+      args.digest = type;
+      dsize = digest_size(type);
+      continue;
+    }
+
+    errno = 0;
+    length = strtoul(size, &end, 10);
+    if (*size < '0' || *size > '9' || *end || errno ||
+        length > 0xFFFFFFFFUL || strlen(hex) != dsize * 2) goto bad_line;
+    for (i = 0; i < dsize * 2; i++) {
+      c = hex[i];
+      if      (c >= '0' && c <= '9') c -= '0';
+      else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+      else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+      else goto bad_line;
+      digest[i / 2] = (i & 1) ? (digest[i / 2] << 4) | c : c;
+    }
+
+    /* undo the escapes written by manifest_path() */
+    for (in = out = path; *in; in++) {
+      if (*in == '\\') {
+        switch (*++in) {
+        case '\\': *out++ = '\\'; break;
+        case 't':  *out++ = '\t'; break;
+        case 'n':  *out++ = '\n'; break;
+        case 'r':  *out++ = '\r'; break;
+        default:   goto bad_line;
+        }
+      }
+      else {
+        *out++ = *in;
+      }
+    }
+    *out = '\0';
+
+    if (verify_add(path, (unsigned int) length, digest)) {
+      fprintf(stderr, "%s: out of memory\n", filename);
+      fclose(fh);
+      return 1;
+    }
+  }
+
+  if (ferror(fh) || line == 0) {
+    fprintf(stderr, "%s: %s\n", filename,
+            line ? strerror(errno) : "not a manifest");
+    fclose(fh);
+    return 1;
+  }
+  fclose(fh);
+  return 0;
+
+bad_line:
+  fprintf(stderr, "%s:%u: not a manifest line\n", filename, line);
+  fclose(fh);
+  return 1;
+}
+
+/**
+ * Adds an entry to the --verify table.
+ *
+ * @param path   the path of the file
+ * @param length the expected size of the file
+ * @param digest the expected digest of the file
+ * @return zero if the entry was added, or non-zero if out of memory
+ */
+static int verify_add(char *path, unsigned int length,
+                      const unsigned char *digest)
+{
+  struct verify_entry *list, *e;
+  unsigned int i, slot, size, *slots;
+  char *p;
+
+  /* grow the list and the hash table, if needed */
+  if (verify.num == verify.max) {
+    size = verify.max ? verify.max * 2 : 256;
+    if (!(list = realloc(verify.list, size * sizeof(*list)))) return 1;
+    verify.list = list;
+    verify.max = size;
+  }
+  if ((verify.num + 1) * 2 > verify.mask + 1 || !verify.slots) {
+    size = verify.slots ? (verify.mask + 1) * 2 : 512;
+    if (!(slots = calloc(size, sizeof(*slots)))) return 1;
+    for (i = 0; i < verify.num; i++) {
+      p = verify.list[i].path;
+      for (slot = dir_cache_hash(p, strlen(p)) & (size - 1);
+           slots[slot]; slot = (slot + 1) & (size - 1));
+      slots[slot] = i + 1;
+    }
+    free(verify.slots);
+    verify.slots = slots;
+    verify.mask = size - 1;
+  }
+
+  e = &verify.list[verify.num];
+  if (!(e->path = strdup(path))) return 1;
+  e->length = length;
+  e->seen = 0;
+  memcpy(e->digest, digest, DIGEST_MAX);
+  for (slot = dir_cache_hash(path, strlen(path)) & verify.mask;
+       verify.slots[slot]; slot = (slot + 1) & verify.mask);
+  verify.slots[slot] = ++verify.num;
+  return 0;
+}
+
+/**
+ * Finds the --verify entry for a path. If the manifest has the path more
+ * than once, as a cabinet can, the first entry not yet seen is found.
+ *
+ * @param path the path to look for
+ * @return the entry, or NULL if there is no entry not yet seen
+ */
+static struct verify_entry *verify_find(const char *path) {
+  struct verify_entry *e, *found = NULL;
+  unsigned int slot;
+
+  if (!verify.slots) return NULL;
+  for (slot = dir_cache_hash(path, strlen(path)) & verify.mask;
+       verify.slots[slot]; slot = (slot + 1) & verify.mask)
+  {
+    e = &verify.list[verify.slots[slot] - 1];
+    if (!e->seen && (!found || e < found) && strcmp(e->path, path) == 0) {
+      found = e;
+    }
+  }
+  return found;
+}
+
+/**
+ * Compares a tested file with its --verify entry, and prints the result.
+ * With --fail-fast, the first file that fails or doesn't match stops
+ * testing.
+ *
+ * @param name   the name of the file
+ * @param length the size of the file
+ * @param error  why the file failed to extract, or NULL if it didn't
+ * @param digest the digest of the file
+ */
+static void verify_file(const char *name, unsigned int length,
+                        const char *error, const unsigned char *digest)
+{
+  struct verify_entry *e;
+  const char *problem = NULL;
+
+  if (error) {
+    /* counted as an error by whoever tested the file */
+    printf("  %s  failed (%s)\n", name, error);
+    if (args.fail_fast) verify.stop = 1;
+    return;
+  }
+
+  if (!(e = verify_find(name))) {
+    problem = "not in manifest";
+  }
+  else {
+    e->seen = 1;
+    if (e->length != length) {
+      problem = "wrong size";
+    }
+    else if (memcmp(e->digest, digest, digest_size(args.digest))) {
+      problem = "wrong digest";
+    }
+  }
+
+  if (problem) {
+    printf("  %s  %s\n", name, problem);
+    verify.errors++;
+    if (args.fail_fast) verify.stop = 1;
+  }
+  else if (!args.quiet) {
+    printf("  %s  OK\n", name);
+  }
+}
+
+/**
+ * Finishes --verify. Unless testing was stopped or only some files were
+ * tested, entries in the manifest that no file had are reported missing.
+ *
+ * @return the number of files that didn't match or were missing
+ */
+static int verify_finish(void) {
+  unsigned int i;
+  int errors = verify.errors;
+
+  for (i = 0; i < verify.num; i++) {
+    if (!verify.list[i].seen && !verify.stop &&
+        !args.include && !args.exclude)
+    {
+      printf("  %s  missing\n", verify.list[i].path);
+      errors++;
+    }
+    free(verify.list[i].path);
+  }
+  free(verify.list);
+  free(verify.slots);
+  verify.list = NULL;
+  verify.slots = NULL;
+  verify.num = verify.max = 0;
+  return errors;
+}
+
+/**
+ * Starts batching small files for -t, if the digest can hash several
+ * files at once on this CPU. If the batch can't be allocated, files are
+ * hashed as they are extracted, as before.
+ */
+static void batch_start(void) {
+  if (digest_lanes(args.digest) > 1 &&
+      (batch.data = malloc(TEST_BATCH_SIZE)))
+  {
+    batch.active = 1;
+  }
+}
+
+/**
+ * Adds data written to TEST_FNAME to the file being written to a batch.
+ * process_cabinet() and verify_main() make sure the whole file fits.
+ *
+ * @param b      the batch
+ * @param buffer the data to add
+ * @param bytes  the number of bytes to add
+ * @return the number of bytes added, or -1 if they don't fit
+ */
+static int batch_write(struct test_batch *b, void *buffer, int bytes) {
+  if (b->used + b->fill + (size_t) bytes > TEST_BATCH_SIZE) return -1;
+  memcpy(&b->data[b->used + b->fill], buffer, (size_t) bytes);
+  b->fill += (size_t) bytes;
+  return bytes;
+}
+
+/**
+ * Adds the file just written to a batch. Its result is set by
+ * batch_hash().
+ *
+ * @param b    the batch
+ * @param name the name of the file, which must last until it is printed
+ */
+static void batch_add(struct test_batch *b, const char *name) {
+  b->names[b->num] = name;
+  b->buffers[b->num] = &b->data[b->used];
+  b->lengths[b->num] = b->fill;
+  b->num++;
+  b->used += b->fill;
+}
+
+/**
+ * Hashes the files in a batch and empties it. Their names, lengths and
+ * digests stay in the batch until another file is added.
+ *
+ * @param b the batch
+ * @return the number of files hashed
+ */
+static int batch_hash(struct test_batch *b) {
+  int num = b->num;
+  if (num) {
+    digest_many(args.digest, num, b->buffers, b->lengths, b->digests);
+  }
+  b->num = 0;
+  b->used = 0;
+  return num;
+}
+
+/**
+ * Hashes the files in the batch, prints their results in order and
+ * empties the batch. With --fail-fast, stops printing once one fails.
+ */
+static void batch_flush(void) {
+  int i, num = batch_hash(&batch);
+  for (i = 0; i < num && !verify.stop; i++) {
+    print_test_result(batch.names[i], (unsigned int) batch.lengths[i],
+                      NULL, batch.digests[i]);
+  }
+}
+
+/**
+ * Stops batching files and frees the batch.
+ */
+static void batch_stop(void) {
+  batch_flush();
+  free(batch.data);
+  batch.data = NULL;
+  batch.active = 0;
+}
+
+/**
+ * Finds which of the files to be extracted share their length with
+ * another of them, so --dedup only hashes files that could be copies.
+ *
+ * @param order the files to be extracted
+ * @param num   the number of files
+ * @return a flag for each file, non-zero if another file has its length,
+ *         or NULL if out of memory
+ */
+static char *dedup_shared(struct file_entry *order, int num) {
+  unsigned int *lengths, *p;
+  char *shared;
+  int i;
+
+  if (!(shared = malloc((size_t) num + 1))) return NULL;
+  if (!(lengths = malloc(((size_t) num + 1) * sizeof(unsigned int)))) {
+    free(shared);
+    return NULL;
+  }
+  for (i = 0; i < num; i++) lengths[i] = order[i].file->length;
+  qsort(lengths, (size_t) num, sizeof(unsigned int), &dedup_cmp_length);
+
+  /* a length shared by several files is next to itself once sorted */
+  for (i = 0; i < num; i++) {
+    p = bsearch(&order[i].file->length, lengths, (size_t) num,
+                sizeof(unsigned int), &dedup_cmp_length);
+    shared[i] = (p > lengths && p[-1] == *p) ||
+                (p < &lengths[num - 1] && p[1] == *p);
+  }
+  free(lengths);
+  return shared;
+}
+
+static int dedup_cmp_length(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Extracts a file to disk for --dedup. If it could be a copy of a file
+ * already extracted, it's hashed, and if it is a copy, it's linked to
+ * that file. Otherwise it's written, and its date and permissions set,
+ * as usual. Either way, it's added to the index.
+ *
+ * @param file   the file to extract
+ * @param name   where to extract it to, which is output_name
+ * @param shared non-zero if another file in the cabinet has its length
+ * @return the number of errors reported
+ */
+static int dedup_extract(struct mscabd_file *file, char *name, int shared) {
+  struct mspack_file *fh;
+  struct dedup_entry *e;
+  unsigned char digest[DIGEST_MAX];
+  int errors = 0, candidate, written = 0;
+
+  candidate = file->length && (shared || dedup_has_length(file->length));
+
+  /* a file that could be a copy is hashed in memory, so a copy is never
+   * written at all, unless it's too long */
+  if (candidate && file->length <= DEDUP_BUFMAX &&
+      !dedup_reserve(file->length))
+  {
+    if (cabd->extract(cabd, file, DEDUP_FNAME)) {
+      fprintf(stderr, "%s: %s\n", name, cab_error(cabd));
+      return 1;
+    }
+    digest_init(&dedup.digest, DIGEST_XXH3);
+    digest_update(&dedup.digest, dedup.buf, dedup.used);
+    digest_finish(&dedup.digest, digest);
+
+    if ((e = dedup_match(file->length, digest, dedup.buf, NULL, &errors))) {
+      /* a file extracted again over itself is left as it is */
+      if (!strcmp(e->path, name)) return errors;
+      if (!dedup_link(e->path, name, 0)) {
+        /* hard links all share the first file's date and permissions */
+        if (args.dedup == DEDUP_REFLINK) set_date_and_perm(file, name);
+        dedup_add(name, file->length, digest);
+        dedup.linked++;
+        return errors;
+      }
+    }
+
+    if ((fh = cabextract_system.open(&cabextract_system, name,
+                                     MSPACK_SYS_OPEN_WRITE)))
+    {
+      written = cabextract_system.write(fh, dedup.buf, (int) dedup.used)
+                == (int) dedup.used;
+      cabextract_system.close(fh);
+    }
+    if (!written) {
+      fprintf(stderr, "%s: %s\n", name, strerror(errno));
+      return errors + 1;
+    }
+    set_date_and_perm(file, name);
+    dedup_add(name, file->length, digest);
+    return errors;
+  }
+
+  if (candidate) digest_init(&dedup.digest, DIGEST_XXH3);
+  dedup.hashing = candidate;
+  if (cabd->extract(cabd, file, name)) {
+    fprintf(stderr, "%s: %s\n", name, cab_error(cabd));
+    dedup.hashing = 0;
+    return 1;
+  }
+  dedup.hashing = 0;
+  set_date_and_perm(file, name);
+  if (!candidate) {
+    dedup_add(name, file->length, NULL);
+    return 0;
+  }
+
+  /* the file must be all there to be compared with another */
+  digest_finish(&dedup.digest, digest);
+#if USE_OUTPUT_FD
+  if ((errors = output_close())) return errors;
+#endif
+  if ((e = dedup_match(file->length, digest, NULL, name, &errors)) &&
+      !dedup_link(e->path, name, 1))
+  {
+    if (args.dedup == DEDUP_REFLINK) set_date_and_perm(file, name);
+    dedup.linked++;
+  }
+  dedup_add(name, file->length, digest);
+  return errors;
+}
+
+/**
+ * Makes dedup.buf long enough to hold a file.
+ *
+ * @param length the length of the file, at most DEDUP_BUFMAX
+ * @return zero for success, or non-zero if out of memory
+ */
+static int dedup_reserve(size_t length) {
+  size_t size = dedup.size ? dedup.size : 65536;
+  unsigned char *buf;
+
+  if (length <= dedup.size) return 0;
+  while (size < length) size *= 2;
+  if (size > DEDUP_BUFMAX) size = DEDUP_BUFMAX;
+  if (!(buf = realloc(dedup.buf, size))) return 1;
+  dedup.buf = buf;
+  dedup.size = size;
+  return 0;
+}
+
+static unsigned int dedup_slot(unsigned int length) {
+  unsigned int hash = length * 2654435761U;
+  return (hash ^ (hash >> 16)) & dedup.mask;
+}
+
+/**
+ * Returns non-zero if a file in the --dedup index has the given length.
+ */
+static int dedup_has_length(unsigned int length) {
+  struct dedup_entry *e;
+  if (!dedup.slots) return 0;
+  for (e = dedup.slots[dedup_slot(length)]; e; e = e->next) {
+    if (e->length == length) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Looks in the --dedup index for a file with the same content as a file
+ * just extracted. Files in the index with its length are hashed if they
+ * haven't been, and those with its digest are compared byte for byte.
+ *
+ * @param length the length of the file
+ * @param digest the XXH3 digest of the file
+ * @param data   the file, if it's in memory, or NULL if it's on disk
+ * @param name   the file, if it's on disk, which doesn't match itself
+ * @param errors incremented by errors reported writing earlier files
+ * @return the entry of a file with the same content, or NULL
+ */
+static struct dedup_entry *dedup_match(unsigned int length,
+                                       const unsigned char *digest,
+                                       const unsigned char *data,
+                                       const char *name, int *errors)
+{
+  struct dedup_entry *e;
+  int synced = 0;
+
+  if (!dedup.slots) return NULL;
+  for (e = dedup.slots[dedup_slot(length)]; e; e = e->next) {
+    if (e->length != length || (name && !strcmp(e->path, name))) continue;
+#if USE_OUTPUT_FD
+    /* files still being written have to be finished to be read */
+    if (!synced) *errors += output_sync();
+#endif
+    synced = 1;
+    if (!e->hashed) dedup_hash(e);
+    if (e->hashed < 0) continue;
+    if (memcmp(e->digest, digest, digest_size(DIGEST_XXH3))) continue;
+    if (dedup_same(e->path, data, name, length)) return e;
+  }
+  return NULL;
+}
+
+/**
+ * Hashes a file in the --dedup index from disk. If it can't be read, or
+ * is no longer the length it was, it's never matched.
+ */
+static void dedup_hash(struct dedup_entry *e) {
+  unsigned char buf[DEDUP_CHUNK];
+  struct digest_ctx ctx;
+  off_t total = 0;
+  size_t n;
+  FILE *fh;
+
+  e->hashed = -1;
+  if (!(fh = fopen(e->path, "rb"))) return;
+  digest_init(&ctx, DIGEST_XXH3);
+  while ((n = fread(buf, 1, sizeof(buf), fh)) > 0) {
+    digest_update(&ctx, buf, n);
+    total += (off_t) n;
+  }
+  if (!ferror(fh) && total == (off_t) e->length) {
+    digest_finish(&ctx, e->digest);
+    e->hashed = 1;
+  }
+  fclose(fh);
+}
+
+/**
+ * Compares a file on disk with a file in memory or another file on disk.
+ *
+ * @param path   the file on disk
+ * @param data   the file in memory, or NULL
+ * @param other  the other file on disk, if data is NULL
+ * @param length the length both files should be
+ * @return non-zero if both files have the same content
+ */
+static int dedup_same(const char *path, const unsigned char *data,
+                      const char *other, unsigned int length)
+{
+  unsigned char a[DEDUP_CHUNK], b[DEDUP_CHUNK];
+  FILE *fa, *fb = NULL;
+  size_t n, done = 0;
+  int same = 1;
+
+  if (!(fa = fopen(path, "rb"))) return 0;
+  if (!data && !(fb = fopen(other, "rb"))) {
+    fclose(fa);
+    return 0;
+  }
+  while (same && done < length) {
+    n = length - done;
+    if (n > DEDUP_CHUNK) n = DEDUP_CHUNK;
+    if (fread(a, 1, n, fa) != n) same = 0;
+    else if (fb) same = fread(b, 1, n, fb) == n && !memcmp(a, b, n);
+    else same = !memcmp(a, &data[done], n);
+    done += n;
+  }
+  /* and neither file is any longer */
+  if (same && (fgetc(fa) != EOF || (fb && fgetc(fb) != EOF))) same = 0;
+  fclose(fa);
+  if (fb) fclose(fb);
+  return same;
+}
+
+/**
+ * Makes a file a hard link to another file, or with --dedup=reflink, a
+ * reflink to it, sharing its data but not its date or permissions. If
+ * the file system can't do this, --dedup stops trying, and says so.
+ *
+ * @param target  the file to link to
+ * @param name    the file to replace with a link
+ * @param written non-zero if name has already been written
+ * @return zero for success, or non-zero if name wasn't linked
+ */
+static int dedup_link(const char *target, const char *name, int written) {
+  int r = -1, error = ENOSYS;
+
+  if (dedup.unsupported) return -1;
+  if (args.dedup == DEDUP_REFLINK) {
+#if HAVE_SYS_IOCTL_H && HAVE_LINUX_FS_H && defined(FICLONE)
+    int in, out;
+    if ((in = open(target, O_RDONLY)) != -1) {
+      /* a file not written yet may still hold something else */
+      if (!written) unshare_file(name);
+      out = open(name, O_WRONLY | O_CREAT | (written ? 0 : O_TRUNC), 0666);
+      if (out != -1) {
+        r = ioctl(out, FICLONE, in);
+        error = errno;
+        close(out);
+      }
+      close(in);
+    }
+#else
+    (void) written;
+#endif
+  }
+  else {
+#if HAVE_LINK
+    char *tmp;
+    /* link beside the file then rename over it, so it's never missing */
+    if ((tmp = malloc(strlen(name) + sizeof(".cabx-link")))) {
+      sprintf(tmp, "%s.cabx-link", name);
+      unlink(tmp);
+      if (!(r = link(target, tmp)) && (r = rename(tmp, name))) {
+        error = errno;
+        unlink(tmp);
+      }
+      else if (r) {
+        error = errno;
+      }
+      free(tmp);
+    }
+#endif
+  }
+
+  if (r && (error == ENOSYS || error == EXDEV || error == EPERM ||
+            error == EOPNOTSUPP || error == EINVAL || error == ENOTTY))
+  {
+    fprintf(stderr, "%s: can't %s files here (%s), writing copies\n", name,
+            (args.dedup == DEDUP_REFLINK) ? "reflink" : "hard link",
+            strerror(error));
+    dedup.unsupported = 1;
+  }
+  return r;
+}
+
+/**
+ * Adds a file just extracted to the --dedup index.
+ *
+ * @param name   the file extracted
+ * @param length the length of the file
+ * @param digest its XXH3 digest, or NULL to hash it when it's needed
+ */
+static void dedup_add(const char *name, unsigned int length,
+                      const unsigned char *digest)
+{
+  struct dedup_entry *e, *next, **slots, **old = dedup.slots;
+  unsigned int i, size = dedup.slots ? dedup.mask + 1 : 0, slot;
+
+  /* keep no more entries than slots */
+  if (dedup.num >= size) {
+    if ((slots = calloc(size ? size * 2 : 1024, sizeof(*slots)))) {
+      dedup.slots = slots;
+      dedup.mask = (size ? size * 2 : 1024) - 1;
+      for (i = 0; i < size; i++) {
+        for (e = old[i]; e; e = next) {
+          next = e->next;
+          slot = dedup_slot(e->length);
+          e->next = slots[slot];
+          slots[slot] = e;
+        }
+      }
+      free(old);
+    }
+    if (!dedup.slots) return;
+  }
+
+  if (!(e = malloc(sizeof(struct dedup_entry)))) return;
+  if (!(e->path = strdup(name))) {
+    free(e);
+    return;
+  }
+  e->length = length;
+  e->hashed = digest ? 1 : 0;
+  if (digest) memcpy(e->digest, digest, digest_size(DIGEST_XXH3));
+  slot = dedup_slot(length);
+  e->next = dedup.slots[slot];
+  dedup.slots[slot] = e;
+  dedup.num++;
+}
+
+/**
+ * Frees the --dedup index.
+ */
+static void dedup_free(void) {
+  struct dedup_entry *e, *next;
+  unsigned int i;
+  if (dedup.slots) {
+    for (i = 0; i <= dedup.mask; i++) {
+      for (e = dedup.slots[i]; e; e = next) {
+        next = e->next;
+        free(e->path);
+        free(e);
+      }
+    }
+  }
+  free(dedup.slots);
+  free(dedup.buf);
+  dedup.slots = NULL;
+  dedup.buf = NULL;
+}
+
+/**
+ * Checks if a file is already extracted, for --update.
+ *
+ * @param file the file to extract
+ * @param name where it would be extracted to
+ * @return 0 if the file should be extracted, UPDATE_DATE if the file on
+ *         disk has its length and date, UPDATE_CONTENT if it has its
+ *         length and content, or UPDATE_WRITTEN if its content differed
+ *         and it has been extracted over the file on disk
+ */
+static int update_current(struct mscabd_file *file, char *name) {
+  struct stat st;
+  int err, closed;
+
+  if (stat(name, &st) || !S_ISREG(st.st_mode) ||
+      st.st_size != (off_t) file->length)
+  {
+    return 0;
+  }
+  if (st.st_mtime == file_mtime(file)) return 1;
+
+  /* a file with other hard links, such as one left by --dedup, can't be
+   * written over in place, as that would change the others too. it is
+   * extracted as usual, which replaces it with a file of its own */
+  if (args.update != UPDATE_CONTENT || st.st_nlink > 1 ||
+      !(update.fh = fopen(name, "r+b")))
+  {
+    return 0;
+  }
+
+  update.offset = 0;
+  update.differs = 0;
+  err = cabd->extract(cabd, file, UPDATE_FNAME);
+  closed = fclose(update.fh);
+  update.fh = NULL;
+
+  /* a file that fails to decompress or write is left for extracting to
+   * report */
+  if (err || closed) return 0;
+  set_date_and_perm(file, name);
+  return update.differs ? UPDATE_WRITTEN : UPDATE_CONTENT;
+}
+
+/**
+ * Compares data written to UPDATE_FNAME with the next bytes of the file
+ * on disk. From the first chunk that differs, the data is written over
+ * the file on disk instead.
+ *
+ * @param buffer the data written
+ * @param bytes  the number of bytes written
+ * @return bytes, or -1 if the file on disk can't be written
+ */
+static int update_write(void *buffer, int bytes) {
+  unsigned char buf[DEDUP_CHUNK], *in = (unsigned char *) buffer;
+  size_t left = (size_t) bytes, n;
+
+  while (left > 0 && !update.differs) {
+    n = (left > DEDUP_CHUNK) ? DEDUP_CHUNK : left;
+    if (fread(buf, 1, n, update.fh) != n || memcmp(buf, in, n)) {
+      /* go back to the start of this chunk, and write from there */
+#if HAVE_FSEEKO
+      if (fseeko(update.fh, update.offset, SEEK_SET)) return -1;
+#else
+      if (fseek(update.fh, (long) update.offset, SEEK_SET)) return -1;
+#endif
+      update.differs = 1;
+      break;
+    }
+    update.offset += (off_t) n;
+    in += n;
+    left -= n;
+  }
+  if (left > 0 && fwrite(in, 1, left, update.fh) != left) return -1;
+  return bytes;
+}
+
+/**
+ * Lists a cabinet and each of its folders for --json, as a "cabinet" line
+ * and a "folder" line for each folder.
+ *
+ * @param basename the file the cabinet is in
+ * @param cab      the cabinet, with its cabinet set loaded
+ */
+static void json_cabinet(const char *basename, struct mscabd_cabinet *cab) {
+  static const char *methods[] = { "none", "mszip", "quantum", "lzx" };
+  struct mscabd_folder *fol;
+  struct mscabd_file *file;
+  unsigned long folders = 0, files = 0;
+  int method;
+
+  for (fol = cab->folders; fol; fol = fol->next) folders++;
+  for (file = cab->files; file; file = file->next) files++;
+  json_begin("cabinet", basename);
+  json_number("offset", (unsigned long) cab->base_offset);
+  json_number("length", cab->length);
+  json_number("set_id", cab->set_id);
+  json_number("set_index", cab->set_index);
+  json_number("folders", folders);
+  json_number("files", files);
+  json_end();
+
+  for (fol = cab->folders, folders = 0; fol; fol = fol->next, folders++) {
+    method = MSCABD_COMP_METHOD(fol->comp_type);
+    json_begin("folder", basename);
+    json_number("index", folders);
+    json_string("method", (method <= MSCAB_COMP_LZX) ? methods[method]
+                                                      : "unknown");
+    json_number("level", MSCABD_COMP_LEVEL(fol->comp_type));
+    json_number("blocks", fol->num_blocks);
+    json_number("data_length", (unsigned long) fol->data_length);
+    json_end();
+  }
+}
+
+/**
+ * Lists a file for --json, as a "file" line. Its folder is the index of
+ * a "folder" line, or null if it has none.
+ *
+ * @param basename the file the cabinet is in
+ * @param entry    the file, as ordered by order_files()
+ */
+static void json_file(const char *basename, struct file_entry *entry) {
+  struct mscabd_file *file = entry->file;
+  unsigned int parts[6];
+  char date[20], *p = date;
+  int i;
+
+  json_begin("file", basename);
+  json_string("name", entry->name);
+  json_number("size", file->length);
+  if (entry->folder == (unsigned int) -1) {
+    json_key("folder");
+    json_raw("null", 4);
+  }
+  else {
+    json_number("folder", entry->folder);
+  }
+  json_number("offset", file->offset);
+
+  /* the date is YYYY-MM-DDTHH:MM:SS, in local time like the cabinet's */
+  parts[0] = (unsigned int) file->date_y;
+  parts[1] = (unsigned int) file->date_m;
+  parts[2] = (unsigned int) file->date_d;
+  parts[3] = (unsigned int) file->time_h;
+  parts[4] = (unsigned int) file->time_m;
+  parts[5] = (unsigned int) file->time_s;
+  for (i = 0; i < 6; i++) {
+    if (i == 0) {
+      *p++ = (char) ('0' + parts[0] / 1000 % 10);
+      *p++ = (char) ('0' + parts[0] / 100 % 10);
+    }
+    *p++ = (char) ('0' + parts[i] / 10 % 10);
+    *p++ = (char) ('0' + parts[i] % 10);
+    if (i < 5) *p++ = "--T::"[i];
+  }
+  *p = '\0';
+  json_string("date", date);
+  json_number("attribs", (unsigned long) file->attribs);
+  json_end();
+}
+
+/**
+ * Starts a line of JSON with its type and cabinet.
+ */
+static void json_begin(const char *type, const char *cabinet) {
+  json_raw("{", 1);
+  json_string("type", type);
+  json_string("cabinet", cabinet);
+}
+
+/**
+ * Adds a key to the line of JSON, after a comma if it isn't the first.
+ */
+static void json_key(const char *key) {
+  if (json.used && json.buf[json.used - 1] != '{') json_raw(",", 1);
+  json_raw("\"", 1);
+  json_raw(key, strlen(key));
+  json_raw("\":", 2);
+}
+
+/**
+ * Adds a key and a string to the line of JSON. Quotes, backslashes and
+ * control characters are escaped; other bytes are copied as they are.
+ */
+static void json_string(const char *key, const char *value) {
+  const unsigned char *p, *run;
+  static const char hex[] = "0123456789abcdef";
+  char esc[6];
+
+  json_key(key);
+  json_raw("\"", 1);
+  for (p = run = (const unsigned char *) value; *p; p++) {
+    if (*p >= 0x20 && *p != '"' && *p != '\\') continue;
+    json_raw((const char *) run, (size_t) (p - run));
+    if (*p == '"' || *p == '\\') {
+      esc[0] = '\\';
+      esc[1] = (char) *p;
+      json_raw(esc, 2);
+    }
+    else {
+      memcpy(esc, "\\u00", 4);
+      esc[4] = hex[*p >> 4];
+      esc[5] = hex[*p & 15];
+      json_raw(esc, 6);
+    }
+    run = p + 1;
+  }
+  json_raw((const char *) run, (size_t) (p - run));
+  json_raw("\"", 1);
+}
+
+/**
+ * Adds a key and a number to the line of JSON.
+ */
+static void json_number(const char *key, unsigned long value) {
+  char digits[24], *p = &digits[sizeof(digits)];
+  do {
+    *--p = (char) ('0' + value % 10);
+    value /= 10;
+  } while (value);
+  json_key(key);
+  json_raw(p, (size_t) (&digits[sizeof(digits)] - p));
+}
+
+/**
+ * Adds bytes to json.buf, growing it as needed. If it can't grow, the
+ * listing is cut short, and json_flush() reports it.
+ */
+static void json_raw(const char *data, size_t len) {
+  size_t size = json.size ? json.size : JSON_FLUSH * 2;
+  char *buf;
+
+  if (json.error) return;
+  if (json.used + len > json.size) {
+    while (size < json.used + len) size *= 2;
+    if (!(buf = realloc(json.buf, size))) {
+      json.error = ENOMEM;
+      return;
+    }
+    json.buf = buf;
+    json.size = size;
+  }
+  memcpy(&json.buf[json.used], data, len);
+  json.used += len;
+}
+
+/**
+ * Ends the line of JSON, and writes out the waiting lines if there are
+ * enough of them.
+ */
+static void json_end(void) {
+  json_raw("}\n", 2);
+  if (json.used >= JSON_FLUSH) json_flush();
+}
+
+/**
+ * Writes the waiting lines of JSON to stdout.
+ *
+ * @return zero for success, or non-zero if anything has gone wrong, with
+ *         its errno in json.error
+ */
+static int json_flush(void) {
+  if (json.used && !json.error &&
+      fwrite(json.buf, 1, json.used, stdout) != json.used)
+  {
+    json.error = errno;
+  }
+  json.used = 0;
+  return json.error;
+}
+
+/**
+ * Returns the time in nanoseconds, for --stats, or always 0 if there is
+ * no clock to measure it with.
+ */
+static uint64_t stats_clock(void) {
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * Adds one CAB decompressor's statistics to another's.
+ */
+static void stats_add(struct mscabd_stats *to, struct mscabd_stats *from) {
+  to->in_bytes      += from->in_bytes;
+  to->out_bytes     += from->out_bytes;
+  to->blocks        += from->blocks;
+  to->checksums     += from->checksums;
+  to->folder_resets += from->folder_resets;
+  to->read_time     += from->read_time;
+  to->checksum_time += from->checksum_time;
+  to->decode_time   += from->decode_time;
+  to->e8_time       += from->e8_time;
+  to->e8_bytes      += from->e8_bytes;
+  to->write_time    += from->write_time;
+}
+
+/**
+ * Prints a line of the --stats report: how long a stage took, and how
+ * fast it went through the bytes it dealt with.
+ */
+static void stats_stage(const char *name, double time, off_t bytes) {
+  if (time > 0 && bytes > 0) {
+    fprintf(stderr, "  %-12s %10.3f %10.1f\n", name, time,
+            (double) bytes / time / 1e6);
+  }
+  else {
+    fprintf(stderr, "  %-12s %10.3f %10s\n", name, time, "-");
+  }
+}
+
+/**
+ * Prints the --stats report to stderr: what was read and decoded, how
+ * long each stage of extraction took, and the calls made to do it. Times
+ * from --verify workers are added up, so they can add up to more than
+ * the time taken.
+ */
+static void stats_report(void) {
+  double total = (double) (stats_clock() - stats.start) / 1e9;
+  struct mscabd_stats s;
+
+  if (cabd->get_stats(cabd, &s) != MSPACK_ERR_OK) return;
+  stats_add(&s, &stats.workers);
+
+  fprintf(stderr, "\nStatistics:\n"
+          "  read %llu bytes in %lu data block(s), checked %lu checksum(s)\n"
+          "  decoded %llu bytes, starting folders %lu time(s)\n\n",
+          (unsigned long long) s.in_bytes, s.blocks, s.checksums,
+          (unsigned long long) s.out_bytes, s.folder_resets);
+  fprintf(stderr, "  %-12s %10s %10s\n", "stage", "seconds", "MB/s");
+  stats_stage("read", s.read_time, s.in_bytes);
+  stats_stage("checksums", s.checksum_time, s.in_bytes);
+  stats_stage("decode", s.decode_time, s.out_bytes);
+  stats_stage("E8", s.e8_time, s.e8_bytes);
+  stats_stage("write", s.write_time, s.out_bytes);
+  stats_stage("cabx_write", (double) stats.write_time / 1e9,
+              stats.write_bytes);
+  stats_stage("directories", (double) stats.path_time / 1e9, 0);
+  stats_stage("total", total, s.out_bytes);
+
+  fprintf(stderr, "\n  %lu write(s) of %llu bytes, %lu path(s) checked "
+          "for directories\n", stats.writes,
+          (unsigned long long) stats.write_bytes, stats.paths);
+  fprintf(stderr, "  calls: %lu open, %lu read (%llu bytes), %lu seek, "
+          "%lu mkdir,\n         %lu pwrite, %lu io_uring_enter, "
+          "%lu copy_file_range\n", stats.opens, stats.reads,
+          (unsigned long long) stats.read_bytes, stats.seeks, stats.mkdirs,
+          stats.pwrites, stats.ring_enters, stats.copies);
+}
+
+#if HAVE_PTHREAD_H
+/**
+ * Starts the hashing thread for -t. If it can't be started, files are
+ * hashed as they are extracted, as before.
+ */
+static void hashq_start(void) {
+  if (!(hashq.data = malloc(HASHQ_SLOTS * HASHQ_CHUNK))) return;
+  pthread_mutex_init(&hashq.lock, NULL);
+  pthread_cond_init(&hashq.cond, NULL);
+  if (pthread_create(&hashq.thread, NULL, &hashq_main, NULL)) {
+    pthread_cond_destroy(&hashq.cond);
+    pthread_mutex_destroy(&hashq.lock);
+    free(hashq.data);
+    hashq.data = NULL;
+    return;
+  }
+  hashq.running = 1;
+}
+
+/**
+ * The hashing thread. Takes chunks from the queue in order, and adds
+ * them to the digest of the current file. A chunk that ends a file
+ * says which result to put the checksum in, and starts the next file.
+ * If whole files are waiting at the head of the queue, and the digest
+ * can hash several at once, they are all hashed with digest_many().
+ */
+static void *hashq_main(void *arg) {
+  const unsigned char *buffers[HASHQ_SLOTS];
+  unsigned char digests[HASHQ_SLOTS][DIGEST_MAX];
+  size_t lengths[HASHQ_SLOTS];
+  int results[HASHQ_SLOTS];
+  struct digest_ctx ctx;
+  unsigned int slot, n, i;
+  int lanes = digest_lanes(args.digest), partial = 0;
+
+  (void) arg;
+  digest_init(&ctx, args.digest);
+  pthread_mutex_lock(&hashq.lock);
+  for (;;) {
+    while (hashq.count == 0 && !hashq.quit) {
+      pthread_cond_wait(&hashq.cond, &hashq.lock);
+    }
+    if (hashq.count == 0) break;
+
+    /* take every whole file waiting, or else the next chunk */
+    n = 0;
+    if (lanes > 1 && !partial) {
+      for (; n < hashq.count; n++) {
+        slot = (hashq.head + n) % HASHQ_SLOTS;
+        if ((results[n] = hashq.result[slot]) < 0) break;
+        buffers[n] = &hashq.data[slot * HASHQ_CHUNK];
+        lengths[n] = hashq.len[slot];
+      }
+    }
+    if (n < 2) {
+      n = 1;
+      slot = hashq.head;
+      results[0] = hashq.result[slot];
+    }
+    pthread_mutex_unlock(&hashq.lock);
+
+    if (n > 1) {
+      digest_many(args.digest, (int) n, buffers, lengths, digests);
+      for (i = 0; i < n; i++) {
+        memcpy(hashq.results[results[i]].digest, digests[i], DIGEST_MAX);
+      }
+    }
+    else {
+      digest_update(&ctx, &hashq.data[slot * HASHQ_CHUNK], hashq.len[slot]);
+      if ((partial = (results[0] < 0)) == 0) {
+        digest_finish(&ctx, hashq.results[results[0]].digest);
+        digest_init(&ctx, args.digest);
+      }
+    }
+
+    pthread_mutex_lock(&hashq.lock);
+    for (i = 0; i < n; i++) {
+      if (results[i] >= 0) hashq.results[results[i]].done = 1;
+    }
+    hashq.head = (hashq.head + n) % HASHQ_SLOTS;
+    hashq.count -= n;
+    pthread_cond_broadcast(&hashq.cond);
+  }
+  pthread_mutex_unlock(&hashq.lock);
+  return NULL;
+}
+
+/**
+ * Returns the slot after the queued chunks, waiting for it to be free if
+ * the queue is full. It is filled without holding the lock, as the
+ * hashing thread never reads it until it is queued.
+ *
+ * @return the slot being filled
+ */
+static unsigned int hashq_tail(void) {
+  unsigned int slot;
+
+  pthread_mutex_lock(&hashq.lock);
+  while (hashq.count == HASHQ_SLOTS) {
+    pthread_cond_wait(&hashq.cond, &hashq.lock);
+  }
+  slot = (hashq.head + hashq.count) % HASHQ_SLOTS;
+  pthread_mutex_unlock(&hashq.lock);
+  return slot;
+}
+
+/**
+ * Queues the chunk being filled for the hashing thread.
+ *
+ * @param result for the end of a file, the result to put its checksum
+ *               in, otherwise -1
+ */
+static void hashq_queue(int result) {
+  unsigned int slot = hashq_tail();
 
-  /* set permissions */
-  mode = 0444;
-  if (  file->attribs & MSCAB_ATTRIB_EXEC)    mode |= 0111;
-  if (!(file->attribs & MSCAB_ATTRIB_RDONLY)) mode |= 0222;
-  chmod(filename, mode & ~user_umask);
+  hashq.len[slot] = hashq.fill;
+  hashq.result[slot] = result;
+  hashq.fill = 0;
+
+  pthread_mutex_lock(&hashq.lock);
+  hashq.count++;
+  pthread_cond_broadcast(&hashq.cond);
+  pthread_mutex_unlock(&hashq.lock);
 }
 
-/* ------- support functions ------- */
+/**
+ * Passes data written to TEST_FNAME to the hashing thread. It is copied
+ * into the chunk being filled, which is queued once it is full and more
+ * data follows, or when the file ends.
+ *
+ * @param buffer the data written
+ * @param bytes  the number of bytes written
+ */
+static void hashq_write(unsigned char *buffer, size_t bytes) {
+  size_t len;
+  while (bytes > 0) {
+    if (hashq.fill == HASHQ_CHUNK) hashq_queue(-1);
+    len = HASHQ_CHUNK - hashq.fill;
+    if (len > bytes) len = bytes;
+    memcpy(&hashq.data[hashq_tail() * HASHQ_CHUNK + hashq.fill], buffer,
+           len);
+    hashq.fill += len;
+    buffer += len;
+    bytes  -= len;
+  }
+}
 
 /**
- * Memorises a file by its device and inode number rather than its name. If
- * the file does not exist, it will not be memorised.
+ * Ends the file being tested. Its result is printed once the hashing
+ * thread has finished its digest and the results of all files before
+ * it have been printed.
  *
- * @param fml  address of the file_mem list that will memorise this file.
- * @param name name of the file to memorise.
- * @param from a string that, if not NULL, will be duplicated stored with
- *             the memorised file.
- * @see recall_file(), forget_files()
+ * @param name   the name of the file, which must exist until the result
+ *               is printed
+ * @param length the size of the file
+ * @param error  why the file failed to extract, or NULL if it didn't
  */
-static void memorise_file(struct file_mem **fml, char *name, char *from) {
-  struct file_mem *fm;
-  struct stat st_buf;
-  if (stat(name, &st_buf) != 0) return;
-  if (!(fm = malloc(sizeof(struct file_mem)))) return;
-  fm->st_dev = st_buf.st_dev;
-  fm->st_ino = st_buf.st_ino;
-  fm->from = (from) ? malloc(strlen(from)+1) : NULL;
-  if (fm->from) strcpy(fm->from, from);
-  fm->next = *fml;
-  *fml = fm;
+static void hashq_end(const char *name, unsigned int length,
+                      const char *error)
+{
+  struct hash_result *r;
+  int result;
+
+  /* make room for the result, if needed */
+  while (hashq.r_count == HASHQ_RESULTS) hashq_report(1);
+
+  result = (hashq.r_head + hashq.r_count) % HASHQ_RESULTS;
+  r = &hashq.results[result];
+  r->name = name;
+  r->length = length;
+  r->error = error ? strdup(error) : NULL;
+  r->failed = error ? 1 : 0;
+  r->done = 0;
+  hashq.r_count++;
+  hashq_queue(result);
+  hashq_report(0);
 }
 
 /**
- * Determines if a file has been memorised before, by its device and inode
- * number. If the file does not exist, it cannot be recalled.
+ * Prints the results of tested files, in the order they were tested.
  *
- * @param fml  list to search for previously memorised file
- * @param name name of file to recall.
- * @param from if non-NULL, this is an address that the associated "from"
- *             description pointer will be stored.
- * @return non-zero if the file has been previously memorised, zero if the
- *         file is unknown or does not exist.
- * @see memorise_file(), forget_files()
+ * @param wait if zero, only the results that are ready are printed. If
+ *             one, waits for the first result. If more, waits for all
+ *             results.
  */
-static int recall_file(struct file_mem *fml, char *name, char **from) {
-  struct file_mem *fm;
-  struct stat st_buf;
-  if (stat(name, &st_buf) != 0) return 0;
-  for (fm = fml; fm; fm = fm->next) {
-    if ((st_buf.st_ino == fm->st_ino) && (st_buf.st_dev == fm->st_dev)) {
-      if (from) *from = fm->from; return 1;
+static void hashq_report(int wait) {
+  struct hash_result *r;
+  int done;
+
+  while (hashq.r_count > 0) {
+    r = &hashq.results[hashq.r_head];
+    pthread_mutex_lock(&hashq.lock);
+    while (!r->done && wait) {
+      pthread_cond_wait(&hashq.cond, &hashq.lock);
     }
+    done = r->done;
+    pthread_mutex_unlock(&hashq.lock);
+    if (!done) break;
+
+    print_test_result(r->name, r->length, r->failed ? (r->error ? r->error
+                      : "out of memory") : NULL, r->digest);
+    free(r->error);
+    r->error = NULL;
+    hashq.r_head = (hashq.r_head + 1) % HASHQ_RESULTS;
+    hashq.r_count--;
+    if (wait == 1) wait = 0;
   }
-  return 0;
 }
 
 /**
- * Frees all memory used by a file_mem list.
+ * Stops the hashing thread, once hashq_report() has printed all results.
+ */
+static void hashq_stop(void) {
+  if (!hashq.running) return;
+  pthread_mutex_lock(&hashq.lock);
+  hashq.quit = 1;
+  pthread_cond_broadcast(&hashq.cond);
+  pthread_mutex_unlock(&hashq.lock);
+  pthread_join(hashq.thread, NULL);
+  pthread_cond_destroy(&hashq.cond);
+  pthread_mutex_destroy(&hashq.lock);
+  free(hashq.data);
+  hashq.data = NULL;
+  hashq.running = 0;
+}
+
+/**
+ * Tests the files of a cabinet for --verify, with a worker for each CPU
+ * testing a folder at a time. This is only done for a cabinet that each
+ * worker can open for itself: one at the start of a file that isn't
+ * stdin, and not part of a set. Otherwise, or if the workers can't be
+ * set up, the files are left to be tested one by one.
  *
- * @param fml address of the list to free
- * @see memorise_file()
+ * @param basename the file the cabinet is in
+ * @param cab      the cabinet
+ * @param order    the files to test, in folder order
+ * @param num      the number of files to test
+ * @return the number of files that failed to extract, or -1 if the files
+ *         weren't tested
  */
-static void forget_files(struct file_mem **fml) {
-  struct file_mem *fm, *next;
-  for (fm = *fml; fm; fm = next) {
-    next = fm->next;
-    free(fm->from);
-    free(fm);
+static int verify_folders(char *basename, struct mscabd_cabinet *cab,
+                          struct file_entry *order, int num)
+{
+  struct verify_worker *workers, *w;
+  struct verify_result *r;
+  struct mscabd_file *file;
+  struct verify_job job;
+  int i, n, count, files, folders, started = 0, errors = 0;
+
+  if (search_threads < 2 || IS_STDIN(basename) || cab->base_offset ||
+      cab->prevcab || cab->nextcab) return -1;
+
+  /* use no more workers than there are folders */
+  for (file = cab->files, files = 0; file; file = file->next) files++;
+  for (i = 0, folders = 0; i < num; i++) {
+    if (i == 0 || order[i].folder != order[i-1].folder ||
+        order[i].folder == (unsigned int) -1) folders++;
   }
-  *fml = NULL;
+  if ((n = folders < search_threads ? folders : search_threads) < 2) {
+    return -1;
+  }
+
+  if (!(workers = calloc((size_t) n, sizeof(*workers)))) return -1;
+  if (!(job.results = calloc((size_t) num, sizeof(*job.results)))) {
+    free(workers);
+    return -1;
+  }
+  job.order = order;
+  job.num = num;
+  job.next = job.stop = 0;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  /* each worker opens the cabinet, and numbers its files */
+  for (i = 0; i < n; i++) {
+    w = &workers[i];
+    w->sys = cabextract_system;
+    w->job = &job;
+    if (!(w->cabd = mspack_create_cab_decompressor(&w->sys))) break;
+    w->cabd->set_param(w->cabd, MSCABD_PARAM_FIXMSZIP, args.fix);
+    w->cabd->set_param(w->cabd, MSCABD_PARAM_CHECKSUMS, !args.no_checksums);
+    w->cabd->set_param(w->cabd, MSCABD_PARAM_STATS, args.stats);
+    if (!(w->cab = w->cabd->open(w->cabd, basename))) break;
+    if (!(w->files = malloc(files * sizeof(*w->files)))) break;
+    for (file = w->cab->files, count = 0; file && count < files;
+         file = file->next) w->files[count++] = file;
+    if (file || count != files) break;
+    if (digest_lanes(args.digest) > 1 &&
+        (w->batch = calloc(1, sizeof(*w->batch))) &&
+        !(w->batch->data = malloc(TEST_BATCH_SIZE)))
+    {
+      free(w->batch);
+      w->batch = NULL;
+    }
+    if (pthread_create(&w->thread, NULL, &verify_main, w)) break;
+    started++;
+  }
+
+  /* print the results in order, as they arrive */
+  for (i = 0; started && i < num; i++) {
+    r = &job.results[i];
+    pthread_mutex_lock(&job.lock);
+    while (!r->done) pthread_cond_wait(&job.cond, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+    if (r->failed) errors++;
+    print_test_result(order[i].name, order[i].file->length,
+      r->failed ? (r->error ? r->error : "out of memory") : NULL, r->digest);
+    if (verify.stop) break;
+  }
+
+  pthread_mutex_lock(&job.lock);
+  job.stop = 1;
+  pthread_mutex_unlock(&job.lock);
+  for (i = 0; i < n; i++) {
+    w = &workers[i];
+    if (i < started) pthread_join(w->thread, NULL);
+    if (w->batch) free(w->batch->data);
+    free(w->batch);
+    free(w->files);
+    if (w->cab) w->cabd->close(w->cabd, w->cab);
+    if (args.stats && w->cabd) {
+      struct mscabd_stats s;
+      w->cabd->get_stats(w->cabd, &s);
+      stats_add(&stats.workers, &s);
+    }
+    mspack_destroy_cab_decompressor(w->cabd);
+  }
+  for (i = 0; i < num; i++) free(job.results[i].error);
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  free(job.results);
+  free(workers);
+  return started ? errors : -1;
 }
 
 /**
- * Ensures that all directory components in a filepath exist. New directory
- * components are created, if necessary.
- *
- * @param path the filepath to check
- * @return non-zero if all directory components in a filepath exist, zero
- *         if components do not exist and cannot be created
+ * A --verify worker. Takes the files of a folder at a time, tests them
+ * with its own decompressor, and hands back their results. Small files
+ * wait in the worker's batch, if it has one, until it's full or the
+ * folder is done.
  */
-static int ensure_filepath(char *path) {
-  struct stat st_buf;
-  char *p;
-  int ok;
+static void *verify_main(void *arg) {
+  struct verify_worker *w = arg;
+  struct verify_job *job = w->job;
+  struct test_batch *b = w->batch;
+  struct verify_result *r;
+  struct mscabd_file *file;
+  unsigned int folder;
+  int i, end, stop, batched;
+
+  for (;;) {
+    /* take the next folder's files. files without a folder go alone */
+    pthread_mutex_lock(&job->lock);
+    i = end = job->next;
+    if (!job->stop && i < job->num) {
+      folder = job->order[i].folder;
+      for (end = i + 1; end < job->num && folder != (unsigned int) -1 &&
+           job->order[end].folder == folder; end++);
+      job->next = end;
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (i == end) break;
+
+    for (stop = 0; i < end && !stop; i++) {
+      r = &job->results[i];
+      file = w->files[job->order[i].index];
+      if (b && file->length <= TEST_BATCH_MAX) {
+        if (b->num == TEST_BATCH_FILES ||
+            b->used + file->length > TEST_BATCH_SIZE) verify_flush(w);
+        b->filling = 1;
+      }
+      if (w->cabd->extract(w->cabd, file, TEST_FNAME)) {
+        r->failed = 1;
+        r->error = strdup(cab_error(w->cabd));
+      }
+      batched = b && b->filling && !r->failed;
+      if (b) b->filling = 0;
+      if (batched) {
+        w->batched[b->num] = i;
+        batch_add(b, job->order[i].name);
+      }
+      else {
+        memcpy(r->digest, w->result, DIGEST_MAX);
+      }
 
-  for (p = &path[1]; *p; p++) {
-    if (*p != '/') continue;
-    *p = '\0';
-    ok = (stat(path, &st_buf) == 0) && S_ISDIR(st_buf.st_mode);
-    if (!ok) ok = (mkdir(path, 0777 & ~user_umask) == 0);
-    *p = '/';
-    if (!ok) return 0;
+      pthread_mutex_lock(&job->lock);
+      if (!batched) r->done = 1;
+      stop = job->stop;
+      pthread_cond_broadcast(&job->cond);
+      pthread_mutex_unlock(&job->lock);
+    }
+    verify_flush(w);
   }
-  return 1;
+  return NULL;
+}
+
+/**
+ * Hashes the small files in a --verify worker's batch, and hands back
+ * their results.
+ *
+ * @param w the worker
+ */
+static void verify_flush(struct verify_worker *w) {
+  struct verify_job *job = w->job;
+  int i, num;
+
+  if (!w->batch || !(num = batch_hash(w->batch))) return;
+  for (i = 0; i < num; i++) {
+    memcpy(job->results[w->batched[i]].digest, w->batch->digests[i],
+           DIGEST_MAX);
+  }
+  pthread_mutex_lock(&job->lock);
+  for (i = 0; i < num; i++) job->results[w->batched[i]].done = 1;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
 }
+#endif
 
 /**
  * Returns a string with an error message appropriate for the last error
@@ -1152,6 +5377,10 @@ struct mspack_file_p {
   FILE *fh;
   const char *name;
   char regular_file;
+  char output;
+  struct digest_ctx *digest;  /* for TEST_FNAME, NULL for hashq or batch */
+  unsigned char *result;      /* for TEST_FNAME, where the digest goes */
+  struct test_batch *batch;   /* for TEST_FNAME, the batch it goes in */
 };
 
 static struct mspack_file *cabx_open(struct mspack_system *this,
@@ -1162,9 +5391,11 @@ static struct mspack_file *cabx_open(struct mspack_system *this,
 
   /* Use of the STDOUT_FNAME pointer for a filename means the file should
    * actually be extracted to stdout. Use of the TEST_FNAME pointer for a
-   * filename means the file should only be MD5-summed.
+   * filename means the file should only be digested.
    */
-  if (filename == STDOUT_FNAME || filename == TEST_FNAME) {
+  if (filename == STDOUT_FNAME || filename == TEST_FNAME ||
+      filename == DEDUP_FNAME || filename == UPDATE_FNAME)
+  {
     /* only WRITE mode is valid for these special files */
     if (mode != MSPACK_SYS_OPEN_WRITE) {
       return NULL;
@@ -1183,6 +5414,7 @@ static struct mspack_file *cabx_open(struct mspack_system *this,
   debug("open:%s,%d\n", filename, IS_STDIN(filename));
   if ((fh = malloc(sizeof(struct mspack_file_p)))) {
     fh->name = filename;
+    fh->output = 0;
 
     if (filename == STDOUT_FNAME) {
       fh->regular_file = 0;
@@ -1192,19 +5424,69 @@ static struct mspack_file *cabx_open(struct mspack_system *this,
     else if (filename == TEST_FNAME) {
       fh->regular_file = 0;
       fh->fh = NULL;
-      md5_init_ctx(&md5_context);
+      fh->digest = &test_digest;
+      fh->result = test_result;
+      fh->batch = (this == &cabextract_system) ? &batch : NULL;
+#if HAVE_PTHREAD_H
+      if (this != &cabextract_system) {
+        /* a --verify worker has a digest and batch of its own */
+        fh->digest = &((struct verify_worker *) this)->digest;
+        fh->result = ((struct verify_worker *) this)->result;
+        fh->batch = ((struct verify_worker *) this)->batch;
+      }
+      else if (hashq.running) {
+        /* the hashing thread has the digest */
+        fh->digest = NULL;
+      }
+#endif
+      if (fh->batch && fh->batch->filling) {
+        /* the file is hashed with the rest of the batch */
+        fh->digest = NULL;
+        fh->batch->fill = 0;
+      }
+      else {
+        fh->batch = NULL;
+      }
+      if (fh->digest) digest_init(fh->digest, args.digest);
+      return (struct mspack_file *) fh;
+    }
+    else if (filename == DEDUP_FNAME) {
+      fh->regular_file = 0;
+      fh->fh = NULL;
+      dedup.used = 0;
+      return (struct mspack_file *) fh;
+    }
+    else if (filename == UPDATE_FNAME) {
+      fh->regular_file = 0;
+      fh->fh = NULL;
       return (struct mspack_file *) fh;
     }
     else if (IS_STDIN(filename)) {
       fh->regular_file = 0;
       fh->fh = stdin;
-      if (cabxbuf_open(fh->fh) == 0) {
+      /* every stdin handle starts at the start, like a newly opened file */
+      if (cabxbuf_open(fh->fh, args.stream) == 0 &&
+          cabxbuf_seek(0, MSPACK_SYS_SEEK_START) == 0)
+      {
         return (struct mspack_file *) fh;
       }
     }
+#if USE_OUTPUT_FD
+    else if (filename == output_name && mode == MSPACK_SYS_OPEN_WRITE) {
+      /* the file being extracted goes through the output writer */
+      fh->regular_file = 0;
+      fh->output = 1;
+      fh->fh = NULL;
+      if (output_open(filename) == 0) {
+        return (struct mspack_file *) fh;
+      }
+    }
+#endif
     else {
       /* regular file - simply attempt to open it */
       fh->regular_file = 1;
+      STATS_ADD(opens, 1);
+      if (mode == MSPACK_SYS_OPEN_WRITE) unshare_file(filename);
       if ((fh->fh = fopen(filename, fmode))) {
         return (struct mspack_file *) fh;
       }
@@ -1219,8 +5501,15 @@ static void cabx_close(struct mspack_file *file) {
   struct mspack_file_p *this = (struct mspack_file_p *) file;
   if (this) {
     if (this->name == TEST_FNAME) {
-      md5_finish_ctx(&md5_context, (void *) &md5_result);
+      /* the hashing thread finishes its digest at hashq_end() */
+      if (this->digest) digest_finish(this->digest, this->result);
     } 
+#if USE_OUTPUT_FD
+    else if (this->output) {
+      /* leave the file being extracted open for set_date_and_perm() */
+      output_flush();
+    }
+#endif
     else if (this->regular_file) {
       fclose(this->fh);
     }
@@ -1235,6 +5524,8 @@ static int cabx_read(struct mspack_file *file, void *buffer, int bytes) {
   }
   if (this && this->regular_file && buffer && bytes >= 0) {
     size_t count = fread(buffer, 1, (size_t) bytes, this->fh);
+    STATS_ADD(reads, 1);
+    STATS_ADD(read_bytes, (off_t) count);
     if (!ferror(this->fh)) return (int) count;
 
   }
@@ -1242,15 +5533,56 @@ static int cabx_read(struct mspack_file *file, void *buffer, int bytes) {
 }
 
 static int cabx_write(struct mspack_file *file, void *buffer, int bytes) {
+  uint64_t start;
+  int written;
+
+  if (!args.stats) return cabx_write_data(file, buffer, bytes);
+  start = stats_clock();
+  written = cabx_write_data(file, buffer, bytes);
+  STATS_ADD(write_time, stats_clock() - start);
+  STATS_ADD(writes, 1);
+  if (written > 0) STATS_ADD(write_bytes, (off_t) written);
+  return written;
+}
+
+static int cabx_write_data(struct mspack_file *file, void *buffer,
+                           int bytes)
+{
   struct mspack_file_p *this = (struct mspack_file_p *) file;
   if (this && buffer && bytes >= 0) {
+    /* --dedup hashes a long file that could be a copy as it's written */
+    if (dedup.hashing && this->name == output_name) {
+      digest_update(&dedup.digest, buffer, (size_t) bytes);
+    }
     if (this->name == TEST_FNAME) {
-      md5_process_bytes(buffer, (size_t) bytes, &md5_context);
+      if (this->batch) return batch_write(this->batch, buffer, bytes);
+#if HAVE_PTHREAD_H
+      if (!this->digest && hashq.running) {
+        hashq_write(buffer, (size_t) bytes);
+        return bytes;
+      }
+#endif
+      digest_update(this->digest, buffer, (size_t) bytes);
+      return bytes;
+    }
+    else if (this->name == DEDUP_FNAME) {
+      if (dedup.used + (size_t) bytes > dedup.size) return -1;
+      memcpy(&dedup.buf[dedup.used], buffer, (size_t) bytes);
+      dedup.used += (size_t) bytes;
       return bytes;
     }
+    else if (this->name == UPDATE_FNAME) {
+      return update_write(buffer, bytes);
+    }
+#if USE_OUTPUT_FD
+    else if (this->output) {
+      return output_write(buffer, bytes);
+    }
+#endif
     else {
       /* regular files and the stdout writer */
       size_t count = fwrite(buffer, 1, (size_t) bytes, this->fh);
+      if (this->name == STDOUT_FNAME) stdout_written += (off_t) count;
       if (!ferror(this->fh)) return (int) count;
     }
   }
@@ -1263,6 +5595,7 @@ static int cabx_seek(struct mspack_file *file, off_t offset, int mode) {
     return cabxbuf_seek(offset, mode);
   }
   if (this && this->regular_file) {
+    STATS_ADD(seeks, 1);
     switch (mode) {
     case MSPACK_SYS_SEEK_START: mode = SEEK_SET; break;
     case MSPACK_SYS_SEEK_CUR:   mode = SEEK_CUR; break;
@@ -1312,128 +5645,385 @@ static void cabx_copy(void *src, void *dest, size_t bytes) {
   memcpy(dest, src, bytes);
 }
 
+/**
+ * Copies bytes from a cabinet file to the file being extracted to disk
+ * with copy_file_range(), so they aren't read into memory, and may even
+ * be shared by both files if the file system allows it. Other files, and
+ * files the kernel can't copy between, are left to be read and written.
+ */
+static off_t cabx_transfer(struct mspack_file *input,
+                           struct mspack_file *out, off_t bytes)
+{
+#if HAVE_COPY_FILE_RANGE && USE_OUTPUT_FD
+  struct mspack_file_p *in = (struct mspack_file_p *) input;
+  struct output_file *f = output.file;
+  off_t copied = 0;
+  loff_t inoff, outoff;
+  ssize_t n;
+
+  if (!in || !in->regular_file || !out || !f || output.no_transfer ||
+      !((struct mspack_file_p *) out)->output || output.direct ||
+      args.sparse || dedup.hashing)
+  {
+    return 0;
+  }
+
+  /* everything written so far must come first */
+  if (output_flush()) {
+    f->reported = 1;
+    return -1;
+  }
+# if HAVE_FSEEKO
+  inoff = (loff_t) ftello(in->fh);
+# else
+  inoff = (loff_t) ftell(in->fh);
+# endif
+  if (inoff < 0) return 0;
+  outoff = (loff_t) output.offset;
+
+  while (copied < bytes) {
+    STATS_ADD(copies, 1);
+    n = copy_file_range(fileno(in->fh), &inoff, f->fd, &outoff,
+                        (size_t) (bytes - copied), 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+          errno == EOPNOTSUPP || errno == EBADF)
+      {
+        /* the kernel can't copy between these files */
+        output.no_transfer = 1;
+        break;
+      }
+      f->error = errno;
+      f->reported = 1;
+      return -1;
+    }
+    if (n == 0) break;
+    copied += n;
+  }
+  output.offset += copied;
+  if (output.offset > f->data_end) f->data_end = output.offset;
+
+  /* move the input file past what was copied */
+# if HAVE_FSEEKO
+  if (fseeko(in->fh, (off_t) inoff, SEEK_SET)) return -1;
+# else
+  if (fseek(in->fh, (long) inoff, SEEK_SET)) return -1;
+# endif
+  return copied;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Opens stdin. Normally, all of stdin is read with cabxbuf_load(), so the
+ * cabinets in it can be read with seeks. In streaming mode, stdin is only
+ * read as far as it is needed; everything read so far is kept until
+ * cabxbuf_commit() is called. Calling this again after stdin has been
+ * opened does nothing.
+ *
+ * @param fh     the stdin file handle
+ * @param stream non-zero to read stdin on demand
+ * @return 0 for success, or -1 if stdin can't be read or stored
+ */
+int
+cabxbuf_open(FILE *fh, int stream)
+{
+  if (g_cabxbuf.open)
+    return 0;
+
+  memset(&g_cabxbuf, 0, sizeof(g_cabxbuf));
+  g_cabxbuf.in = fh;
+  g_cabxbuf.open = 1;
+  g_cabxbuf.stream = 1;
+  g_cabxbuf.keep = 1;
+  return stream ? 0 : cabxbuf_load();
+}
+
+/**
+ * Reads the rest of stdin, adding it to anything already read by
+ * streaming. It is kept in one contiguous buffer, which doubles in size as
+ * needed. Once stdin grows beyond CABXBUF_MEMMAX bytes, it is spooled to
+ * an unlinked temporary file instead, which is memory-mapped when all of
+ * stdin has been read. Streaming stops, so stdin can be read with seeks.
+ *
+ * @return 0 for success, or -1 if stdin can't be read or stored, or if
+ *         streaming has already discarded the start of stdin
+ */
 int
-cabxbuf_open(FILE *fh)
+cabxbuf_load()
 {
-  size_t total = 0;
-  cabx_data_t *data, *pdata;
+  FILE *fh = g_cabxbuf.in;
+  unsigned char *data;
+  size_t len;
 
-  if (g_cabxbuf.head != NULL)
+  if (!g_cabxbuf.stream)
     return 0;
+  if (g_cabxbuf.base != 0)
+    return -1;
+
+  g_cabxbuf.stream = 0;
+  for (;;) {
+    /* make room for the next read */
+    if (g_cabxbuf.size == g_cabxbuf.alloc && !g_cabxbuf.spool) {
+      if (g_cabxbuf.alloc >= CABXBUF_MEMMAX &&
+          (g_cabxbuf.spool = tmpfile()))
+      {
+        if (fwrite(g_cabxbuf.data, 1, g_cabxbuf.size, g_cabxbuf.spool)
+            != g_cabxbuf.size)
+        {
+          perror("stdin spool file");
+          cabxbuf_close();
+          return -1;
+        }
+        free(g_cabxbuf.data);
+        g_cabxbuf.data = NULL;
+        g_cabxbuf.alloc = CABXBUF_CHUNK;
+        if (!(g_cabxbuf.data = malloc(g_cabxbuf.alloc))) {
+          cabxbuf_close();
+          return -1;
+        }
+      }
+      else {
+        len = g_cabxbuf.alloc ? g_cabxbuf.alloc * 2 : CABXBUF_CHUNK;
+        if (!(data = realloc(g_cabxbuf.data, len))) {
+          cabxbuf_close();
+          return -1;
+        }
+        g_cabxbuf.data = data;
+        g_cabxbuf.alloc = len;
+      }
+    }
+
+    /* fill the buffer, or copy through it to the spool file */
+    if (g_cabxbuf.spool) {
+      if (!(len = fread(g_cabxbuf.data, 1, g_cabxbuf.alloc, fh))) break;
+      if (fwrite(g_cabxbuf.data, 1, len, g_cabxbuf.spool) != len) {
+        perror("stdin spool file");
+        cabxbuf_close();
+        return -1;
+      }
+    }
+    else {
+      len = fread(&g_cabxbuf.data[g_cabxbuf.size], 1,
+                  g_cabxbuf.alloc - g_cabxbuf.size, fh);
+      if (!len) break;
+    }
+    g_cabxbuf.size += len;
+  }
 
-  for(;;) {
-    data = malloc(sizeof(cabx_data_t));
-    if (data == NULL) {
+  if (ferror(fh)) {
+    perror("stdin");
+    cabxbuf_close();
+    return -1;
+  }
+  debug("cabxbuf_load: size=%ld spooled=%d\n", (long) g_cabxbuf.size,
+        g_cabxbuf.spool != NULL);
+
+  /* map the spool file, otherwise it is read with fseek() and fread() */
+  if (g_cabxbuf.spool) {
+    free(g_cabxbuf.data);
+    g_cabxbuf.data = NULL;
+    if (fflush(g_cabxbuf.spool)) {
+      perror("stdin spool file");
       cabxbuf_close();
       return -1;
     }
-    memset(data, 0, sizeof(cabx_data_t));
-    data->len = fread(data->data, 1, DATA_SIZE, fh);
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+    data = mmap(NULL, g_cabxbuf.size, PROT_READ, MAP_PRIVATE,
+                fileno(g_cabxbuf.spool), 0);
+    if (data != MAP_FAILED) {
+      g_cabxbuf.data = data;
+      g_cabxbuf.mapped = 1;
+    }
+#endif
+  }
+  return 0;
+}
+
+/**
+ * When streaming, reads stdin until the buffer reaches the given offset or
+ * stdin ends. Unless cabxbuf_open() is still keeping everything, the bytes
+ * before the current read offset are discarded first, so the buffer only
+ * ever holds what is being read plus one chunk.
+ *
+ * @param upto the offset in stdin that should be buffered
+ * @return 0 for success, or -1 if stdin can't be read
+ */
+static int
+cabxbuf_fill(off_t upto)
+{
+  unsigned char *data;
+  size_t len;
+
+  while (g_cabxbuf.base + (off_t) g_cabxbuf.size < upto && !g_cabxbuf.eof) {
+    /* discard everything before the read offset */
+    if (!g_cabxbuf.keep && g_cabxbuf.offset > g_cabxbuf.base) {
+      len = g_cabxbuf.size;
+      if (g_cabxbuf.offset - g_cabxbuf.base < (off_t) len) {
+        len = (size_t) (g_cabxbuf.offset - g_cabxbuf.base);
+      }
+      memmove(g_cabxbuf.data, &g_cabxbuf.data[len], g_cabxbuf.size - len);
+      g_cabxbuf.size -= len;
+      g_cabxbuf.base += len;
+    }
 
-    debug("cabxbuf_open: len=%d\n", data->len);
+    /* make room for at least one more chunk */
+    if (g_cabxbuf.alloc - g_cabxbuf.size < CABXBUF_CHUNK) {
+      len = g_cabxbuf.alloc ? g_cabxbuf.alloc * 2 : CABXBUF_CHUNK;
+      while (len - g_cabxbuf.size < CABXBUF_CHUNK) len *= 2;
+      if (!(data = realloc(g_cabxbuf.data, len))) return -1;
+      g_cabxbuf.data = data;
+      g_cabxbuf.alloc = len;
+    }
 
-    total += data->len;
-    if (g_cabxbuf.head == NULL)
-      g_cabxbuf.head = data;
-    else 
-      pdata->next = data;
-    if (data->len < DATA_SIZE)
-      break;
-    pdata = data;
+    len = fread(&g_cabxbuf.data[g_cabxbuf.size], 1,
+                g_cabxbuf.alloc - g_cabxbuf.size, g_cabxbuf.in);
+    if (!len) {
+      if (ferror(g_cabxbuf.in)) {
+        perror("stdin");
+        return -1;
+      }
+      g_cabxbuf.eof = 1;
+    }
+    g_cabxbuf.size += len;
   }
-  g_cabxbuf.size = total;
-  g_cabxbuf.offset = 0;
-  g_cabxbuf.current = g_cabxbuf.head;
   return 0;
 }
 
+/**
+ * Stops keeping everything read from stdin while streaming. From now on,
+ * stdin can only be read forwards.
+ */
 void
-cabxbuf_close()
+cabxbuf_commit()
 {
-  if (g_cabxbuf.head == NULL)
-    return;
+  g_cabxbuf.keep = 0;
+}
 
-  cabx_data_t *data, *next;
-  data = g_cabxbuf.head;
-  for(;;) {
-    if (data->next == NULL)
-      break;
-    next = data->next;
-    free(data);
-    data = next;
+/**
+ * Frees the copy of stdin made by cabxbuf_open().
+ */
+void
+cabxbuf_close()
+{
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+  if (g_cabxbuf.mapped) {
+    munmap(g_cabxbuf.data, g_cabxbuf.size);
+    g_cabxbuf.data = NULL;
   }
+#endif
+  free(g_cabxbuf.data);
+  if (g_cabxbuf.spool) fclose(g_cabxbuf.spool);
+  memset(&g_cabxbuf, 0, sizeof(g_cabxbuf));
 }
 
+/**
+ * Reads from the copy of stdin made by cabxbuf_open().
+ *
+ * @param buf   the buffer to read into
+ * @param bytes the number of bytes to read
+ * @return the number of bytes read, which is less than bytes at the end
+ *         of stdin, or -1 for an error
+ */
 int
 cabxbuf_read(void *buf, int bytes)
 {
-  volatile off_t current;
-  int tmpsize = bytes, readsize, total = 0;
-  void *pos = buf;
-  cabx_data_t *data = g_cabxbuf.current;
-
-  current = g_cabxbuf.offset % DATA_SIZE;
-  debug("read start:current=%d, data='%s'\n", 
-      (int)current, (char *)data->data);
-
-  while (tmpsize > 0 && data != NULL) {
-    if (current + tmpsize >= data->len) {
-      readsize = data->len - current;
-    } else {
-      readsize = tmpsize < data->len ? tmpsize : data->len;
+  size_t len;
+
+  if (bytes < 0) return -1;
+
+  if (g_cabxbuf.stream) {
+    /* data already discarded can't be read again */
+    if (g_cabxbuf.offset < g_cabxbuf.base) {
+      errno = ESPIPE;
+      return -1;
     }
-    memcpy(pos, (void *)data->data + current, (size_t)readsize);
-    if (current + tmpsize >= data->len) {
-      current = 0;
-      data = data->next;
+    if (cabxbuf_fill(g_cabxbuf.offset + bytes)) return -1;
+    if (g_cabxbuf.offset >= g_cabxbuf.base + (off_t) g_cabxbuf.size) {
+      return 0;
     }
-    tmpsize -= readsize;
-    pos += readsize;
-    total += readsize;
+    len = (size_t) (g_cabxbuf.base + (off_t) g_cabxbuf.size
+                    - g_cabxbuf.offset);
+    if (len > (size_t) bytes) len = (size_t) bytes;
+    memcpy(buf, &g_cabxbuf.data[g_cabxbuf.offset - g_cabxbuf.base], len);
+    g_cabxbuf.offset += len;
+    return (int) len;
+  }
+
+  if (g_cabxbuf.offset >= (off_t) g_cabxbuf.size) return 0;
+
+  len = g_cabxbuf.size - (size_t) g_cabxbuf.offset;
+  if (len > (size_t) bytes) len = (size_t) bytes;
+
+  if (g_cabxbuf.data) {
+    memcpy(buf, &g_cabxbuf.data[g_cabxbuf.offset], len);
+  }
+  else {
+#if HAVE_FSEEKO
+    if (fseeko(g_cabxbuf.spool, g_cabxbuf.offset, SEEK_SET)) return -1;
+#else
+    if (fseek(g_cabxbuf.spool, g_cabxbuf.offset, SEEK_SET)) return -1;
+#endif
+    if (fread(buf, 1, len, g_cabxbuf.spool) != len) return -1;
   }
-  g_cabxbuf.offset += total;
-  g_cabxbuf.current = data;
-  debug("read end:%d:%d:%d\n", bytes, tmpsize, total);
-  return total;
+  g_cabxbuf.offset += len;
+  return (int) len;
 }
 
+/**
+ * Seeks within the copy of stdin made by cabxbuf_open(). Seeking before
+ * the start or after the end of stdin goes to the start or the end. When
+ * streaming, seeking forwards is always possible, but seeking to the end
+ * reads (and if committed, discards) all of stdin.
+ *
+ * @param offset the offset to seek to
+ * @param mode   MSPACK_SYS_SEEK_START, MSPACK_SYS_SEEK_CUR or
+ *               MSPACK_SYS_SEEK_END
+ * @return 0 for success, or -1 for an error
+ */
 int
 cabxbuf_seek(off_t offset, int mode)
 {
-  off_t count, rest;
-  cabx_data_t *data;
   switch (mode) {
-    case SEEK_SET: 
-      break;
-    case SEEK_CUR:
-      offset += g_cabxbuf.offset;
-      break;
-    case SEEK_END:
-      offset = g_cabxbuf.size;
-      break;
-    default: return -1;
+  case MSPACK_SYS_SEEK_START: break;
+  case MSPACK_SYS_SEEK_CUR:   offset += g_cabxbuf.offset; break;
+  case MSPACK_SYS_SEEK_END:
+    if (g_cabxbuf.stream) {
+      while (!g_cabxbuf.eof) {
+        if (!g_cabxbuf.keep) {
+          g_cabxbuf.offset = g_cabxbuf.base + (off_t) g_cabxbuf.size;
+        }
+        if (cabxbuf_fill(g_cabxbuf.base + (off_t) g_cabxbuf.size + 1)) {
+          return -1;
+        }
+      }
+      offset += g_cabxbuf.base;
+    }
+    offset += (off_t) g_cabxbuf.size;
+    break;
+  default: return -1;
+  }
+  if (offset < 0) offset = 0;
+  if (g_cabxbuf.stream) {
+    if (g_cabxbuf.eof && offset > g_cabxbuf.base + (off_t) g_cabxbuf.size) {
+      offset = g_cabxbuf.base + (off_t) g_cabxbuf.size;
+    }
+  }
+  else if (offset > (off_t) g_cabxbuf.size) {
+    offset = (off_t) g_cabxbuf.size;
   }
-  if (offset <= 0) {
-    offset = 0;
-    data = g_cabxbuf.head;
-  } else if (offset >= g_cabxbuf.size) {
-    offset = g_cabxbuf.size;
-    data = g_cabxbuf.head;
-    while (data->next != NULL)
-      data = data->next;
-  } else {
-    count = offset / DATA_SIZE;
-    data = g_cabxbuf.head;
-
-    while (count-- > 0)
-      data = data->next;
-  }
-  g_cabxbuf.current = data;
   g_cabxbuf.offset = offset;
   return 0;
 }
 
-int
+/**
+ * Returns the current offset within the copy of stdin.
+ *
+ * @return the current offset
+ */
+off_t
 cabxbuf_tell()
 {
   return g_cabxbuf.offset;
@@ -33,6 +33,13 @@
 # include <strings.h>
 #endif
 
+#if !defined(MSPACK_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && \
+     ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+# define CABINFO_SIMD 1
+# include <immintrin.h>
+#endif
+
 #ifdef HAVE_FSEEKO
 # define FSEEK fseeko
 # define FTELL ftello
@@ -179,12 +186,73 @@ int main(int argc, char *argv[]) {
 #define SEARCH_SIZE (32*1024)
 unsigned char search_buf[SEARCH_SIZE];
 
+/* signature scanners: return a pointer to the first 'MSCF' between p and
+ * pend, or to a partial 'M', 'MS' or 'MSC' at the very end of the buffer,
+ * or pend if there is neither. The SSE2 and AVX2 versions test 16 or 32
+ * positions at once and leave the end of the buffer to scan_sig() */
+unsigned char *scan_sig(unsigned char *p, unsigned char *pend) {
+  for (; p < pend; p++) {
+    if (!(p = memchr(p, 0x4D, (size_t) (pend - p)))) break;
+    if ((p + 1 >= pend || p[1] == 0x53) &&
+	(p + 2 >= pend || p[2] == 0x43) &&
+	(p + 3 >= pend || p[3] == 0x46)) return p;
+  }
+  return pend;
+}
+
+#ifdef CABINFO_SIMD
+__attribute__((target("sse2")))
+unsigned char *scan_sig_sse2(unsigned char *p, unsigned char *pend) {
+  const __m128i m = _mm_set1_epi8(0x4D), s = _mm_set1_epi8(0x53);
+  const __m128i c = _mm_set1_epi8(0x43), f = _mm_set1_epi8(0x46);
+  __m128i v0, v1, v2, v3;
+  unsigned int mask;
+  for (; (pend - p) >= 19; p += 16) {
+    v0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[0]), m);
+    v1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[1]), s);
+    v2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[2]), c);
+    v3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &p[3]), f);
+    v0 = _mm_and_si128(_mm_and_si128(v0, v1), _mm_and_si128(v2, v3));
+    if ((mask = (unsigned int) _mm_movemask_epi8(v0))) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return scan_sig(p, pend);
+}
+
+__attribute__((target("avx2")))
+unsigned char *scan_sig_avx2(unsigned char *p, unsigned char *pend) {
+  const __m256i m = _mm256_set1_epi8(0x4D), s = _mm256_set1_epi8(0x53);
+  const __m256i c = _mm256_set1_epi8(0x43), f = _mm256_set1_epi8(0x46);
+  __m256i v0, v1, v2, v3;
+  unsigned int mask;
+  for (; (pend - p) >= 35; p += 32) {
+    v0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[0]), m);
+    v1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[1]), s);
+    v2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[2]), c);
+    v3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &p[3]), f);
+    v0 = _mm256_and_si256(_mm256_and_si256(v0, v1), _mm256_and_si256(v2, v3));
+    if ((mask = (unsigned int) _mm256_movemask_epi8(v0))) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return scan_sig_sse2(p, pend);
+}
+#endif
+
 void search() {
   unsigned char *pstart = &search_buf[0], *pend, *p;
+  unsigned char *(*scan)(unsigned char *, unsigned char *) = &scan_sig;
   FILELEN offset, caboff, cablen, foffset, length;
   unsigned long cablen32, foffset32;
   int state = 0;
 
+#ifdef CABINFO_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) scan = &scan_sig_sse2;
+  if (__builtin_cpu_supports("avx2")) scan = &scan_sig_avx2;
+#endif
+
   for (offset = 0; offset < filelen; offset += length) {
     /* search length is either the full length of the search buffer,
      * or the amount of data remaining to the end of the file,
@@ -203,17 +271,30 @@ void search() {
       switch (state) {
 	/* starting state */
       case 0:
-	/* we spend most of our time in this while loop, looking for
-	 * a leading 'M' of the 'MSCF' signature
+	/* we spend most of our time in scan(), looking for the 'MSCF'
+	 * signature. If the whole header is in the buffer, read the
+	 * fields now and let state 19 validate them.
 	 */
-	while (*p++ != 0x4D && p < pend);
-	if (p < pend) state = 1; /* if we found tht 'M', advance state */
+	p = scan(p, pend);
+	if (p >= pend) break;
+	if ((pend - p) >= 20) {
+	  cablen32  = EndGetI32(&p[8]);
+	  foffset32 = p[16] | (p[17] << 8) | (p[18] << 16);
+	  p += 19;
+	  state = 19;
+	}
+	else {
+	  p++;
+	  state = 1;
+	}
 	break;
 	
-	/* verify that the next 3 bytes are 'S', 'C' and 'F' */
-      case 1: state = (*p++ == 0x53) ? 2 : 0; break;
-      case 2: state = (*p++ == 0x43) ? 3 : 0; break;
-      case 3: state = (*p++ == 0x46) ? 4 : 0; break;
+	/* verify that the next 3 bytes are 'S', 'C' and 'F'. On a
+	 * mismatch, don't consume the byte, it may be an 'M'
+	 */
+      case 1: if (*p == 0x53) p++, state = 2; else state = 0; break;
+      case 2: if (*p == 0x43) p++, state = 3; else state = 0; break;
+      case 3: if (*p == 0x46) p++, state = 4; else state = 0; break;
 	
 	/* we don't care about bytes 4-7 */
 	/* bytes 8-11 are the overall length of the cabinet */